@@ -0,0 +1,100 @@
+/*
+* allocbench.c -- compares buildsh's slab allocator (src/balloc.c) with
+* a plain realloc/free based allocator (i.e. glibc malloc on Linux) on
+* a workload similar to parsing syscall traces, with the garbage
+* collector driven like in buildsh (src/jobs.lua): stopped while a
+* trace is parsed, and a full collection whenever the heap has doubled.
+* Usage: allocbench [rounds]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "balloc.h"
+
+static const char workload[] =
+ "local rounds = ...\n"
+ "local store = {}\n"
+ "local base = collectgarbage( 'count' )\n"
+ "for r = 1, rounds do\n"
+ "  collectgarbage( 'stop' )\n"
+ "  -- generate a trace log\n"
+ "  local lines = {}\n"
+ "  for i = 1, 2000 do\n"
+ "    lines[ #lines+1 ] = ('%d open(\"src/dir%d/file%d.c\", O_RDONLY) = %d')\n"
+ "                        :format( 1000+r, i % 17, i % 301, i % 20 )\n"
+ "  end\n"
+ "  -- parse it\n"
+ "  local pdata, deps = {}, { input = {}, output = {} }\n"
+ "  for _,l in ipairs( lines ) do\n"
+ "    local pid, call, path, rv = l:match( '^(%d+) (%w+)%(\"([^\"]*)\".-= (%-?%d+)' )\n"
+ "    local p = pdata[ pid ] or { cwd = '.', fds = {} }\n"
+ "    pdata[ pid ] = p\n"
+ "    p.fds[ tonumber( rv ) ] = path\n"
+ "    deps.input[ path ] = true\n"
+ "  end\n"
+ "  -- keep a few records around like the dependency store does\n"
+ "  store[ r % 50 ] = deps\n"
+ "  collectgarbage( 'restart' )\n"
+ "  if collectgarbage( 'count' ) >= 2 * base then\n"
+ "    collectgarbage( 'collect' )\n"
+ "    base = collectgarbage( 'count' )\n"
+ "  end\n"
+ "end\n";
+
+static void *plain_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  (void)ud; (void)osize;
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, nsize);
+}
+
+static double run (lua_State *L, int rounds) {
+  clock_t start;
+  luaL_openlibs(L);
+  if (luaL_loadbuffer(L, workload, sizeof(workload)-1, "=workload")) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    exit(EXIT_FAILURE);
+  }
+  lua_pushinteger(L, rounds);
+  start = clock();
+  if (lua_pcall(L, 1, 0, 0)) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    exit(EXIT_FAILURE);
+  }
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main (int argc, char *argv[]) {
+  int rounds = argc > 1 ? atoi(argv[1]) : 200;
+  lua_State *L;
+  balloc *a;
+  balloc_stats st;
+  double t;
+
+  L = lua_newstate(plain_alloc, NULL);
+  t = run(L, rounds);
+  lua_close(L);
+  printf("realloc: %.3fs\n", t);
+
+  a = balloc_new();
+  L = lua_newstate(balloc_alloc, a);
+  t = run(L, rounds);
+  balloc_getstats(a, &st);
+  lua_close(L);
+  balloc_delete(a);
+  printf("balloc:  %.3fs\n", t);
+  printf("  %lu allocs, %lu frees, %lu reallocs, %lu large\n",
+         st.allocs, st.frees, st.reallocs, st.large_allocs);
+  printf("  peak %lu bytes, %lu slabs left, %lu slabs released\n",
+         (unsigned long)st.peak_bytes, (unsigned long)st.slabs,
+         (unsigned long)st.slabs_freed);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+/*
+* poolbench.c -- measures the per-call overhead of the scratch pool
+* used by ape functions without a pool argument (src/ape_pool.c): a
+* pool that is cleared before every call, once with the global
+* allocator limited to 32 bytes of free memory (the old setup), and
+* once with a separate allocator that keeps up to 1 MiB.
+* Usage: poolbench [calls]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "apr_general.h"
+#include "apr_pools.h"
+#include "apr_allocator.h"
+#include "apr_strings.h"
+#include "apr_file_info.h"
+
+static const char *parts[] = { "src", "lib/dir", "../include", "x.c" };
+
+/* roughly what a filepath_merge/find_exec call allocates */
+static void work (apr_pool_t *pool, int i) {
+  char *path = NULL;
+  apr_filepath_merge(&path, parts[i % 2], parts[2 + i % 2],
+                     APR_FILEPATH_NATIVE, pool);
+  (void)apr_pstrcat(pool, path, "/", parts[i % 4], NULL);
+  (void)apr_palloc(pool, 16 * 1024);
+}
+
+static double run (apr_pool_t *pool, long calls) {
+  clock_t start = clock();
+  long i;
+  for (i = 0; i < calls; i++) {
+    apr_pool_clear(pool);
+    work(pool, (int)i);
+  }
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+int main (int argc, char *argv[]) {
+  long calls = argc > 1 ? atol(argv[1]) : 1000000;
+  apr_pool_t *pool = NULL;
+  apr_allocator_t *allocator = NULL;
+  double t;
+
+  apr_initialize();
+
+  /* old: top-level pool, global allocator keeps (almost) nothing */
+  apr_pool_create(&pool, NULL);
+  apr_allocator_max_free_set(apr_pool_allocator_get(pool), 32);
+  t = run(pool, calls);
+  apr_pool_destroy(pool);
+  printf("max_free 32:     %.3fs (%.0f ns/call)\n", t, t * 1e9 / calls);
+
+  /* new: separate allocator with a bounded free list */
+  apr_allocator_create(&allocator);
+  apr_pool_create_ex(&pool, NULL, NULL, allocator);
+  apr_allocator_owner_set(allocator, pool);
+  apr_allocator_max_free_set(allocator, 1024 * 1024);
+  t = run(pool, calls);
+  apr_pool_destroy(pool);
+  printf("scratch (1 MiB): %.3fs (%.0f ns/call)\n", t, t * 1e9 / calls);
+
+  apr_terminate();
+  return EXIT_SUCCESS;
+}
@@ -36,6 +36,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <spawn.h>
+#include <sched.h>
 
 
 /* open a log file for writing */
@@ -57,6 +59,16 @@ static int write_all( int fd, void const* buf, size_t len );
       write_all( (fd), _buf, _ret ); \
   } while( 0 )
 
+/* write the pid and the parent pid of the current process, so that
+ * the log consumer can attribute the events of a process even if it
+ * hasn't seen the process being created */
+#define write_pid( fd ) \
+  do { \
+    write_int( (fd), "%d", getpid() ); \
+    write_literal( (fd), "/" ); \
+    write_int( (fd), "%d", getppid() ); \
+  } while( 0 )
+
 /* write a string using hex escapes */
 static int write_name( int fd, char const* s );
 
@@ -95,13 +107,24 @@ static int (*orig_renameat) ( int, char const*, int, char const* ) = 0;
 static pid_t (*orig_fork)( void ) = 0;
 static int (*orig_execve)( char const*, char* const*, char* const* ) = 0;
 static int (*orig_execvpe)( char const*, char* const*, char* const* ) = 0;
-
-
-/* TODO:
- *  clone?
- *  posix_spawn?
- *
- */
+static int (*orig_posix_spawn)( pid_t*, char const*,
+                                posix_spawn_file_actions_t const*,
+                                posix_spawnattr_t const*, char* const*,
+                                char* const* ) = 0;
+static int (*orig_posix_spawnp)( pid_t*, char const*,
+                                 posix_spawn_file_actions_t const*,
+                                 posix_spawnattr_t const*, char* const*,
+                                 char* const* ) = 0;
+static int (*orig_clone)( int (*)( void* ), void*, int, void*, ... ) = 0;
+/* not available in older C libraries */
+static int (*orig_execveat)( int, char const*, char* const*, char* const*,
+                             int ) = 0;
+static int (*orig_fexecve)( int, char* const*, char* const* ) = 0;
+
+/* clone3 has no C library wrapper (the C library only uses it
+ * internally for posix_spawn and threads), so processes created by
+ * direct clone3 system calls can't be intercepted here. Their events
+ * are still tagged with the parent pid, though. */
 
 /* init functions for the orig function pointers above */
 def_init( fopen )
@@ -118,6 +141,44 @@ def_init( renameat )
 def_init( fork )
 def_init( execve )
 def_init( execvpe )
+def_init( posix_spawn )
+def_init( posix_spawnp )
+def_init( clone )
+
+/* define an init function for an optional function pointer */
+#define def_init_opt( f ) \
+  static int init_##f( void ) { \
+    if( !orig_##f ) \
+      orig_##f = dlsym( RTLD_NEXT, #f ); \
+    return orig_##f != 0; \
+  }
+
+def_init_opt( execveat )
+def_init_opt( fexecve )
+
+
+/* failed lookups of files to read are logged, because the command
+ * must run again if such a file shows up later */
+static int is_missing( int err ) {
+  return err == ENOENT || err == ENOTDIR;
+}
+
+static void log_missing( int dirfd, char const* file ) {
+  int fd = open_log_file();
+  if( fd >= 0 && my_lock( fd ) ) {
+    write_pid( fd );
+    if( dirfd == AT_FDCWD )
+      write_literal( fd, " missing " );
+    else {
+      write_literal( fd, " missingat " );
+      write_int( fd, "%d", dirfd );
+      write_literal( fd, " " );
+    }
+    write_name( fd, file );
+    write_literal( fd, "\n" );
+    my_unlock( fd );
+  }
+}
 
 
 static FILE* my_fopen( char const* file, char const* mode ) {
@@ -133,7 +194,7 @@ static FILE* my_fopen( char const* file, char const* mode ) {
   if( retval != NULL ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " open " );
       write_name( fd, file );
       if( mode[ 0 ] == 'r' && !strchr( mode, '+' ) )
@@ -144,7 +205,9 @@ static FILE* my_fopen( char const* file, char const* mode ) {
       write_literal( fd, "\n" );
       my_unlock( fd );
     }
-  }
+  } else if( is_missing( myerrno ) && mode[ 0 ] == 'r' &&
+             !strchr( mode, '+' ) )
+    log_missing( AT_FDCWD, file );
 
   /* restore errno and return */
   errno = myerrno;
@@ -168,7 +231,7 @@ static DIR* my_opendir( char const* name ) {
   if( retval != NULL ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " open " );
       write_name( fd, name );
       write_literal( fd, " in " );
@@ -186,6 +249,110 @@ static DIR* my_opendir( char const* name ) {
 DIR* opendir( char const* name ) __attribute__((__alias__("my_opendir")));
 
 
+/* successful lookups of file metadata are logged as probes: the
+ * command depends on the existence and type of the file, but not
+ * necessarily on its contents. Failed lookups are logged as missing
+ * files like for open. */
+static void log_probe( int dirfd, char const* file, int ok, int err ) {
+  if( file == NULL || *file == '\0' ) /* e.g. AT_EMPTY_PATH */
+    return;
+  if( ok ) {
+    int fd = open_log_file();
+    if( fd >= 0 && my_lock( fd ) ) {
+      write_pid( fd );
+      if( dirfd == AT_FDCWD )
+        write_literal( fd, " probe " );
+      else {
+        write_literal( fd, " probeat " );
+        write_int( fd, "%d", dirfd );
+        write_literal( fd, " " );
+      }
+      write_name( fd, file );
+      write_literal( fd, "\n" );
+      my_unlock( fd );
+    }
+  } else if( is_missing( err ) )
+    log_missing( dirfd, file );
+}
+
+/* Not all of the following functions exist in every C library (e.g.
+ * glibc before 2.33 implements stat via __xstat, newer versions only
+ * keep __xstat for old binaries), so the original functions are looked
+ * up on demand, and a missing one fails with ENOSYS. */
+#define def_probe( rt, f, params, args, dirfd, file, ok ) \
+  static rt (*orig_##f) params = 0; \
+  def_init_opt( f ) \
+  static rt my_##f params { \
+    rt retval = -1; \
+    int myerrno = 0; \
+    if( !init_##f() ) { \
+      errno = ENOSYS; \
+      return -1; \
+    } \
+    retval = orig_##f args; \
+    myerrno = errno; \
+    log_probe( (dirfd), (file), (ok), myerrno ); \
+    errno = myerrno; \
+    return retval; \
+  } \
+  rt f params __attribute__((__alias__("my_" #f)));
+
+def_probe( int, stat, ( char const* file, struct stat* buf ),
+           ( file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, stat64, ( char const* file, struct stat64* buf ),
+           ( file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, lstat, ( char const* file, struct stat* buf ),
+           ( file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, lstat64, ( char const* file, struct stat64* buf ),
+           ( file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, fstatat,
+           ( int dirfd, char const* file, struct stat* buf, int flags ),
+           ( dirfd, file, buf, flags ), dirfd, file, retval == 0 )
+def_probe( int, fstatat64,
+           ( int dirfd, char const* file, struct stat64* buf, int flags ),
+           ( dirfd, file, buf, flags ), dirfd, file, retval == 0 )
+def_probe( int, __xstat, ( int ver, char const* file, struct stat* buf ),
+           ( ver, file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, __xstat64,
+           ( int ver, char const* file, struct stat64* buf ),
+           ( ver, file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, __lxstat, ( int ver, char const* file, struct stat* buf ),
+           ( ver, file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, __lxstat64,
+           ( int ver, char const* file, struct stat64* buf ),
+           ( ver, file, buf ), AT_FDCWD, file, retval == 0 )
+def_probe( int, __fxstatat,
+           ( int ver, int dirfd, char const* file, struct stat* buf,
+             int flags ),
+           ( ver, dirfd, file, buf, flags ), dirfd, file, retval == 0 )
+def_probe( int, __fxstatat64,
+           ( int ver, int dirfd, char const* file, struct stat64* buf,
+             int flags ),
+           ( ver, dirfd, file, buf, flags ), dirfd, file, retval == 0 )
+#ifdef STATX_BASIC_STATS
+def_probe( int, statx,
+           ( int dirfd, char const* file, int flags, unsigned mask,
+             struct statx* buf ),
+           ( dirfd, file, flags, mask, buf ), dirfd, file, retval == 0 )
+#endif
+/* a denied access still means that the file exists */
+def_probe( int, access, ( char const* file, int mode ),
+           ( file, mode ), AT_FDCWD, file,
+           retval == 0 || myerrno == EACCES )
+def_probe( int, faccessat,
+           ( int dirfd, char const* file, int mode, int flags ),
+           ( dirfd, file, mode, flags ), dirfd, file,
+           retval == 0 || myerrno == EACCES )
+def_probe( int, euidaccess, ( char const* file, int mode ),
+           ( file, mode ), AT_FDCWD, file,
+           retval == 0 || myerrno == EACCES )
+def_probe( ssize_t, readlink, ( char const* file, char* buf, size_t len ),
+           ( file, buf, len ), AT_FDCWD, file, retval >= 0 )
+def_probe( ssize_t, readlinkat,
+           ( int dirfd, char const* file, char* buf, size_t len ),
+           ( dirfd, file, buf, len ), dirfd, file, retval >= 0 )
+
+
 static int my_open( char const* file, int oflags, ... ) {
   int retval = 0;
   int myerrno = 0;
@@ -208,7 +375,7 @@ static int my_open( char const* file, int oflags, ... ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " open " );
       write_name( fd, file );
       if( (oflags & O_WRONLY) || (oflags & O_RDWR) )
@@ -219,7 +386,9 @@ static int my_open( char const* file, int oflags, ... ) {
       write_literal( fd, "\n" );
       my_unlock( fd );
     }
-  }
+  } else if( is_missing( myerrno ) &&
+             !(oflags & (O_WRONLY|O_RDWR|O_CREAT)) )
+    log_missing( AT_FDCWD, file );
 
   /* restore errno and return */
   errno = myerrno;
@@ -254,7 +423,7 @@ static int my_openat( int dirfd, char const* file, int oflags, ... ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " openat " );
       if( dirfd == AT_FDCWD )
         write_literal( fd, "AT_FDCWD" );
@@ -270,7 +439,9 @@ static int my_openat( int dirfd, char const* file, int oflags, ... ) {
       write_literal( fd, "\n" );
       my_unlock( fd );
     }
-  }
+  } else if( is_missing( myerrno ) &&
+             !(oflags & (O_WRONLY|O_RDWR|O_CREAT)) )
+    log_missing( dirfd, file );
 
   /* restore errno and return */
   errno = myerrno;
@@ -296,7 +467,7 @@ static int my_creat( char const* file, mode_t mode ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " creat " );
       write_name( fd, file );
       write_all( fd, " ", 1 );
@@ -328,7 +499,7 @@ static int my_mkdir( char const* dir, mode_t mode ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " mkdir " );
       write_name( fd, dir );
       write_literal( fd, "\n" );
@@ -357,7 +528,7 @@ static int my_mkdirat( int dirfd, char const* dir, mode_t mode ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " mkdirat " );
       if( dirfd == AT_FDCWD )
         write_literal( fd, "AT_FDCWD" );
@@ -391,7 +562,7 @@ static int my_chdir( char const* dir ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " chdir " );
       write_name( fd, dir );
       write_literal( fd, "\n" );
@@ -420,7 +591,7 @@ static int my_fchdir( int dirfd ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " fchdir " );
       write_int( fd, "%d", dirfd );
       write_literal( fd, "\n" );
@@ -449,7 +620,7 @@ static int my_rename( char const* old, char const* newn ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " rename " );
       write_name( fd, old );
       write_literal( fd, " " );
@@ -480,7 +651,7 @@ static int my_renameat( int ofd, char const* old, int nfd, char const* newn ) {
   if( retval >= 0 ) {
     int fd = open_log_file();
     if( fd >= 0 && my_lock( fd ) ) {
-      write_int( fd, "%d", getpid() );
+      write_pid( fd );
       write_literal( fd, " renameat " );
       if( ofd == AT_FDCWD )
         write_literal( fd, "AT_FDCWD" );
@@ -525,10 +696,46 @@ static pid_t my_fork( void ) {
 }
 
 pid_t fork( void ) __attribute__((__alias__("my_fork")));
+/* the child of a vfork may only call exec or _exit, so a normal fork
+ * is fine (and the fork can be reported safely) */
 pid_t vfork( void ) __attribute__((__alias__("my_fork")));
 
 
+static int my_clone( int (*fn)( void* ), void* stack, int flags,
+                     void* arg, ... ) {
+  int retval = 0;
+  int myerrno = 0;
+  void* ptid = NULL;
+  void* tls = NULL;
+  void* ctid = NULL;
+  va_list ap;
+
+  init_clone();
+
+  /* the optional arguments are passed on unconditionally, clone
+   * ignores them unless the corresponding flags are set */
+  va_start( ap, arg );
+  ptid = va_arg( ap, void* );
+  tls = va_arg( ap, void* );
+  ctid = va_arg( ap, void* );
+  va_end( ap );
+  retval = orig_clone( fn, stack, flags, arg, ptid, tls, ctid );
+  myerrno = errno;
+
+  /* threads share the pid of the process */
+  if( retval > 0 && !(flags & CLONE_THREAD) )
+    report_fork( retval );
+
+  errno = myerrno;
+  return retval;
+}
+
+int clone( int (*)( void* ), void*, int, void*, ... ) __attribute__((__alias__("my_clone")));
+
+
 static void report_exec( char const* prog );
+static void report_execat( int dirfd, char const* prog );
+static void report_spawn( pid_t cpid, char const* prog );
 static char** clone_env( char* const* env, size_t*, size_t*, size_t*,
                          size_t*, size_t* );
 static void free_env( char**, size_t, size_t, size_t, size_t, size_t );
@@ -716,6 +923,132 @@ error:
 int execle( char const*, char const*, ... ) __attribute__((__alias__("my_execle")));
 
 
+static int my_execveat( int dirfd, char const* prog, char* const* argv,
+                        char* const* env, int flags ) {
+  int retval = -1;
+  char** new_env = NULL;
+  size_t ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos;
+  if( !init_execveat() ) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  /* do logging before actual call this time */
+  report_execat( dirfd, prog );
+
+  new_env = clone_env( env, &ldp_pos, &dil_pos, &dffns_pos, &lmtf_pos,
+                       &lmpl_pos );
+  if( new_env == NULL ) {
+    errno = ENOMEM;
+    goto error;
+  }
+
+  retval = orig_execveat( dirfd, prog, argv, new_env, flags );
+
+error:
+  free_env( new_env, ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos );
+  return retval;
+}
+
+int execveat( int, char const*, char* const*, char* const*, int ) __attribute__((__alias__("my_execveat")));
+
+
+static int my_fexecve( int pfd, char* const* argv, char* const* env ) {
+  int retval = -1;
+  char** new_env = NULL;
+  size_t ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos;
+  if( !init_fexecve() ) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  /* do logging before actual call this time */
+  report_execat( pfd, "" );
+
+  new_env = clone_env( env, &ldp_pos, &dil_pos, &dffns_pos, &lmtf_pos,
+                       &lmpl_pos );
+  if( new_env == NULL ) {
+    errno = ENOMEM;
+    goto error;
+  }
+
+  retval = orig_fexecve( pfd, argv, new_env );
+
+error:
+  free_env( new_env, ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos );
+  return retval;
+}
+
+int fexecve( int, char* const*, char* const* ) __attribute__((__alias__("my_fexecve")));
+
+
+/* posix_spawn returns an error code instead of setting errno */
+static int my_posix_spawn( pid_t* pid, char const* prog,
+                           posix_spawn_file_actions_t const* fa,
+                           posix_spawnattr_t const* attr,
+                           char* const* argv, char* const* env ) {
+  int retval = 0;
+  int myerrno = errno;
+  pid_t cpid = 0;
+  char** new_env = NULL;
+  size_t ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos;
+  init_posix_spawn();
+
+  new_env = clone_env( env != NULL ? env : environ, &ldp_pos, &dil_pos,
+                       &dffns_pos, &lmtf_pos, &lmpl_pos );
+  if( new_env == NULL )
+    return ENOMEM;
+
+  retval = orig_posix_spawn( &cpid, prog, fa, attr, argv, new_env );
+  free_env( new_env, ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos );
+
+  /* do logging for successful calls only! */
+  if( retval == 0 ) {
+    report_spawn( cpid, prog );
+    if( pid != NULL )
+      *pid = cpid;
+  }
+  errno = myerrno;
+  return retval;
+}
+
+int posix_spawn( pid_t*, char const*, posix_spawn_file_actions_t const*,
+                 posix_spawnattr_t const*, char* const*, char* const* ) __attribute__((__alias__("my_posix_spawn")));
+
+
+static int my_posix_spawnp( pid_t* pid, char const* prog,
+                            posix_spawn_file_actions_t const* fa,
+                            posix_spawnattr_t const* attr,
+                            char* const* argv, char* const* env ) {
+  int retval = 0;
+  int myerrno = errno;
+  pid_t cpid = 0;
+  char** new_env = NULL;
+  size_t ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos;
+  init_posix_spawnp();
+
+  new_env = clone_env( env != NULL ? env : environ, &ldp_pos, &dil_pos,
+                       &dffns_pos, &lmtf_pos, &lmpl_pos );
+  if( new_env == NULL )
+    return ENOMEM;
+
+  retval = orig_posix_spawnp( &cpid, prog, fa, attr, argv, new_env );
+  free_env( new_env, ldp_pos, dil_pos, dffns_pos, lmtf_pos, lmpl_pos );
+
+  /* do logging for successful calls only! */
+  if( retval == 0 ) {
+    report_spawn( cpid, prog );
+    if( pid != NULL )
+      *pid = cpid;
+  }
+  errno = myerrno;
+  return retval;
+}
+
+int posix_spawnp( pid_t*, char const*, posix_spawn_file_actions_t const*,
+                  posix_spawnattr_t const*, char* const*, char* const* ) __attribute__((__alias__("my_posix_spawnp")));
+
+
 
 /*
  * definition of the helper functions declared above
@@ -803,7 +1136,7 @@ static void report_fork( pid_t cpid ) {
   int myerrno = errno;
   int fd = open_log_file();
   if( fd >= 0 && my_lock( fd ) ) {
-    write_int( fd, "%d", getpid() );
+    write_pid( fd );
     write_literal( fd, " fork " );
     write_int( fd, "%d", cpid );
     write_literal( fd, "\n" );
@@ -815,6 +1148,41 @@ static void report_fork( pid_t cpid ) {
 static void report_exec( char const* prog ) {
   int fd = open_log_file();
   if( fd >= 0 && my_lock( fd ) ) {
+    write_pid( fd );
+    write_literal( fd, " exec " );
+    write_name( fd, prog );
+    write_literal( fd, "\n" );
+    my_unlock( fd );
+  }
+}
+
+static void report_execat( int dirfd, char const* prog ) {
+  int fd = open_log_file();
+  if( fd >= 0 && my_lock( fd ) ) {
+    write_pid( fd );
+    write_literal( fd, " execat " );
+    if( dirfd == AT_FDCWD )
+      write_literal( fd, "AT_FDCWD" );
+    else
+      write_int( fd, "%d", dirfd );
+    write_literal( fd, " " );
+    write_name( fd, prog );
+    write_literal( fd, "\n" );
+    my_unlock( fd );
+  }
+}
+
+/* the child of posix_spawn is reported by the parent: as a fork and
+ * as an exec in the child (tagged with the parent pid) */
+static void report_spawn( pid_t cpid, char const* prog ) {
+  int fd = open_log_file();
+  if( fd >= 0 && my_lock( fd ) ) {
+    write_pid( fd );
+    write_literal( fd, " fork " );
+    write_int( fd, "%d", cpid );
+    write_literal( fd, "\n" );
+    write_int( fd, "%d", cpid );
+    write_literal( fd, "/" );
     write_int( fd, "%d", getpid() );
     write_literal( fd, " exec " );
     write_name( fd, prog );
@@ -857,20 +1225,20 @@ static size_t scan_env( char* const* env, size_t* ldp_pos,
   *ldp_pos = *dil_pos = *dffns_pos = *lmtf_pos = *lmpl_pos = -1;
   /* count and remember positions for variables to replace */
   while( env[ n ] != NULL ) {
-    if( *ldp_pos != (size_t)-1 &&
-        !strncmp( env[ n ], LDP, sizeof( LDP ) ) )
+    if( *ldp_pos == (size_t)-1 &&
+        !strncmp( env[ n ], LDP, sizeof( LDP )-1 ) )
       *ldp_pos = n;
-    else if( *lmtf_pos != (size_t)-1 &&
-             !strncmp( env[ n ], LMTF, sizeof( LMTF ) ) )
+    else if( *lmtf_pos == (size_t)-1 &&
+             !strncmp( env[ n ], LMTF, sizeof( LMTF )-1 ) )
       *lmtf_pos = n;
-    else if( *lmpl_pos != (size_t)-1 &&
-             !strncmp( env[ n ], LMPL, sizeof( LMPL ) ) )
+    else if( *lmpl_pos == (size_t)-1 &&
+             !strncmp( env[ n ], LMPL, sizeof( LMPL )-1 ) )
       *lmpl_pos = n;
-    else if( *dil_pos != (size_t)-1 &&
-             !strncmp( env[ n ], DIL, sizeof( DIL ) ) )
+    else if( *dil_pos == (size_t)-1 &&
+             !strncmp( env[ n ], DIL, sizeof( DIL )-1 ) )
       *dil_pos = n;
-    else if( *dffns_pos != (size_t)-1 &&
-             !strncmp( env[ n ], DFFNS, sizeof( DFFNS ) ) )
+    else if( *dffns_pos == (size_t)-1 &&
+             !strncmp( env[ n ], DFFNS, sizeof( DFFNS )-1 ) )
       *dffns_pos = n;
     ++n;
   }
@@ -993,14 +1361,14 @@ static char** clone_env( char* const* env, size_t* ldp_pos,
       new_env[ i ] = env[ i ];
   }
   /* replace (or add) the important variables */
-  i = *dffns_pos != (size_t)-1 ? *dffns_pos : ++n;
+  i = *dffns_pos != (size_t)-1 ? *dffns_pos : n++;
   new_env[ i ] = dffns_default;
   *dffns_pos = -1; /* no need to free it later, it's static! */
   if( *lmtf_pos != (size_t)-1 )
     temp = env[ *lmtf_pos ];
   else {
     temp = NULL;
-    *lmtf_pos = ++n;
+    *lmtf_pos = n++;
   }
   if( !handle_lmtf( new_env, temp, lmtf_pos ) )
     goto error;
@@ -1008,7 +1376,7 @@ static char** clone_env( char* const* env, size_t* ldp_pos,
     temp = env[ *lmpl_pos ];
   else {
     temp = NULL;
-    *lmpl_pos = ++n;
+    *lmpl_pos = n++;
   }
   if( !handle_lmpl( new_env, temp, lmpl_pos ) )
     goto error;
@@ -1016,7 +1384,7 @@ static char** clone_env( char* const* env, size_t* ldp_pos,
     temp = env[ *ldp_pos ];
   else {
     temp = NULL;
-    *ldp_pos = ++n;
+    *ldp_pos = n++;
   }
   if( !handle_ldp( new_env, temp, ldp_pos, LDP, sizeof( LDP )-1 ) )
     goto error;
@@ -1024,12 +1392,12 @@ static char** clone_env( char* const* env, size_t* ldp_pos,
     temp = env[ *dil_pos ];
   else {
     temp = NULL;
-    *dil_pos = ++n;
+    *dil_pos = n++;
   }
   if( !handle_ldp( new_env, temp, dil_pos, DIL, sizeof( DIL )-1 ) )
     goto error;
 
-  new_env[ n+1 ] = NULL;
+  new_env[ n ] = NULL;
   return new_env;
 
 error:
@@ -99,6 +99,12 @@ APE_API int luaopen_ape( lua_State* L ) {
   ape_user_setup( L );
   ape_time_setup( L );
   ape_proc_setup( L );
+  ape_job_setup( L );
+  ape_clean_setup( L );
+  ape_lines_setup( L );
+  ape_glob_setup( L );
+  ape_stat_setup( L );
+  ape_fanotify_setup( L );
   ape_random_setup( L );
   ape_extra_setup( L );
   moon_register( L, functions );
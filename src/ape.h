@@ -12,6 +12,7 @@
 #include <apr_file_io.h>
 #include <apr_time.h>
 #include <apr_random.h>
+#include <apr_thread_proc.h>
 #include "moon.h"
 
 #ifndef APE_API
@@ -40,10 +41,21 @@
 #define APE_PROCATTR_NAME    "apr_procattr_t"
 #define APE_PROC_NAME        "apr_proc_t"
 #define APE_CRYPTOHASH_NAME  "apr_crypto_hash_t"
+#define APE_JOB_NAME         "ape_job_t"
+#define APE_PATHCACHE_NAME   "ape_pathcache_t"
+#define APE_LINES_NAME       "ape_lines_t"
+#define APE_GLOBCACHE_NAME   "ape_globcache_t"
+#define APE_SCRATCH_NAME     "ape_scratch_t"
+#define APE_FANOTIFY_NAME    "ape_fanotify_t"
 
 
 APE_API int ape_status( lua_State* L, int n, apr_status_t rv );
 APE_API apr_pool_t** ape_opt_pool( lua_State* L, int i );
+/* exclusive use of the scratch pool across calls into Lua (memory
+ * allocated from it stays valid until the next ape call after the
+ * release) */
+APE_API apr_pool_t* ape_scratch_hold( lua_State* L );
+APE_API void ape_scratch_release( lua_State* L );
 APE_API void ape_pool_setup( lua_State* L );
 APE_API void ape_errno_setup( lua_State* L );
 APE_API void ape_env_setup( lua_State* L );
@@ -66,6 +78,21 @@ APE_API apr_status_t ape_table2env( lua_State* L, int index,
                                     char const*** env,
                                     apr_pool_t* pool );
 APE_API void ape_proc_setup( lua_State* L );
+/* resource usage of a terminated child process */
+typedef struct {
+  lua_Number maxrss; /* peak resident set size in bytes (0 if unknown) */
+  lua_Number cputime; /* user + system cpu time in seconds */
+} ape_rusage;
+APE_API apr_status_t ape_proc_wait_rusage( apr_proc_t* proc, int* exitcode,
+                                           apr_exit_why_e* why,
+                                           apr_wait_how_e how,
+                                           ape_rusage* usage );
+APE_API void ape_job_setup( lua_State* L );
+APE_API void ape_clean_setup( lua_State* L );
+APE_API void ape_lines_setup( lua_State* L );
+APE_API void ape_glob_setup( lua_State* L );
+APE_API void ape_stat_setup( lua_State* L );
+APE_API void ape_fanotify_setup( lua_State* L );
 APE_API apr_crypto_hash_t* ape_check_hash( lua_State* L, int index );
 APE_API void ape_random_setup( lua_State* L );
 APE_API void ape_extra_setup( lua_State* L );
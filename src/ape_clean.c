@@ -0,0 +1,351 @@
+/***
+  @module ape
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_time.h>
+#include "moon.h"
+#include "ape.h"
+
+#if defined( APR_HAVE_UNISTD_H ) && APR_HAVE_UNISTD_H && \
+    !defined( _WIN32 ) && !defined( _WIN64 )
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  if defined( AT_FDCWD ) && defined( AT_REMOVEDIR )
+#    define APE_HAVE_UNLINKAT 1
+#    ifndef O_DIRECTORY
+#      define O_DIRECTORY 0
+#    endif
+#    ifndef O_CLOEXEC
+#      define O_CLOEXEC 0
+#    endif
+#  endif
+#endif
+
+/* default and maximum number of threads removing files */
+#define CLEAN_THREADS 8
+#define CLEAN_MAX_THREADS 64
+/* minimum interval between calls of the progress function */
+#define CLEAN_PROGRESS_INTERVAL 250000
+
+
+typedef struct {
+  char const* path;
+  size_t dirlen; /* length of the directory part including separator */
+  apr_status_t rv;
+  int isdir; /* removing it as a file failed, try again as directory */
+} clean_entry;
+
+typedef struct {
+  clean_entry* entries;
+  size_t n;
+  size_t* groups; /* start index of every directory (plus end marker) */
+  size_t ngroups;
+  /* the following fields are protected by the mutex */
+  size_t next; /* next group to process */
+  size_t done; /* number of processed entries */
+  int active; /* number of running workers */
+#if APR_HAS_THREADS
+  apr_thread_mutex_t* mutex;
+  apr_thread_cond_t* cond;
+#endif
+} clean_state;
+
+
+static size_t dir_length( char const* path ) {
+  size_t len = strlen( path );
+  while( len > 0 && path[ len-1 ] != '/'
+#if defined( _WIN32 ) || defined( _WIN64 )
+         && path[ len-1 ] != '\\'
+#endif
+       )
+    --len;
+  return len;
+}
+
+
+/* sorts by directory first, so that all entries of a directory are
+ * next to each other */
+static int compare_entries( void const* a, void const* b ) {
+  clean_entry const* x = a;
+  clean_entry const* y = b;
+  size_t len = x->dirlen < y->dirlen ? x->dirlen : y->dirlen;
+  int c = memcmp( x->path, y->path, len );
+  if( c != 0 )
+    return c;
+  else if( x->dirlen != y->dirlen )
+    return x->dirlen < y->dirlen ? -1 : 1;
+  return strcmp( x->path + x->dirlen, y->path + y->dirlen );
+}
+
+
+/* deeper directories first */
+static int compare_dirs( void const* a, void const* b ) {
+  clean_entry const* x = *(clean_entry const* const*)a;
+  clean_entry const* y = *(clean_entry const* const*)b;
+  return strcmp( y->path, x->path );
+}
+
+
+static void clean_lock( clean_state* s ) {
+#if APR_HAS_THREADS
+  if( s->mutex != NULL )
+    apr_thread_mutex_lock( s->mutex );
+#else
+  (void)s;
+#endif
+}
+
+
+static void clean_unlock( clean_state* s ) {
+#if APR_HAS_THREADS
+  if( s->mutex != NULL )
+    apr_thread_mutex_unlock( s->mutex );
+#else
+  (void)s;
+#endif
+}
+
+
+/* removes all (non-directory) files of one directory */
+static void clean_group( clean_entry* e, size_t n, apr_pool_t* pool ) {
+  size_t i = 0;
+#ifdef APE_HAVE_UNLINKAT
+  int dfd = AT_FDCWD;
+  (void)pool;
+  if( e->dirlen > 0 ) {
+    char* dir = malloc( e->dirlen+1 );
+    if( dir != NULL ) {
+      memcpy( dir, e->path, e->dirlen );
+      dir[ e->dirlen ] = '\0';
+      dfd = open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+      free( dir );
+    }
+    if( dfd < 0 ) {
+      apr_status_t rv = APR_FROM_OS_ERROR( errno );
+      for( i = 0; i < n; ++i )
+        e[ i ].rv = rv;
+      return;
+    }
+  }
+  for( i = 0; i < n; ++i ) {
+    if( unlinkat( dfd, e[ i ].path + e[ i ].dirlen, 0 ) == 0 )
+      e[ i ].rv = APR_SUCCESS;
+    else if( errno == EISDIR || errno == EPERM )
+      e[ i ].isdir = 1;
+    else
+      e[ i ].rv = APR_FROM_OS_ERROR( errno );
+  }
+  if( dfd != AT_FDCWD )
+    close( dfd );
+#else
+  for( i = 0; i < n; ++i ) {
+    e[ i ].rv = apr_file_remove( e[ i ].path, pool );
+    if( e[ i ].rv != APR_SUCCESS && !APR_STATUS_IS_ENOENT( e[ i ].rv ) )
+      e[ i ].isdir = 1;
+    apr_pool_clear( pool );
+  }
+#endif
+}
+
+
+static void clean_work( clean_state* s, apr_pool_t* pool ) {
+  for( ;; ) {
+    size_t g = 0;
+    clean_lock( s );
+    g = s->next++;
+    clean_unlock( s );
+    if( g >= s->ngroups )
+      break;
+    clean_group( s->entries + s->groups[ g ],
+                 s->groups[ g+1 ] - s->groups[ g ], pool );
+    clean_lock( s );
+    s->done += s->groups[ g+1 ] - s->groups[ g ];
+    clean_unlock( s );
+  }
+}
+
+
+#if APR_HAS_THREADS
+static void* APR_THREAD_FUNC clean_thread( apr_thread_t* t, void* p ) {
+  clean_state* s = p;
+  apr_pool_t* pool = NULL;
+  if( apr_pool_create( &pool, NULL ) == APR_SUCCESS ) {
+    clean_work( s, pool );
+    apr_pool_destroy( pool );
+  }
+  apr_thread_mutex_lock( s->mutex );
+  s->active--;
+  apr_thread_cond_signal( s->cond );
+  apr_thread_mutex_unlock( s->mutex );
+  apr_thread_exit( t, APR_SUCCESS );
+  return NULL;
+}
+#endif
+
+
+/* calls the progress function (if any) in protected mode, the error
+ * message is left on the stack, and the function is not called again */
+static int clean_progress( lua_State* L, int fi, size_t done, size_t n,
+                           int ok ) {
+  if( ok && !lua_isnoneornil( L, fi ) ) {
+    lua_pushvalue( L, fi );
+    lua_pushnumber( L, (lua_Number)done );
+    lua_pushnumber( L, (lua_Number)n );
+    ok = lua_pcall( L, 2, 0, 0 ) == 0;
+  }
+  return ok;
+}
+
+
+static int ape_clean_files( lua_State* L ) {
+  clean_state s;
+  apr_pool_t* pool = NULL;
+  apr_pool_t* wpool = NULL;
+  clean_entry** dirs = NULL;
+  size_t i = 0, ndirs = 0, removed = 0;
+  int nthreads = 0, ok = 1;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  nthreads = luaL_optint( L, 2, CLEAN_THREADS );
+  if( !lua_isnoneornil( L, 3 ) )
+    luaL_checktype( L, 3, LUA_TFUNCTION );
+  lua_settop( L, 3 );
+  memset( &s, 0, sizeof( s ) );
+  s.n = moon_rawlen( L, 1 );
+  for( i = 0; i < s.n; ++i ) {
+    lua_rawgeti( L, 1, (int)i+1 );
+    if( !lua_isstring( L, -1 ) )
+      luaL_argerror( L, 1, "array of strings expected" );
+    lua_pop( L, 1 );
+  }
+  /* the progress function may use the default pool, so it gets a
+   * separate one while we hold the scratch pool */
+  pool = ape_scratch_hold( L );
+  s.entries = apr_pcalloc( pool, sizeof( clean_entry ) * (s.n+1) );
+  s.groups = apr_palloc( pool, sizeof( size_t ) * (s.n+1) );
+  dirs = apr_palloc( pool, sizeof( clean_entry* ) * (s.n+1) );
+  for( i = 0; i < s.n; ++i ) {
+    lua_rawgeti( L, 1, (int)i+1 );
+    s.entries[ i ].path = apr_pstrdup( pool, lua_tostring( L, -1 ) );
+    s.entries[ i ].dirlen = dir_length( s.entries[ i ].path );
+    lua_pop( L, 1 );
+  }
+  qsort( s.entries, s.n, sizeof( clean_entry ), compare_entries );
+  for( i = 0; i < s.n; ++i ) {
+    if( i == 0 || s.entries[ i ].dirlen != s.entries[ i-1 ].dirlen ||
+        memcmp( s.entries[ i ].path, s.entries[ i-1 ].path,
+                s.entries[ i ].dirlen ) != 0 )
+      s.groups[ s.ngroups++ ] = i;
+  }
+  s.groups[ s.ngroups ] = s.n;
+  if( nthreads > CLEAN_MAX_THREADS )
+    nthreads = CLEAN_MAX_THREADS;
+  if( (size_t)nthreads > s.ngroups )
+    nthreads = (int)s.ngroups;
+#if APR_HAS_THREADS
+  if( nthreads > 1 &&
+      apr_thread_mutex_create( &s.mutex, APR_THREAD_MUTEX_DEFAULT,
+                               pool ) == APR_SUCCESS &&
+      apr_thread_cond_create( &s.cond, pool ) == APR_SUCCESS ) {
+    apr_thread_t* threads[ CLEAN_MAX_THREADS ];
+    int n = 0;
+    apr_thread_mutex_lock( s.mutex );
+    for( n = 0; n < nthreads; ++n ) {
+      if( apr_thread_create( threads+n, NULL, clean_thread, &s,
+                             pool ) != APR_SUCCESS )
+        break;
+      s.active++;
+    }
+    /* report the progress while the workers are busy */
+    while( s.active > 0 ) {
+      apr_thread_cond_timedwait( s.cond, s.mutex, CLEAN_PROGRESS_INTERVAL );
+      if( s.active > 0 ) {
+        size_t done = s.done;
+        apr_thread_mutex_unlock( s.mutex );
+        ok = clean_progress( L, 3, done, s.n, ok );
+        apr_thread_mutex_lock( s.mutex );
+      }
+    }
+    apr_thread_mutex_unlock( s.mutex );
+    while( n-- > 0 ) {
+      apr_status_t rv = APR_SUCCESS;
+      apr_thread_join( &rv, threads[ n ] );
+    }
+    s.mutex = NULL;
+  }
+#endif
+  /* does everything if no thread could be started */
+  if( apr_pool_create( &wpool, pool ) == APR_SUCCESS )
+    clean_work( &s, wpool );
+  /* remove directories bottom-up */
+  for( i = 0; i < s.n; ++i ) {
+    if( s.entries[ i ].isdir )
+      dirs[ ndirs++ ] = s.entries + i;
+  }
+  qsort( dirs, ndirs, sizeof( clean_entry* ), compare_dirs );
+  for( i = 0; i < ndirs; ++i ) {
+    apr_status_t rv = apr_dir_remove( dirs[ i ]->path, pool );
+    /* directories still containing other files are kept silently */
+    if( APR_STATUS_IS_ENOTEMPTY( rv ) || APR_STATUS_IS_EEXIST( rv ) )
+      rv = APR_ENOENT;
+    dirs[ i ]->rv = rv;
+  }
+  ok = clean_progress( L, 3, s.n, s.n, ok );
+  /* the results stay valid until the next ape function is called */
+  ape_scratch_release( L );
+  if( !ok ) {
+    lua_settop( L, 4 ); /* the error message */
+    return lua_error( L );
+  }
+  /* collect the results */
+  lua_pushnil( L );
+  lua_newtable( L );
+  for( i = 0; i < s.n; ++i ) {
+    apr_status_t rv = s.entries[ i ].rv;
+    if( rv == APR_SUCCESS )
+      ++removed;
+    else if( !APR_STATUS_IS_ENOENT( rv ) ) {
+      char buf[ 200 ] = { 0 };
+      apr_strerror( rv, buf, sizeof( buf ) );
+      lua_pushstring( L, s.entries[ i ].path );
+      lua_pushstring( L, buf );
+      lua_rawset( L, -3 );
+    }
+  }
+  lua_pushnumber( L, (lua_Number)removed );
+  lua_replace( L, -3 );
+  return 2;
+}
+
+
+
+APE_API void ape_clean_setup( lua_State* L ) {
+  luaL_Reg const ape_clean_functions[] = {
+  /***
+    Removes many files (and empty directories) at once. The files are
+    grouped by directory and removed by a pool of threads, the
+    directories are removed afterwards (deepest first). Missing files
+    are not reported as errors.
+    @function clean_files
+    @tparam table paths an array of file and directory paths
+    @tparam[opt] number threads the number of threads to use
+    @tparam[opt] function progress called regularly with the number
+      of processed paths and the total number of paths
+    @treturn number the number of removed paths
+    @treturn table a table mapping failed paths to error messages
+  */
+    { "clean_files", ape_clean_files },
+    { NULL, NULL }
+  };
+  moon_register( L, ape_clean_functions );
+}
+
@@ -2,12 +2,20 @@
   @module ape
 */
 #include <stddef.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
 #include <apr_env.h>
 #include "moon.h"
 #include "ape.h"
 
+#if defined( _WIN32 ) || defined( _WIN64 )
+#  include <stdlib.h>
+#  define environ _environ
+#else
+extern char** environ;
+#endif
+
 
 static int ape_env_get( lua_State* L ) {
   char const* name = luaL_checkstring( L, 1 );
@@ -35,6 +43,22 @@ static int ape_env_delete( lua_State* L ) {
 }
 
 
+static int ape_env_all( lua_State* L ) {
+  char** e = environ;
+  lua_newtable( L );
+  for( ; e != NULL && *e != NULL; ++e ) {
+    char const* eq = strchr( *e, '=' );
+    /* skips the hidden "=C:=..." variables on Windows */
+    if( eq != NULL && eq != *e ) {
+      lua_pushlstring( L, *e, eq - *e );
+      lua_pushstring( L, eq+1 );
+      lua_rawset( L, -3 );
+    }
+  }
+  return 1;
+}
+
+
 
 APE_API void ape_env_setup( lua_State* L ) {
   /***
@@ -73,6 +97,13 @@ APE_API void ape_env_setup( lua_State* L ) {
       code in case of an error
   */
     { "env_delete", ape_env_delete },
+  /***
+    Returns a copy of the whole environment, e.g. for modifying it
+    for a child process (see @{job_spawn}).
+    @function env_all
+    @treturn table a table mapping variable names to values
+  */
+    { "env_all", ape_env_all },
     { NULL, NULL }
   };
 
@@ -12,7 +12,8 @@
 #define DEF( e ) \
   static int ape_status_is_ ## e( lua_State* L ) { \
     apr_status_t status = luaL_checkint( L, 1 ); \
-    return APR_STATUS_IS_ ## e( status ); \
+    lua_pushboolean( L, APR_STATUS_IS_ ## e( status ) ); \
+    return 1; \
   }
 
 #define REG( e ) { "is_" #e, ape_status_is_ ## e },
@@ -14,10 +14,19 @@
 #include <apr_file_info.h>
 #include <apr_thread_proc.h>
 #include <apr_mmap.h>
+#include <apr_random.h>
+#include <apr_thread_mutex.h>
 #include "moon.h"
 #include "ape.h"
 
 
+/* default and maximum number of threads for hashing files */
+#define HASH_THREADS 16
+#define HASH_MAX_THREADS 64
+/* maximum size of a digest in bytes */
+#define HASH_DIGEST_MAX 64
+
+
 static apr_status_t check_read( lua_State* L, char const* path,
                                 apr_pool_t* pool ) {
   apr_status_t rv = APR_SUCCESS;
@@ -144,84 +153,6 @@ static int ape_extra_find_exec( lua_State* L ) {
 }
 
 
-static int ape_extra_run_collect( lua_State* L ) {
-  static char const* const names[] = {
-    "shellcmd", "shellcmd/env", "program", "program/env",
-    "program/path", NULL
-  };
-  static apr_cmdtype_e const flags[] = {
-    APR_SHELLCMD, APR_SHELLCMD_ENV, APR_PROGRAM, APR_PROGRAM_ENV,
-    APR_PROGRAM_PATH
-  };
-  apr_cmdtype_e ct = flags[ luaL_checkoption( L, 1, NULL, names ) ];
-  char const* cmd = luaL_checkstring( L, 2 );
-  char const** argv = NULL;
-  char const** env = NULL;
-  apr_pool_t** pool = NULL;
-  apr_procattr_t* pa = NULL;
-  apr_status_t rv = APR_SUCCESS;
-  luaL_checktype( L, 3, LUA_TTABLE );
-  if( !lua_isnoneornil( L, 4 ) )
-    luaL_checktype( L, 4, LUA_TTABLE );
-  pool = ape_opt_pool( L, 5 );
-  rv = apr_procattr_create( &pa, *pool );
-  if( rv != APR_SUCCESS )
-    return ape_status( L, 0, rv );
-  rv = apr_procattr_cmdtype_set( pa, ct );
-  if( rv != APR_SUCCESS )
-    return ape_status( L, 0, rv );
-  rv = apr_procattr_io_set( pa, APR_NO_PIPE, APR_FULL_BLOCK, APR_NO_PIPE );
-  if( rv != APR_SUCCESS )
-    return ape_status( L, 0, rv );
-  if( (rv = ape_table2argv( L, 3, &argv, *pool )) == APR_SUCCESS &&
-      (lua_isnoneornil( L, 4 ) ||
-       (rv = ape_table2env( L, 4, &env, *pool )) == APR_SUCCESS) ) {
-    apr_proc_t proc;
-    rv = apr_proc_create( &proc, cmd, argv, env, pa, *pool );
-    if( rv == APR_SUCCESS ) {
-      int exitstatus = 0;
-      apr_exit_why_e ewhy = 0;
-      luaL_Buffer buf;
-      if( proc.out == NULL )
-        return ape_status( L, 0, APR_EGENERAL );
-      luaL_buffinit( L, &buf );
-      do {
-        char* s = luaL_prepbuffer( &buf );
-        apr_size_t size = LUAL_BUFFERSIZE;
-        rv = apr_file_read( proc.out, s, &size );
-        luaL_addsize( &buf, size );
-      } while( rv == APR_SUCCESS );
-      luaL_pushresult( &buf );
-      apr_file_close( proc.out );
-      if( !APR_STATUS_IS_EOF( rv ) ) {
-        int v = 0;
-        apr_proc_wait( &proc, &exitstatus, &ewhy, APR_NOWAIT );
-        v = ape_status( L, 0, rv );
-        lua_pushvalue( L, -4 );
-        return v + 1;
-      }
-      rv = apr_proc_wait( &proc, &exitstatus, &ewhy, APR_WAIT );
-      if( !APR_STATUS_IS_CHILD_DONE( rv ) ) {
-        int v = ape_status( L, 0, rv );
-        lua_pushvalue( L, -4 );
-        return v + 1;
-      }
-      if( APR_PROC_CHECK_EXIT( ewhy ) ) {
-        lua_pushboolean( L, exitstatus == 0 );
-        lua_pushliteral( L, "exit" );
-      } else {
-        lua_pushboolean( L, 0 );
-        lua_pushliteral( L, "signal" );
-      }
-      lua_pushnumber( L, (lua_Number)exitstatus );
-      lua_pushvalue( L, -4 );
-      return 4;
-    }
-  }
-  return ape_status( L, 0, rv );
-}
-
-
 #define DIRSEPLEN (sizeof( LUA_DIRSEP )-1)
 
 static char const* find_dirsep( char const* path, size_t len,
@@ -384,36 +315,36 @@ static int ape_extra_path_glob( lua_State* L ) {
 }
 
 
-static int ape_extra_hash_file( lua_State* L ) {
-  apr_crypto_hash_t* h = ape_check_hash( L, 1 );
-  char const* fname = luaL_checkstring( L, 2 );
-  apr_pool_t** pool = ape_opt_pool( L, 3 );
+/* hashes the contents of a file; `*regular` is set to 0 (without an
+ * error) if the file isn't a regular file */
+static apr_status_t hash_file( apr_crypto_hash_t* h, char const* fname,
+                               int* regular, apr_pool_t* pool ) {
   apr_file_t* file = NULL;
   apr_finfo_t finfo;
   apr_mmap_t* mmap = NULL;
   apr_status_t rv = APR_SUCCESS;
 
+  *regular = 1;
   rv = apr_file_open( &file, fname, APR_FOPEN_READ,
-                      APR_FPROT_OS_DEFAULT, *pool );
+                      APR_FPROT_OS_DEFAULT, pool );
   if( rv != APR_SUCCESS )
-    return ape_status( L, 0, rv );
+    return rv;
   rv = apr_file_info_get( &finfo, APR_FINFO_SIZE|APR_FINFO_TYPE, file );
   if( rv != APR_SUCCESS ) {
     apr_file_close( file );
-    return ape_status( L, 0, rv );
+    return rv;
   }
   if( finfo.filetype != APR_REG ) {
     apr_file_close( file );
-    lua_pushnil( L );
-    lua_pushliteral( L, "not a regular file" );
-    return 2;
+    *regular = 0;
+    return APR_SUCCESS;
   }
   if( APR_MMAP_CANDIDATE( finfo.size ) ) {
     rv = apr_mmap_create( &mmap, file, 0, (apr_size_t)finfo.size,
-                          APR_MMAP_READ, *pool );
+                          APR_MMAP_READ, pool );
     if( rv != APR_SUCCESS ) {
       apr_file_close( file );
-      return ape_status( L, 0, rv );
+      return rv;
     }
     h->add( h, mmap->mm, mmap->size );
     apr_mmap_delete( mmap );
@@ -427,15 +358,289 @@ static int ape_extra_hash_file( lua_State* L ) {
     } while( rv == APR_SUCCESS );
     if( !APR_STATUS_IS_EOF( rv ) ) {
       apr_file_close( file );
-      return ape_status( L, 0, rv );
+      return rv;
     }
   }
   apr_file_close( file );
+  return APR_SUCCESS;
+}
+
+
+static int ape_extra_hash_file( lua_State* L ) {
+  apr_crypto_hash_t* h = ape_check_hash( L, 1 );
+  char const* fname = luaL_checkstring( L, 2 );
+  apr_pool_t** pool = ape_opt_pool( L, 3 );
+  int regular = 1;
+  apr_status_t rv = hash_file( h, fname, &regular, *pool );
+  if( rv != APR_SUCCESS )
+    return ape_status( L, 0, rv );
+  if( !regular ) {
+    lua_pushnil( L );
+    lua_pushliteral( L, "not a regular file" );
+    return 2;
+  }
   lua_pushboolean( L, 1 );
   return 1;
 }
 
 
+/* Files are hashed by a number of threads, so that many opens and
+ * reads are in flight at the same time (which matters a lot for
+ * cold caches on high latency storage). Every thread has its own
+ * hash object and its own (root) pool that is cleared after every
+ * file. */
+typedef struct {
+  char const* path;
+  apr_byte_t digest[ HASH_DIGEST_MAX ];
+  int regular;
+  apr_status_t rv;
+} hash_task;
+
+typedef struct {
+  hash_task* tasks;
+  size_t n;
+  size_t next;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t* mutex;
+#endif
+} hash_work;
+
+typedef struct {
+  hash_work* w;
+  apr_crypto_hash_t* h;
+  apr_pool_t* pool;
+} hash_worker;
+
+
+static void hash_run( hash_worker* k ) {
+  hash_work* w = k->w;
+  for( ;; ) {
+    hash_task* t = NULL;
+#if APR_HAS_THREADS
+    if( w->mutex != NULL )
+      apr_thread_mutex_lock( w->mutex );
+#endif
+    if( w->next < w->n )
+      t = w->tasks + w->next++;
+#if APR_HAS_THREADS
+    if( w->mutex != NULL )
+      apr_thread_mutex_unlock( w->mutex );
+#endif
+    if( t == NULL )
+      break;
+    k->h->init( k->h );
+    t->rv = hash_file( k->h, t->path, &t->regular, k->pool );
+    if( t->rv == APR_SUCCESS && t->regular )
+      k->h->finish( k->h, t->digest );
+    apr_pool_clear( k->pool );
+  }
+}
+
+
+#if APR_HAS_THREADS
+static void* APR_THREAD_FUNC hash_thread( apr_thread_t* t, void* p ) {
+  hash_run( p );
+  apr_thread_exit( t, APR_SUCCESS );
+  return NULL;
+}
+#endif
+
+
+static void hash_push_results( lua_State* L, hash_work const* w,
+                               apr_size_t dlen ) {
+  static char const hexdigits[] = "0123456789abcdef";
+  size_t i = 0, j = 0;
+  int ti = lua_gettop( L ) + 1;
+  lua_createtable( L, (int)w->n, 0 );
+  lua_newtable( L );
+  lua_newtable( L );
+  for( i = 0; i < w->n; ++i ) {
+    hash_task const* t = w->tasks + i;
+    if( t->rv == APR_SUCCESS && t->regular ) {
+      char hex[ 2*HASH_DIGEST_MAX ];
+      for( j = 0; j < dlen; ++j ) {
+        hex[ 2*j ] = hexdigits[ (t->digest[ j ] >> 4) & 0x0F ];
+        hex[ 2*j+1 ] = hexdigits[ t->digest[ j ] & 0x0F ];
+      }
+      lua_pushlstring( L, hex, 2*dlen );
+    } else {
+      if( t->rv != APR_SUCCESS ) {
+        char buf[ 200 ] = { 0 };
+        apr_strerror( t->rv, buf, sizeof( buf ) );
+        lua_pushstring( L, buf );
+        lua_rawseti( L, ti+1, (int)i+1 );
+        lua_pushinteger( L, t->rv );
+        lua_rawseti( L, ti+2, (int)i+1 );
+      } else {
+        lua_pushliteral( L, "not a regular file" );
+        lua_rawseti( L, ti+1, (int)i+1 );
+      }
+      lua_pushboolean( L, 0 );
+    }
+    lua_rawseti( L, ti, (int)i+1 );
+  }
+}
+
+
+static int ape_extra_sha256_files( lua_State* L ) {
+  int threads = 0, i = 0, started = 0;
+  apr_pool_t* pool = NULL;
+  hash_work w;
+  hash_worker workers[ HASH_MAX_THREADS ];
+  apr_size_t dlen = 0;
+  apr_status_t rv = APR_SUCCESS;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  threads = luaL_optint( L, 2, HASH_THREADS );
+  if( threads < 1 )
+    threads = 1;
+  else if( threads > HASH_MAX_THREADS )
+    threads = HASH_MAX_THREADS;
+  lua_settop( L, 1 );
+  memset( &w, 0, sizeof( w ) );
+  memset( workers, 0, sizeof( workers ) );
+  w.n = moon_rawlen( L, 1 );
+  ape_assert( L, apr_pool_create( &pool, NULL ), "APR memory pool" );
+  w.tasks = apr_pcalloc( pool, (w.n+1) * sizeof( hash_task ) );
+  if( w.tasks == NULL ) {
+    apr_pool_destroy( pool );
+    return ape_status( L, 0, APR_ENOMEM );
+  }
+  /* the path strings stay alive in the argument table */
+  for( i = 0; i < (int)w.n; ++i ) {
+    lua_rawgeti( L, 1, i+1 );
+    w.tasks[ i ].path = lua_tostring( L, -1 );
+    lua_pop( L, 1 );
+    if( w.tasks[ i ].path == NULL ) {
+      apr_pool_destroy( pool );
+      luaL_argerror( L, 1, "array of strings expected" );
+    }
+  }
+  if( (size_t)threads > w.n )
+    threads = w.n > 0 ? (int)w.n : 1;
+  for( i = 0; i < threads && rv == APR_SUCCESS; ++i ) {
+    workers[ i ].w = &w;
+    workers[ i ].h = apr_crypto_sha256_new( pool );
+    if( workers[ i ].h == NULL )
+      rv = APR_ENOMEM;
+    else
+      rv = apr_pool_create( &workers[ i ].pool, NULL );
+  }
+  if( rv != APR_SUCCESS ) {
+    while( i-- > 0 )
+      if( workers[ i ].pool != NULL )
+        apr_pool_destroy( workers[ i ].pool );
+    apr_pool_destroy( pool );
+    return ape_status( L, 0, rv );
+  }
+  dlen = workers[ 0 ].h->size;
+  if( dlen > HASH_DIGEST_MAX )
+    dlen = HASH_DIGEST_MAX;
+#if APR_HAS_THREADS
+  if( threads > 1 &&
+      apr_thread_mutex_create( &w.mutex, APR_THREAD_MUTEX_DEFAULT,
+                               pool ) == APR_SUCCESS ) {
+    apr_thread_t* tids[ HASH_MAX_THREADS ];
+    /* the calling thread is worker 0 */
+    for( started = 1; started < threads; ++started ) {
+      if( apr_thread_create( tids+started, NULL, hash_thread,
+                             workers+started, pool ) != APR_SUCCESS )
+        break;
+    }
+    hash_run( workers );
+    for( i = 1; i < started; ++i ) {
+      apr_status_t trv = APR_SUCCESS;
+      apr_thread_join( &trv, tids[ i ] );
+    }
+  } else
+#endif
+    hash_run( workers );
+  (void)started;
+  hash_push_results( L, &w, dlen );
+  for( i = 0; i < threads; ++i )
+    apr_pool_destroy( workers[ i ].pool );
+  apr_pool_destroy( pool );
+  return 3;
+}
+
+
+#if defined( _WIN32 ) || defined( _WIN64 ) || defined( __WINDOWS__ )
+#include <windows.h>
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+
+static int ape_extra_cpu_count( lua_State* L ) {
+  long n = 0;
+#if defined( _WIN32 ) || defined( _WIN64 ) || defined( __WINDOWS__ )
+  SYSTEM_INFO si;
+  GetSystemInfo( &si );
+  n = (long)si.dwNumberOfProcessors;
+#elif defined( _SC_NPROCESSORS_ONLN )
+  n = sysconf( _SC_NPROCESSORS_ONLN );
+#endif
+  lua_pushinteger( L, n > 0 ? n : 1 );
+  return 1;
+}
+
+
+static int ape_extra_loadavg( lua_State* L ) {
+#if !defined( _WIN32 ) && !defined( _WIN64 ) && !defined( __WINDOWS__ )
+  double la[ 3 ];
+  if( getloadavg( la, 3 ) == 3 ) {
+    lua_pushnumber( L, la[ 0 ] );
+    lua_pushnumber( L, la[ 1 ] );
+    lua_pushnumber( L, la[ 2 ] );
+    return 3;
+  }
+#endif
+  lua_pushnil( L );
+  return 1;
+}
+
+
+static int ape_extra_mem_available( lua_State* L ) {
+#if defined( _WIN32 ) || defined( _WIN64 ) || defined( __WINDOWS__ )
+  MEMORYSTATUSEX ms;
+  ms.dwLength = sizeof( ms );
+  if( GlobalMemoryStatusEx( &ms ) ) {
+    lua_pushnumber( L, (lua_Number)ms.ullAvailPhys );
+    return 1;
+  }
+#else
+  /* MemAvailable also accounts for reclaimable page cache, so it is
+   * preferred over the plain number of free pages */
+  FILE* f = fopen( "/proc/meminfo", "r" );
+  if( f != NULL ) {
+    char line[ 128 ];
+    unsigned long kb = 0;
+    while( fgets( line, sizeof( line ), f ) != NULL ) {
+      if( sscanf( line, "MemAvailable: %lu kB", &kb ) == 1 ) {
+        fclose( f );
+        lua_pushnumber( L, (lua_Number)kb * 1024 );
+        return 1;
+      }
+    }
+    fclose( f );
+  }
+#  if defined( _SC_AVPHYS_PAGES ) && defined( _SC_PAGESIZE )
+  {
+    long pages = sysconf( _SC_AVPHYS_PAGES );
+    long psize = sysconf( _SC_PAGESIZE );
+    if( pages > 0 && psize > 0 ) {
+      lua_pushnumber( L, (lua_Number)pages * psize );
+      return 1;
+    }
+  }
+#  endif
+#endif
+  lua_pushnil( L );
+  return 1;
+}
+
+
 #ifdef APR_HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
@@ -569,21 +774,6 @@ APE_API void ape_extra_setup( lua_State* L ) {
       code in case of an error
   */
     { "find_exec", ape_extra_find_exec },
-  /***
-    Executes a program and collects its standard output
-    @function run_collect
-    @tparam string type specifies how to execute the program
-    @tparam string prog the program name
-    @tparam table argv an array of program arguments
-    @tparam[opt] table env an env table
-    @tparam[opt] apr_pool_t pool a memory pool for temporary
-      allocations
-    @treturn boolean,string,number,string same as @{os.execute} in Lua
-      5.2 plus the output
-    @treturn nil,string,number,string nil, an error message, and an
-      error code in case of an error (plus partial output if any)
-  */
-    { "run_collect", ape_extra_run_collect },
   /***
     Strips the directory part (and file extension) of a path.
     @function basename
@@ -626,6 +816,43 @@ APE_API void ape_extra_setup( lua_State* L ) {
       code in case of an error
   */
     { "hash_file", ape_extra_hash_file },
+  /***
+    Computes the SHA-256 hashes of many files at once. The files are
+    read and hashed by multiple threads, so that many I/O requests are
+    in flight at the same time.
+    @function sha256_files
+    @tparam table paths an array of file names
+    @tparam[opt] number threads the maximum number of threads
+      (default: 16)
+    @treturn table an array of hex digests (indexed like `paths`),
+      `false` for files that couldn't be hashed
+    @treturn table error messages for the files that couldn't be
+      hashed (indexed like `paths`)
+    @treturn table error codes for the files that couldn't be hashed
+      (indexed like `paths`)
+  */
+    { "sha256_files", ape_extra_sha256_files },
+  /***
+    Returns the number of online processors.
+    @function cpu_count
+    @treturn number the number of cpus (at least 1)
+  */
+    { "cpu_count", ape_extra_cpu_count },
+  /***
+    Returns the system load averages.
+    @function loadavg
+    @treturn number,number,number the 1, 5, and 15 minute load
+      averages
+    @treturn nil if the load average is not available
+  */
+    { "loadavg", ape_extra_loadavg },
+  /***
+    Returns the amount of memory available for new processes.
+    @function mem_available
+    @treturn number the available memory in bytes
+    @treturn nil if the information is not available
+  */
+    { "mem_available", ape_extra_mem_available },
     { NULL, NULL }
   };
   moon_register( L, ape_extra_functions );
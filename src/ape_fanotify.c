@@ -0,0 +1,537 @@
+/***
+  @module ape
+*/
+#include <stddef.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+#include "moon.h"
+#include "ape.h"
+
+#if defined( __linux__ ) && APR_HAS_THREADS
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <signal.h>
+#  include <stdio.h>
+#  include <string.h>
+#  include <unistd.h>
+#  include <stdlib.h>
+#  include <sys/types.h>
+#  include <sys/fanotify.h>
+#  ifndef O_LARGEFILE
+#    define O_LARGEFILE 0
+#  endif
+#  define APE_HAVE_FANOTIFY 1
+#endif
+
+
+#ifdef APE_HAVE_FANOTIFY
+
+/* events are read in chunks of this size */
+#define FAN_BUFFER_SIZE 65536
+/* the reader thread checks the stop flag this often (in ms) */
+#define FAN_POLL_INTERVAL 100
+/* groups that haven't been taken for this long are dropped if their
+ * leader is gone (e.g. processes outside of buildsh) */
+#define FAN_STALE_TIME apr_time_from_sec( 600 )
+
+/* access modes recorded per path */
+#define FAN_READ 1
+#define FAN_WRITE 2
+
+
+/* the paths accessed by one process group, or by the processes in
+ * one of the per-command cgroups of buildsh */
+typedef struct {
+  apr_pool_t* pool; /* for the group itself, its hashes, and the paths */
+  apr_hash_t* paths; /* path -> int* (access modes) */
+  apr_array_header_t* pids; /* pid_t* of the processes seen */
+  long key; /* the pgid, or minus the number of the cgroup */
+  char const* cgroup; /* path of the cgroup (or NULL) */
+  apr_time_t touched;
+} fan_group;
+
+/* A fanotify listener for a whole mount. A separate thread reads the
+ * events while the commands are running (so that most processes still
+ * exist when their process group is looked up) and sorts the paths
+ * into groups. Programs are stopped in `execve` until their event has
+ * been read, so that the group of every process that has executed a
+ * program is known. Processes in a cgroup `buildsh-<pid>/cmd-<n>` of this
+ * buildsh process are attributed by their cgroup (which they can't
+ * leave like their process group). The group of every process seen
+ * is remembered, so that the events of a process that has been
+ * reaped in the meantime can still be attributed. Everything but the
+ * stop flag is protected by the mutex.
+ */
+typedef struct {
+  apr_pool_t* pool; /* for the mutex, the thread, and the hashes */
+  apr_hash_t* groups; /* key -> fan_group* */
+  apr_hash_t* pids; /* pid -> fan_group* */
+  apr_thread_mutex_t* mutex;
+  apr_thread_t* thread;
+  int fd;
+  volatile int stop;
+  double lost; /* events that couldn't be attributed */
+  pid_t self; /* the process group of buildsh is ignored */
+  char cgsuffix[ 32 ]; /* "/buildsh-<pid>/cmd-" */
+  char buf[ FAN_BUFFER_SIZE ];
+} ape_fanotify;
+
+
+static void ape_fanotify_init( void* p ) {
+  ape_fanotify* f = p;
+  f->pool = NULL;
+  f->groups = NULL;
+  f->pids = NULL;
+  f->mutex = NULL;
+  f->thread = NULL;
+  f->fd = -1;
+  f->stop = 0;
+  f->lost = 0;
+  f->self = getpgrp();
+  sprintf( f->cgsuffix, "/buildsh-%ld/cmd-", (long)getpid() );
+}
+
+
+static void fan_release( ape_fanotify* f ) {
+  if( f->thread != NULL ) {
+    apr_status_t rv = APR_SUCCESS;
+    f->stop = 1;
+    apr_thread_join( &rv, f->thread );
+    f->thread = NULL;
+  }
+  if( f->fd >= 0 ) {
+    close( f->fd );
+    f->fd = -1;
+  }
+  if( f->groups != NULL ) {
+    apr_hash_index_t* hi = apr_hash_first( NULL, f->groups );
+    for( ; hi != NULL; hi = apr_hash_next( hi ) ) {
+      fan_group* g = NULL;
+      apr_hash_this( hi, NULL, NULL, (void**)&g );
+      apr_pool_destroy( g->pool );
+    }
+    f->groups = NULL;
+    f->pids = NULL;
+  }
+  if( f->pool != NULL ) {
+    apr_pool_destroy( f->pool );
+    f->pool = NULL;
+  }
+}
+
+
+static int ape_fanotify_gc( lua_State* L ) {
+  fan_release( moon_checkudata( L, 1, APE_FANOTIFY_NAME ) );
+  return 0;
+}
+
+
+/* returns the number of a cgroup `.../buildsh-<pid>/cmd-<n>` of this
+ * buildsh process, or 0 for other cgroups */
+static long fan_cgroup_id( ape_fanotify* f, char const* cg ) {
+  size_t len = strlen( f->cgsuffix );
+  char const* c = strrchr( cg, '/' );
+  char* end = NULL;
+  long id = 0;
+  if( c == NULL || c - cg + 5 < (ptrdiff_t)len ||
+      strncmp( c+5-len, f->cgsuffix, len ) )
+    return 0;
+  id = strtol( c+5, &end, 10 );
+  return (*end == '\0' && id > 0) ? id : 0;
+}
+
+
+/* reads the (v2) cgroup of a process, returns the length of the path
+ * or 0 */
+static size_t fan_proc_cgroup( pid_t pid, char* buf, size_t size ) {
+  char name[ 64 ];
+  char* p = buf;
+  ssize_t n = 0;
+  int fd = -1;
+  sprintf( name, "/proc/%ld/cgroup", (long)pid );
+  fd = open( name, O_RDONLY | O_CLOEXEC );
+  if( fd < 0 )
+    return 0;
+  n = read( fd, buf, size-1 );
+  close( fd );
+  if( n <= 0 )
+    return 0;
+  buf[ n ] = '\0';
+  while( strncmp( p, "0::", 3 ) ) {
+    p = strchr( p, '\n' );
+    if( p == NULL )
+      return 0;
+    ++p;
+  }
+  n = strcspn( p+3, "\n" );
+  memmove( buf, p+3, n );
+  buf[ n ] = '\0';
+  return n;
+}
+
+
+static fan_group* fan_get_group( ape_fanotify* f, long key,
+                                 char const* cgroup ) {
+  fan_group* g = apr_hash_get( f->groups, &key, sizeof( key ) );
+  if( g == NULL ) {
+    apr_pool_t* pool = NULL;
+    if( apr_pool_create( &pool, NULL ) != APR_SUCCESS )
+      return NULL;
+    g = apr_palloc( pool, sizeof( *g ) );
+    g->pool = pool;
+    g->paths = apr_hash_make( pool );
+    g->pids = apr_array_make( pool, 4, sizeof( pid_t* ) );
+    g->key = key;
+    g->cgroup = cgroup ? apr_pstrcat( pool, "/sys/fs/cgroup", cgroup,
+                                      NULL ) : NULL;
+    apr_hash_set( f->groups, &g->key, sizeof( g->key ), g );
+  }
+  g->touched = apr_time_now();
+  return g;
+}
+
+
+/* remembers the group of a process */
+static void fan_add_pid( ape_fanotify* f, fan_group* g, pid_t pid ) {
+  fan_group* old = apr_hash_get( f->pids, &pid, sizeof( pid ) );
+  if( old != g ) {
+    pid_t* p = apr_palloc( g->pool, sizeof( *p ) );
+    /* the key of an existing entry would still point into the pool of
+     * the old group */
+    if( old != NULL )
+      apr_hash_set( f->pids, &pid, sizeof( pid ), NULL );
+    *p = pid;
+    APR_ARRAY_PUSH( g->pids, pid_t* ) = p;
+    apr_hash_set( f->pids, p, sizeof( *p ), g );
+  }
+}
+
+
+static void fan_drop_group( ape_fanotify* f, fan_group* g ) {
+  int i = 0;
+  for( i = 0; i < g->pids->nelts; ++i ) {
+    pid_t* p = APR_ARRAY_IDX( g->pids, i, pid_t* );
+    /* the pid may have been reused by a process of another group */
+    if( apr_hash_get( f->pids, p, sizeof( *p ) ) == g )
+      apr_hash_set( f->pids, p, sizeof( *p ), NULL );
+  }
+  apr_hash_set( f->groups, &g->key, sizeof( g->key ), NULL );
+  apr_pool_destroy( g->pool );
+}
+
+
+static fan_group* fan_find_group( ape_fanotify* f, pid_t pid,
+                                  pid_t pgid ) {
+  char cg[ 4096 ];
+  long id = 0;
+  if( pgid < 0 ) { /* the process (and its zombie) is already gone */
+    fan_group* g = apr_hash_get( f->pids, &pid, sizeof( pid ) );
+    if( g != NULL )
+      g->touched = apr_time_now();
+    return g;
+  }
+  if( fan_proc_cgroup( pid, cg, sizeof( cg ) ) > 0 &&
+      (id = fan_cgroup_id( f, cg )) > 0 )
+    return fan_get_group( f, -id, cg );
+  return fan_get_group( f, pgid, NULL );
+}
+
+
+static void fan_event( ape_fanotify* f,
+                       struct fanotify_event_metadata const* m ) {
+  char link[ 64 ];
+  char path[ 4096 ];
+  ssize_t n = 0;
+  pid_t pgid = 0;
+  fan_group* g = NULL;
+  int* modes = NULL;
+  if( m->mask & FAN_Q_OVERFLOW ) {
+    ++f->lost;
+    return;
+  }
+  if( m->fd < 0 )
+    return;
+  pgid = getpgid( m->pid );
+  if( pgid == f->self )
+    return;
+  sprintf( link, "/proc/self/fd/%d", m->fd );
+  n = readlink( link, path, sizeof( path )-1 );
+  if( n <= 0 || path[ 0 ] != '/' )
+    return;
+  path[ n ] = '\0';
+  /* temporary files that were deleted before the event was read */
+  if( n > 10 && !strcmp( path+n-10, " (deleted)" ) )
+    return;
+  g = fan_find_group( f, m->pid, pgid );
+  if( g == NULL ) {
+    ++f->lost;
+    return;
+  }
+  fan_add_pid( f, g, m->pid );
+  modes = apr_hash_get( g->paths, path, n );
+  if( modes == NULL ) {
+    modes = apr_palloc( g->pool, sizeof( *modes ) );
+    *modes = 0;
+    apr_hash_set( g->paths, apr_pstrndup( g->pool, path, n ), n, modes );
+  }
+  *modes |= (m->mask & FAN_CLOSE_WRITE) ? FAN_WRITE : FAN_READ;
+}
+
+
+/* reads all pending events, the mutex must be locked */
+static void fan_drain( ape_fanotify* f ) {
+  for( ;; ) {
+    struct fanotify_event_metadata const* m = (void*)f->buf;
+    ssize_t len = read( f->fd, f->buf, sizeof( f->buf ) );
+    if( len <= 0 )
+      break;
+    for( ; FAN_EVENT_OK( m, len ); m = FAN_EVENT_NEXT( m, len ) ) {
+      if( m->vers != FANOTIFY_METADATA_VERSION )
+        ++f->lost;
+      else
+        fan_event( f, m );
+      if( m->fd >= 0 ) {
+#ifdef FAN_OPEN_EXEC_PERM
+        /* the process waits in `execve` until it is allowed to go on */
+        if( m->mask & FAN_OPEN_EXEC_PERM ) {
+          struct fanotify_response r;
+          r.fd = m->fd;
+          r.response = FAN_ALLOW;
+          if( write( f->fd, &r, sizeof( r ) ) < 0 )
+            ++f->lost;
+        }
+#endif
+        close( m->fd );
+      }
+    }
+  }
+}
+
+
+static void* APR_THREAD_FUNC fan_thread( apr_thread_t* t, void* p ) {
+  ape_fanotify* f = p;
+  struct pollfd pfd;
+  pfd.fd = f->fd;
+  pfd.events = POLLIN;
+  while( !f->stop ) {
+    int r = poll( &pfd, 1, FAN_POLL_INTERVAL );
+    if( r > 0 ) {
+      apr_thread_mutex_lock( f->mutex );
+      fan_drain( f );
+      apr_thread_mutex_unlock( f->mutex );
+    } else if( r < 0 && errno != EINTR )
+      break;
+  }
+  apr_thread_exit( t, APR_SUCCESS );
+  return NULL;
+}
+
+
+/* drops groups that have been unclaimed for a long time */
+static void fan_prune( ape_fanotify* f ) {
+  apr_time_t now = apr_time_now();
+  apr_hash_index_t* hi = apr_hash_first( NULL, f->groups );
+  for( ; hi != NULL; hi = apr_hash_next( hi ) ) {
+    fan_group* g = NULL;
+    apr_hash_this( hi, NULL, NULL, (void**)&g );
+    if( now - g->touched > FAN_STALE_TIME &&
+        (g->cgroup != NULL ? access( g->cgroup, F_OK ) != 0 :
+           kill( (pid_t)g->key, 0 ) != 0 && errno == ESRCH) )
+      fan_drop_group( f, g );
+  }
+}
+
+
+static int ape_fanotify_open( lua_State* L ) {
+  char const* path = luaL_optstring( L, 1, "." );
+  ape_fanotify* f = moon_newobject( L, APE_FANOTIFY_NAME, 0 );
+  apr_status_t rv = APR_SUCCESS;
+  unsigned long mask = FAN_OPEN | FAN_CLOSE_WRITE;
+  int ok = 0;
+  f->fd = fanotify_init( FAN_CLASS_CONTENT | FAN_CLOEXEC | FAN_NONBLOCK |
+                         FAN_UNLIMITED_QUEUE,
+                         O_RDONLY | O_LARGEFILE | O_CLOEXEC );
+  if( f->fd < 0 )
+    return ape_status( L, 0, APR_FROM_OS_ERROR( errno ) );
+#ifdef FAN_OPEN_EXEC_PERM
+  /* every new program waits until the reader thread has seen it, so
+   * its group is known even if it exits before its other events are
+   * read (Linux 5.0) */
+  ok = fanotify_mark( f->fd, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                      mask | FAN_OPEN_EXEC_PERM, AT_FDCWD, path ) == 0;
+#endif
+#ifdef FAN_OPEN_EXEC
+  mask |= FAN_OPEN_EXEC;
+#endif
+  if( !ok && fanotify_mark( f->fd, FAN_MARK_ADD | FAN_MARK_MOUNT, mask,
+                            AT_FDCWD, path ) != 0 ) {
+    rv = APR_FROM_OS_ERROR( errno );
+    fan_release( f );
+    return ape_status( L, 0, rv );
+  }
+  ape_assert( L, apr_pool_create( &f->pool, NULL ), "APR memory pool" );
+  f->groups = apr_hash_make( f->pool );
+  f->pids = apr_hash_make( f->pool );
+  if( (rv = apr_thread_mutex_create( &f->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     f->pool )) != APR_SUCCESS ||
+      (rv = apr_thread_create( &f->thread, NULL, fan_thread, f,
+                               f->pool )) != APR_SUCCESS ) {
+    f->thread = NULL;
+    fan_release( f );
+    return ape_status( L, 0, rv );
+  }
+  return 1;
+}
+
+
+/* adds the paths of a group to the table on top of the stack, and
+ * forgets the group */
+static void fan_take_group( lua_State* L, ape_fanotify* f, long key ) {
+  fan_group* g = apr_hash_get( f->groups, &key, sizeof( key ) );
+  if( g != NULL ) {
+    apr_hash_index_t* hi = apr_hash_first( NULL, g->paths );
+    for( ; hi != NULL; hi = apr_hash_next( hi ) ) {
+      void const* path = NULL;
+      apr_ssize_t plen = 0;
+      int* modes = NULL;
+      apr_hash_this( hi, &path, &plen, (void**)&modes );
+      lua_pushlstring( L, path, plen );
+      if( *modes & FAN_WRITE )
+        lua_pushliteral( L, "out" );
+      else {
+        lua_pushvalue( L, -1 );
+        lua_rawget( L, -3 );
+        if( !lua_isnil( L, -1 ) ) { /* keep "out" */
+          lua_pop( L, 2 );
+          continue;
+        }
+        lua_pop( L, 1 );
+        lua_pushliteral( L, "in" );
+      }
+      lua_rawset( L, -3 );
+    }
+    fan_drop_group( f, g );
+  }
+}
+
+
+static int ape_fanotify_take( lua_State* L ) {
+  ape_fanotify* f = moon_checkudata( L, 1, APE_FANOTIFY_NAME );
+  pid_t pgid = (pid_t)luaL_checknumber( L, 2 );
+  char const* cgroup = luaL_optstring( L, 3, NULL );
+  long id = 0;
+  if( f->fd < 0 )
+    luaL_error( L, "attempt to use a closed fanotify listener" );
+  lua_newtable( L );
+  apr_thread_mutex_lock( f->mutex );
+  /* the events of a finished command are already queued */
+  fan_drain( f );
+  fan_take_group( L, f, pgid );
+  if( cgroup != NULL && (id = fan_cgroup_id( f, cgroup )) > 0 )
+    fan_take_group( L, f, -id );
+  fan_prune( f );
+  lua_pushnumber( L, f->lost );
+  apr_thread_mutex_unlock( f->mutex );
+  return 2;
+}
+
+
+static int ape_fanotify_lost( lua_State* L ) {
+  ape_fanotify* f = moon_checkudata( L, 1, APE_FANOTIFY_NAME );
+  lua_Number lost = 0;
+  if( f->mutex != NULL ) {
+    apr_thread_mutex_lock( f->mutex );
+    lost = f->lost;
+    apr_thread_mutex_unlock( f->mutex );
+  }
+  lua_pushnumber( L, lost );
+  return 1;
+}
+
+
+static int ape_fanotify_close( lua_State* L ) {
+  fan_release( moon_checkudata( L, 1, APE_FANOTIFY_NAME ) );
+  lua_pushboolean( L, 1 );
+  return 1;
+}
+
+#endif /* APE_HAVE_FANOTIFY */
+
+
+APE_API void ape_fanotify_setup( lua_State* L ) {
+#ifdef APE_HAVE_FANOTIFY
+  luaL_Reg const ape_fanotify_metamethods[] = {
+    { "__gc", ape_fanotify_gc },
+    { NULL, NULL }
+  };
+  /***
+    Userdata type for fanotify listeners (only on Linux).
+    @type ape_fanotify_t
+  */
+  luaL_Reg const ape_fanotify_methods[] = {
+  /***
+    Returns (and forgets) the paths opened by the processes of a
+    process group (and of a per-command cgroup of buildsh) so far,
+    mapped to `"out"` for files that were written and `"in"`
+    otherwise. The second return value is the number of events so
+    far that couldn't be attributed (because the process hadn't
+    executed a program since the listener was opened and had already
+    been reaped before its first event was read, or because the event
+    queue overflowed).
+    @function take
+    @tparam number pgid the process group id
+    @tparam[opt] string cgroup the path of the cgroup of the command
+    @treturn table the paths
+    @treturn number the number of lost events
+  */
+    { "take", ape_fanotify_take },
+  /***
+    Returns the number of events so far that couldn't be attributed
+    to a process group.
+    @function lost
+    @treturn number the number of lost events
+  */
+    { "lost", ape_fanotify_lost },
+  /***
+    Stops listening for events.
+    @function close
+    @treturn boolean true
+  */
+    { "close", ape_fanotify_close },
+    { NULL, NULL }
+  };
+  moon_object_type const ape_fanotify_type = {
+    APE_FANOTIFY_NAME,
+    sizeof( ape_fanotify ),
+    ape_fanotify_init,
+    ape_fanotify_metamethods,
+    ape_fanotify_methods
+  };
+  luaL_Reg const ape_fanotify_functions[] = {
+  /***
+    Starts listening for file accesses (open, exec, and close after
+    writing) on the whole mount containing the given path. Requires
+    the `CAP_SYS_ADMIN` capability, and is only available on Linux.
+    @function fanotify_open
+    @tparam[opt] string path a path on the mount (default: `"."`)
+    @treturn ape_fanotify_t the listener
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "fanotify_open", ape_fanotify_open },
+    { NULL, NULL }
+  };
+  moon_defobject( L, &ape_fanotify_type, 0 );
+  moon_register( L, ape_fanotify_functions );
+#else
+  (void)L;
+#endif
+}
+
@@ -2,8 +2,10 @@
   @module ape
 */
 #include <stddef.h>
+#include <string.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include <luaconf.h>
 #include <apr_file_info.h>
 #include <apr_portable.h>
 #include <apr_tables.h>
@@ -137,6 +139,177 @@ static int ape_filepath_name_get( lua_State* L ) {
 
 
 
+/* Cache for normalized file paths. The results are kept in a Lua
+ * table (in the uservalue) indexed by the current directory of the
+ * traced process and the path, so that repeated lookups of the same
+ * paths (e.g. header files) don't need any APR calls. The pool for
+ * the APR calls is private and only cleared from time to time.
+ */
+typedef struct {
+  apr_pool_t* pool;
+  unsigned uses;
+} ape_pathcache;
+
+#define PATHCACHE_CLEAR_INTERVAL 64
+
+
+static void ape_pathcache_init( void* p ) {
+  ape_pathcache* c = p;
+  c->pool = NULL;
+  c->uses = 0;
+}
+
+
+static int ape_pathcache_gc( lua_State* L ) {
+  ape_pathcache* c = moon_checkudata( L, 1, APE_PATHCACHE_NAME );
+  if( c->pool != NULL ) {
+    apr_pool_destroy( c->pool );
+    c->pool = NULL;
+  }
+  return 0;
+}
+
+
+static int ape_filepath_cache( lua_State* L ) {
+  ape_pathcache* c = NULL;
+  apr_allocator_t* allocator = NULL;
+  luaL_optstring( L, 1, NULL );
+  c = moon_newobject( L, APE_PATHCACHE_NAME, 0 );
+  ape_assert( L, apr_pool_create( &c->pool, NULL ), "APR memory pool" );
+  allocator = apr_pool_allocator_get( c->pool );
+  if( allocator )
+    apr_allocator_max_free_set( allocator, 32 );
+  lua_pushvalue( L, 1 );
+  moon_setuvfield( L, -2, "cwd" );
+  lua_newtable( L );
+  moon_setuvfield( L, -2, "paths" );
+  return 1;
+}
+
+
+/* computes the path relative to the cwd of buildsh (absolute paths
+ * outside of it and invalid paths yield false) */
+static void pathcache_compute( lua_State* L, ape_pathcache* c,
+                               char const* cwd, char const* ccwd,
+                               char const* p ) {
+  char const* root = NULL;
+  char const* rel = p;
+  char* newpath = NULL;
+  apr_status_t rv = APR_SUCCESS;
+  if( ++c->uses > PATHCACHE_CLEAR_INTERVAL ) {
+    apr_pool_clear( c->pool );
+    c->uses = 1;
+  }
+  rv = apr_filepath_root( &root, &rel, APR_FILEPATH_NATIVE, c->pool );
+  if( rv != APR_SUCCESS && !APR_STATUS_IS_EINCOMPLETE( rv ) ) {
+    if( ccwd == NULL ) {
+      lua_pushboolean( L, 0 );
+      return;
+    }
+    rv = apr_filepath_merge( &newpath, ccwd, p, APR_FILEPATH_NATIVE,
+                             c->pool );
+  } else {
+    size_t n = cwd != NULL ? strlen( cwd ) : 0;
+    size_t m = sizeof( LUA_DIRSEP )-1;
+    if( cwd == NULL || strncmp( p, cwd, n ) != 0 ) {
+      lua_pushboolean( L, 0 );
+      return;
+    }
+    rel = p + n;
+    while( *rel == '/' )
+      ++rel;
+    while( strncmp( rel, LUA_DIRSEP, m ) == 0 )
+      rel += m;
+    rv = apr_filepath_merge( &newpath, ".", rel, APR_FILEPATH_NATIVE,
+                             c->pool );
+  }
+  if( rv == APR_SUCCESS )
+    lua_pushstring( L, newpath != NULL ? newpath : "" );
+  else
+    lua_pushboolean( L, 0 );
+}
+
+
+/* pushes the normalized path for the string at index `pi`, the
+ * cwd string (or nil) and the path table for the current directory
+ * of the process are at `cwdi` and `ti` */
+static void pathcache_get( lua_State* L, ape_pathcache* c, int cwdi,
+                           char const* ccwd, int ti, int pi ) {
+  lua_pushvalue( L, pi );
+  lua_rawget( L, ti );
+  if( lua_isnil( L, -1 ) ) {
+    lua_pop( L, 1 );
+    pathcache_compute( L, c, lua_tostring( L, cwdi ), ccwd,
+                       lua_tostring( L, pi ) );
+    lua_pushvalue( L, pi );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, ti );
+  }
+}
+
+
+/* pushes the cwd string and the path table for the given current
+ * directory of a process (created on demand, an unknown directory is
+ * stored as `false`) */
+static void pathcache_prepare( lua_State* L, int ci, int ccwdi ) {
+  moon_getuvfield( L, ci, "cwd" );
+  moon_getuvfield( L, ci, "paths" );
+  if( lua_isnil( L, ccwdi ) ) {
+    lua_pushboolean( L, 0 );
+    lua_replace( L, ccwdi );
+  }
+  lua_pushvalue( L, ccwdi );
+  lua_rawget( L, -2 );
+  if( lua_isnil( L, -1 ) ) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, ccwdi );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+  }
+  lua_replace( L, -2 );
+}
+
+
+static int ape_pathcache_normalize( lua_State* L ) {
+  ape_pathcache* c = moon_checkudata( L, 1, APE_PATHCACHE_NAME );
+  char const* ccwd = luaL_optstring( L, 2, NULL );
+  int top = 0;
+  luaL_checkstring( L, 3 );
+  lua_settop( L, 3 );
+  pathcache_prepare( L, 1, 2 );
+  top = lua_gettop( L );
+  pathcache_get( L, c, top-1, ccwd, top, 3 );
+  if( !lua_toboolean( L, -1 ) )
+    lua_pushnil( L );
+  return 1;
+}
+
+
+static int ape_pathcache_normalize_many( lua_State* L ) {
+  ape_pathcache* c = moon_checkudata( L, 1, APE_PATHCACHE_NAME );
+  char const* ccwd = luaL_optstring( L, 2, NULL );
+  size_t i = 0, n = 0;
+  luaL_checktype( L, 3, LUA_TTABLE );
+  lua_settop( L, 3 );
+  n = moon_rawlen( L, 3 );
+  pathcache_prepare( L, 1, 2 ); /* at indices 4 and 5 */
+  lua_createtable( L, (int)n, 0 );
+  for( i = 1; i <= n; ++i ) {
+    lua_rawgeti( L, 3, (int)i );
+    if( lua_type( L, -1 ) == LUA_TSTRING ) {
+      pathcache_get( L, c, 4, ccwd, 5, 7 );
+      lua_rawseti( L, 6, (int)i );
+    } else {
+      lua_pushboolean( L, 0 );
+      lua_rawseti( L, 6, (int)i );
+    }
+    lua_pop( L, 1 );
+  }
+  return 1;
+}
+
+
 #define define_flag( L, name, suffix ) \
   do { \
     moon_flag_new_ ## suffix( (L), APR_ ## name ); \
@@ -144,6 +317,47 @@ static int ape_filepath_name_get( lua_State* L ) {
   } while( 0 )
 
 APE_API void ape_fpath_setup( lua_State* L ) {
+  luaL_Reg const ape_pathcache_metamethods[] = {
+    { "__gc", ape_pathcache_gc },
+    { NULL, NULL }
+  };
+  /***
+    Userdata type for caches of normalized file paths.
+    @type ape_pathcache_t
+  */
+  luaL_Reg const ape_pathcache_methods[] = {
+  /***
+    Normalizes a file path accessed by a process. Relative paths are
+    merged with the current directory of the process, absolute paths
+    are made relative to the directory given to `filepath_cache`.
+    Results are cached.
+    @function normalize
+    @tparam ?string cwd the current directory of the process (if
+      known)
+    @tparam string path the file path to normalize
+    @treturn string the normalized path, or nil for absolute paths
+      outside of the directory and invalid paths
+  */
+    { "normalize", ape_pathcache_normalize },
+  /***
+    Normalizes an array of file paths at once.
+    @function normalize_many
+    @tparam ?string cwd the current directory of the process (if
+      known)
+    @tparam table paths an array of file paths
+    @treturn table an array of normalized paths (false for absolute
+      paths outside of the directory and invalid paths)
+  */
+    { "normalize_many", ape_pathcache_normalize_many },
+    { NULL, NULL }
+  };
+  moon_object_type const ape_pathcache_type = {
+    APE_PATHCACHE_NAME,
+    sizeof( ape_pathcache ),
+    ape_pathcache_init,
+    ape_pathcache_metamethods,
+    ape_pathcache_methods
+  };
   /***
     File path manipulation.
     @section filepath
@@ -236,8 +450,17 @@ APE_API void ape_fpath_setup( lua_State* L ) {
     @treturn string the file part of the path
   */
     { "filepath_name_get", ape_filepath_name_get },
+  /***
+    Creates a cache for normalized file paths.
+    @function filepath_cache
+    @tparam[opt] string cwd absolute paths below this directory are
+      made relative to it
+    @treturn ape_pathcache_t the new cache
+  */
+    { "filepath_cache", ape_filepath_cache },
     { NULL, NULL }
   };
+  moon_defobject( L, &ape_pathcache_type, 0 );
   moon_flag_def_fpflags( L, 0 );
   /***
     @class field
@@ -0,0 +1,870 @@
+/***
+  @module ape
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <luaconf.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_fnmatch.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_proc.h>
+#include <apr_thread_mutex.h>
+#include "moon.h"
+#include "ape.h"
+
+#if defined( APR_HAVE_UNISTD_H ) && APR_HAVE_UNISTD_H && \
+    !defined( _WIN32 ) && !defined( _WIN64 )
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <dirent.h>
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  define APE_HAVE_DIRENT 1
+#  if defined( DT_DIR ) && defined( DT_LNK ) && defined( DT_UNKNOWN )
+#    define APE_HAVE_D_TYPE 1
+#  endif
+#  if defined( AT_SYMLINK_NOFOLLOW )
+#    define APE_HAVE_FSTATAT 1
+#  endif
+#  if APR_HAS_THREADS
+#    define APE_HAVE_GLOB_THREADS 1
+#  endif
+#  if defined( __APPLE__ )
+#    define GLOB_MTIME_NSEC( st ) ((st).st_mtimespec.tv_nsec)
+#  elif defined( __linux__ ) || defined( __FreeBSD__ ) || \
+        defined( __NetBSD__ ) || defined( __OpenBSD__ ) || defined( __sun )
+#    define GLOB_MTIME_NSEC( st ) ((st).st_mtim.tv_nsec)
+#  else
+#    define GLOB_MTIME_NSEC( st ) 0
+#  endif
+#endif
+
+/* default and maximum number of threads listing directories */
+#define GLOB_THREADS 8
+#define GLOB_MAX_THREADS 64
+/* minimum number of directories to list in parallel */
+#define GLOB_PARALLEL_MIN 4
+/* maximum number of patterns created by brace expansion */
+#define GLOB_MAX_PATTERNS 4096
+
+/* entry types */
+#define GLOB_OTHER 0
+#define GLOB_DIR 1
+#define GLOB_LNK 2 /* symbolic link or unknown */
+
+
+typedef struct {
+  char const* name;
+  int type;
+} glob_entry;
+
+/* a cached directory listing (allocated as one block via malloc) */
+typedef struct {
+  apr_int64_t stamp; /* modification time of the directory */
+  unsigned epoch; /* the last glob call that checked the stamp */
+  size_t n;
+  glob_entry* entries; /* sorted by name */
+} glob_dir;
+
+/* Cache for directory listings. The listings are kept for the
+ * lifetime of the cache object, but every glob call checks the
+ * modification time of a directory once before using its listing.
+ */
+typedef struct {
+  apr_pool_t* pool; /* for the hash table and its keys */
+  apr_hash_t* dirs; /* path -> glob_dir* */
+  unsigned epoch;
+  int threads;
+} ape_globcache;
+
+/* state of a single glob call */
+typedef struct {
+  ape_globcache* c;
+  apr_pool_t* pool;
+  apr_array_header_t* results;
+  int dironly; /* pattern ends with a directory separator */
+  int strict; /* pattern didn't come from `{a,b}` alternatives */
+  apr_status_t rv;
+} glob_ctx;
+
+
+static int glob_is_sep( char c ) {
+  return c == '/' || c == LUA_DIRSEP[ 0 ];
+}
+
+
+static int glob_ignorable( apr_status_t rv ) {
+  return APR_STATUS_IS_ENOENT( rv ) || APR_STATUS_IS_ENOTDIR( rv ) ||
+         APR_STATUS_IS_EACCES( rv );
+}
+
+
+static char const* glob_dirname( char const* path ) {
+  return *path ? path : ".";
+}
+
+
+static apr_status_t glob_stamp( char const* path, apr_int64_t* stamp,
+                                apr_pool_t* pool ) {
+#ifdef APE_HAVE_DIRENT
+  struct stat st;
+  (void)pool;
+  if( stat( glob_dirname( path ), &st ) != 0 )
+    return APR_FROM_OS_ERROR( errno );
+  if( !S_ISDIR( st.st_mode ) )
+    return APR_ENOTDIR;
+  *stamp = (apr_int64_t)st.st_mtime * 1000000000 + GLOB_MTIME_NSEC( st );
+#else
+  apr_finfo_t finfo;
+  apr_status_t rv = apr_stat( &finfo, glob_dirname( path ),
+                              APR_FINFO_MTIME | APR_FINFO_TYPE, pool );
+  if( rv != APR_SUCCESS && !APR_STATUS_IS_INCOMPLETE( rv ) )
+    return rv;
+  if( (finfo.valid & APR_FINFO_TYPE) && finfo.filetype != APR_DIR )
+    return APR_ENOTDIR;
+  *stamp = (apr_int64_t)finfo.mtime;
+#endif
+  return APR_SUCCESS;
+}
+
+
+/* follows symbolic links */
+static int glob_is_dir( char const* path, apr_pool_t* pool ) {
+#ifdef APE_HAVE_DIRENT
+  struct stat st;
+  (void)pool;
+  return stat( path, &st ) == 0 && S_ISDIR( st.st_mode );
+#else
+  apr_finfo_t finfo;
+  apr_status_t rv = apr_stat( &finfo, path, APR_FINFO_TYPE, pool );
+  return (rv == APR_SUCCESS || APR_STATUS_IS_INCOMPLETE( rv )) &&
+         (finfo.valid & APR_FINFO_TYPE) && finfo.filetype == APR_DIR;
+#endif
+}
+
+
+/* collects the entries of a directory before they are copied into a
+ * single memory block */
+typedef struct {
+  char* strs;
+  size_t used, cap;
+  size_t* offs;
+  int* types;
+  size_t n, ncap;
+} glob_builder;
+
+
+static int glob_add( glob_builder* b, char const* name, int type ) {
+  size_t len = strlen( name ) + 1;
+  if( name[ 0 ] == '.' && (name[ 1 ] == '\0' ||
+      (name[ 1 ] == '.' && name[ 2 ] == '\0')) )
+    return 1;
+  if( b->used + len > b->cap ) {
+    size_t cap = b->cap ? 2 * b->cap : 1024;
+    char* s = NULL;
+    while( cap < b->used + len )
+      cap *= 2;
+    if( (s = realloc( b->strs, cap )) == NULL )
+      return 0;
+    b->strs = s;
+    b->cap = cap;
+  }
+  if( b->n == b->ncap ) {
+    size_t ncap = b->ncap ? 2 * b->ncap : 32;
+    size_t* o = realloc( b->offs, ncap * sizeof( size_t ) );
+    int* t = NULL;
+    if( o == NULL )
+      return 0;
+    b->offs = o;
+    if( (t = realloc( b->types, ncap * sizeof( int ) )) == NULL )
+      return 0;
+    b->types = t;
+    b->ncap = ncap;
+  }
+  memcpy( b->strs + b->used, name, len );
+  b->offs[ b->n ] = b->used;
+  b->types[ b->n ] = type;
+  b->used += len;
+  b->n++;
+  return 1;
+}
+
+
+static void glob_builder_free( glob_builder* b ) {
+  free( b->strs );
+  free( b->offs );
+  free( b->types );
+}
+
+
+static int glob_compare( void const* a, void const* b ) {
+  return strcmp( ((glob_entry const*)a)->name,
+                 ((glob_entry const*)b)->name );
+}
+
+
+static glob_dir* glob_finish( glob_builder* b, apr_int64_t stamp ) {
+  size_t i = 0;
+  glob_dir* d = malloc( sizeof( glob_dir ) + b->n * sizeof( glob_entry ) +
+                        b->used );
+  if( d != NULL ) {
+    char* strs = (char*)(d+1) + b->n * sizeof( glob_entry );
+    d->stamp = stamp;
+    d->epoch = 0;
+    d->n = b->n;
+    d->entries = (glob_entry*)(d+1);
+    if( b->used > 0 )
+      memcpy( strs, b->strs, b->used );
+    for( i = 0; i < b->n; ++i ) {
+      d->entries[ i ].name = strs + b->offs[ i ];
+      d->entries[ i ].type = b->types[ i ];
+    }
+    qsort( d->entries, d->n, sizeof( glob_entry ), glob_compare );
+  }
+  glob_builder_free( b );
+  return d;
+}
+
+
+/* reads a directory; the type of the entries is taken from d_type if
+ * possible, so no stat calls are necessary */
+static apr_status_t glob_read( char const* path, glob_dir** out,
+                               apr_pool_t* pool ) {
+  glob_builder b;
+  apr_int64_t stamp = 0;
+  apr_status_t rv = glob_stamp( path, &stamp, pool );
+  memset( &b, 0, sizeof( b ) );
+  if( rv != APR_SUCCESS )
+    return rv;
+#ifdef APE_HAVE_DIRENT
+  {
+    DIR* d = opendir( glob_dirname( path ) );
+    struct dirent* e = NULL;
+    if( d == NULL )
+      return APR_FROM_OS_ERROR( errno );
+    while( (e = readdir( d )) != NULL ) {
+      int type = GLOB_LNK;
+#ifdef APE_HAVE_D_TYPE
+      if( e->d_type == DT_DIR )
+        type = GLOB_DIR;
+      else if( e->d_type != DT_LNK && e->d_type != DT_UNKNOWN )
+        type = GLOB_OTHER;
+      else if( e->d_type == DT_UNKNOWN )
+#endif
+      {
+#ifdef APE_HAVE_FSTATAT
+        struct stat st;
+        if( fstatat( dirfd( d ), e->d_name, &st,
+                     AT_SYMLINK_NOFOLLOW ) == 0 )
+          type = S_ISDIR( st.st_mode ) ? GLOB_DIR :
+                 (S_ISLNK( st.st_mode ) ? GLOB_LNK : GLOB_OTHER);
+#endif
+      }
+      if( !glob_add( &b, e->d_name, type ) ) {
+        closedir( d );
+        glob_builder_free( &b );
+        return APR_ENOMEM;
+      }
+    }
+    closedir( d );
+  }
+#else
+  {
+    apr_pool_t* sub = NULL;
+    apr_dir_t* dir = NULL;
+    apr_finfo_t finfo;
+    if( (rv = apr_pool_create( &sub, pool )) != APR_SUCCESS )
+      return rv;
+    if( (rv = apr_dir_open( &dir, glob_dirname( path ), sub )) != APR_SUCCESS ) {
+      apr_pool_destroy( sub );
+      return rv;
+    }
+    while( (rv = apr_dir_read( &finfo, APR_FINFO_NAME | APR_FINFO_TYPE |
+                               APR_FINFO_LINK, dir )) == APR_SUCCESS ||
+           APR_STATUS_IS_INCOMPLETE( rv ) ) {
+      int type = GLOB_LNK;
+      if( finfo.valid & APR_FINFO_TYPE ) {
+        if( finfo.filetype == APR_DIR )
+          type = GLOB_DIR;
+        else if( finfo.filetype != APR_LNK )
+          type = GLOB_OTHER;
+      }
+      if( !glob_add( &b, finfo.name, type ) ) {
+        apr_dir_close( dir );
+        apr_pool_destroy( sub );
+        glob_builder_free( &b );
+        return APR_ENOMEM;
+      }
+    }
+    apr_dir_close( dir );
+    apr_pool_destroy( sub );
+  }
+#endif
+  if( (*out = glob_finish( &b, stamp )) == NULL )
+    return APR_ENOMEM;
+  return APR_SUCCESS;
+}
+
+
+static void glob_store( ape_globcache* c, char const* path, glob_dir* old,
+                        glob_dir* d ) {
+  if( d == old ) {
+    if( d != NULL )
+      d->epoch = c->epoch;
+    return;
+  }
+  if( d != NULL )
+    d->epoch = c->epoch;
+  if( old != NULL ) /* the key already exists */
+    apr_hash_set( c->dirs, path, APR_HASH_KEY_STRING, d );
+  else if( d != NULL )
+    apr_hash_set( c->dirs, apr_pstrdup( c->pool, path ),
+                  APR_HASH_KEY_STRING, d );
+  free( old );
+}
+
+
+/* returns the (checked) listing of a directory or NULL. Missing
+ * directories are only an error if `strict` is set. */
+static glob_dir* glob_lookup( glob_ctx* x, char const* path,
+                              int strict ) {
+  glob_dir* old = apr_hash_get( x->c->dirs, path, APR_HASH_KEY_STRING );
+  glob_dir* d = NULL;
+  apr_status_t rv = APR_SUCCESS;
+  if( old != NULL ) {
+    apr_int64_t stamp = 0;
+    if( old->epoch == x->c->epoch )
+      return old;
+    rv = glob_stamp( path, &stamp, x->pool );
+    if( rv == APR_SUCCESS && stamp == old->stamp )
+      d = old;
+  }
+  if( d == NULL )
+    rv = glob_read( path, &d, x->pool );
+  if( rv != APR_SUCCESS ) {
+    d = NULL;
+    if( (strict || !glob_ignorable( rv )) && x->rv == APR_SUCCESS )
+      x->rv = rv;
+  }
+  glob_store( x->c, path, old, d );
+  return d;
+}
+
+
+static char const* glob_join( glob_ctx* x, char const* path,
+                              char const* name ) {
+  size_t len = strlen( path );
+  if( len == 0 )
+    return apr_pstrdup( x->pool, name );
+  else if( glob_is_sep( path[ len-1 ] ) )
+    return apr_pstrcat( x->pool, path, name, NULL );
+  return apr_pstrcat( x->pool, path, LUA_DIRSEP, name, NULL );
+}
+
+
+static int glob_hidden( glob_entry const* e ) {
+  return e->name[ 0 ] == '.';
+}
+
+
+
+#ifdef APE_HAVE_GLOB_THREADS
+/* Directories below a `**` are listed level by level, and the
+ * directories of a level are listed (or checked) by multiple threads
+ * before the (sequential) matching of the pattern uses the cache. */
+typedef struct {
+  char const* path;
+  glob_dir* old;
+  glob_dir* dir;
+  apr_status_t rv;
+} glob_task;
+
+typedef struct {
+  glob_task* tasks;
+  size_t n;
+  size_t next;
+  apr_thread_mutex_t* mutex;
+} glob_work;
+
+
+static void glob_run_tasks( glob_work* w ) {
+  for( ;; ) {
+    glob_task* t = NULL;
+    apr_int64_t stamp = 0;
+    if( w->mutex != NULL )
+      apr_thread_mutex_lock( w->mutex );
+    if( w->next < w->n )
+      t = w->tasks + w->next++;
+    if( w->mutex != NULL )
+      apr_thread_mutex_unlock( w->mutex );
+    if( t == NULL )
+      break;
+    /* no pool necessary when using dirent.h */
+    if( t->old != NULL &&
+        glob_stamp( t->path, &stamp, NULL ) == APR_SUCCESS &&
+        stamp == t->old->stamp )
+      t->dir = t->old;
+    else
+      t->rv = glob_read( t->path, &t->dir, NULL );
+  }
+}
+
+
+static void* APR_THREAD_FUNC glob_thread( apr_thread_t* t, void* p ) {
+  glob_run_tasks( p );
+  apr_thread_exit( t, APR_SUCCESS );
+  return NULL;
+}
+
+
+static void glob_prefetch( glob_ctx* x, char const* root ) {
+  apr_array_header_t* level = apr_array_make( x->pool, 16,
+                                              sizeof( char const* ) );
+  APR_ARRAY_PUSH( level, char const* ) = root;
+  while( level->nelts > 0 && x->rv == APR_SUCCESS ) {
+    apr_array_header_t* next = apr_array_make( x->pool, level->nelts,
+                                               sizeof( char const* ) );
+    glob_work w;
+    int i = 0;
+    size_t j = 0;
+    memset( &w, 0, sizeof( w ) );
+    w.tasks = apr_palloc( x->pool, level->nelts * sizeof( glob_task ) );
+    for( i = 0; i < level->nelts; ++i ) {
+      char const* p = APR_ARRAY_IDX( level, i, char const* );
+      glob_dir* d = apr_hash_get( x->c->dirs, p, APR_HASH_KEY_STRING );
+      if( d == NULL || d->epoch != x->c->epoch ) {
+        glob_task* t = w.tasks + w.n++;
+        t->path = p;
+        t->old = d;
+        t->dir = NULL;
+        t->rv = APR_SUCCESS;
+      }
+    }
+    if( x->c->threads > 1 && w.n >= GLOB_PARALLEL_MIN &&
+        apr_thread_mutex_create( &w.mutex, APR_THREAD_MUTEX_DEFAULT,
+                                 x->pool ) == APR_SUCCESS ) {
+      apr_thread_t* threads[ GLOB_MAX_THREADS ];
+      int n = 0, nthreads = x->c->threads;
+      if( (size_t)nthreads > w.n )
+        nthreads = (int)w.n;
+      for( n = 0; n < nthreads; ++n ) {
+        if( apr_thread_create( threads+n, NULL, glob_thread, &w,
+                               x->pool ) != APR_SUCCESS )
+          break;
+      }
+      while( n-- > 0 ) {
+        apr_status_t rv = APR_SUCCESS;
+        apr_thread_join( &rv, threads[ n ] );
+      }
+      w.mutex = NULL;
+    }
+    /* does everything if no thread could be started */
+    glob_run_tasks( &w );
+    for( j = 0; j < w.n; ++j ) {
+      glob_task* t = w.tasks + j;
+      if( t->rv != APR_SUCCESS && !glob_ignorable( t->rv ) &&
+          x->rv == APR_SUCCESS )
+        x->rv = t->rv;
+      glob_store( x->c, t->path, t->old, t->dir );
+    }
+    for( i = 0; i < level->nelts; ++i ) {
+      char const* p = APR_ARRAY_IDX( level, i, char const* );
+      glob_dir* d = apr_hash_get( x->c->dirs, p, APR_HASH_KEY_STRING );
+      if( d != NULL ) {
+        for( j = 0; j < d->n; ++j ) {
+          if( d->entries[ j ].type == GLOB_DIR &&
+              !glob_hidden( d->entries + j ) )
+            APR_ARRAY_PUSH( next, char const* ) =
+              glob_join( x, p, d->entries[ j ].name );
+        }
+      }
+    }
+    level = next;
+  }
+}
+#endif
+
+
+static int glob_has_magic( char const* s ) {
+  return strpbrk( s, "*?[" ) != NULL;
+}
+
+
+static void glob_result( glob_ctx* x, glob_entry const* e,
+                         char const* path ) {
+  if( !x->dironly || e->type == GLOB_DIR ||
+      (e->type == GLOB_LNK && glob_is_dir( path, x->pool )) )
+    APR_ARRAY_PUSH( x->results, char const* ) = path;
+}
+
+
+/* a directory given literally at the start of a pattern (like `srcc`
+ * when `src` was meant) must exist, so that typos in build scripts
+ * don't go unnoticed. Directories that only some of the matches have
+ * are skipped if they are missing. */
+static int glob_strict( glob_ctx* x, char** comps, int ci, int deep ) {
+  int i = 0;
+  if( !x->strict || deep )
+    return 0;
+  for( i = 0; i < ci; ++i ) {
+    if( glob_has_magic( comps[ i ] ) )
+      return 0;
+  }
+  return 1;
+}
+
+
+/* matches the path components `comps[ ci .. m-1 ]` below `path`; a
+ * `**` component matches zero or more (non-hidden) directories, but
+ * symbolic links are not followed there */
+static void glob_walk( glob_ctx* x, char const* path, char** comps,
+                       int ci, int m, int deep ) {
+  char const* comp = comps[ ci ];
+  int strict = glob_strict( x, comps, ci, deep );
+  glob_dir* d = NULL;
+  size_t i = 0;
+  if( x->rv != APR_SUCCESS )
+    return;
+  if( strcmp( comp, "**" ) == 0 ) {
+#ifdef APE_HAVE_GLOB_THREADS
+    if( !deep && x->c->threads > 1 )
+      glob_prefetch( x, path );
+#endif
+    if( ci+1 < m )
+      glob_walk( x, path, comps, ci+1, m, 1 );
+    if( (d = glob_lookup( x, path, strict )) == NULL )
+      return;
+    for( i = 0; i < d->n; ++i ) {
+      glob_entry const* e = d->entries + i;
+      if( !glob_hidden( e ) ) {
+        char const* child = glob_join( x, path, e->name );
+        /* a trailing `**` matches all files and directories */
+        if( ci+1 == m )
+          glob_result( x, e, child );
+        if( e->type == GLOB_DIR )
+          glob_walk( x, child, comps, ci, m, 1 );
+      }
+    }
+  } else if( !glob_has_magic( comp ) ) {
+    if( ci+1 < m )
+      glob_walk( x, glob_join( x, path, comp ), comps, ci+1, m, deep );
+    else if( (d = glob_lookup( x, path, strict )) != NULL ) {
+      glob_entry key;
+      glob_entry const* e = NULL;
+      key.name = comp;
+      e = bsearch( &key, d->entries, d->n, sizeof( glob_entry ),
+                   glob_compare );
+      if( e != NULL )
+        glob_result( x, e, glob_join( x, path, comp ) );
+    }
+  } else if( (d = glob_lookup( x, path, strict )) != NULL ) {
+    for( i = 0; i < d->n; ++i ) {
+      glob_entry const* e = d->entries + i;
+      if( apr_fnmatch( comp, e->name, 0 ) == APR_SUCCESS ) {
+        char const* child = glob_join( x, path, e->name );
+        if( ci+1 == m )
+          glob_result( x, e, child );
+        else if( e->type == GLOB_DIR ||
+                 (e->type == GLOB_LNK && glob_is_dir( child, x->pool )) )
+          glob_walk( x, child, comps, ci+1, m, deep );
+      }
+    }
+  }
+}
+
+
+/* finds the first pair of braces containing a top-level comma */
+static int glob_find_braces( char const* p, size_t* open, size_t* close ) {
+  size_t i = 0;
+  for( i = 0; p[ i ] != '\0'; ++i ) {
+    if( p[ i ] == '{' ) {
+      size_t j = 0;
+      int depth = 0, comma = 0;
+      for( j = i; p[ j ] != '\0'; ++j ) {
+        if( p[ j ] == '{' )
+          ++depth;
+        else if( p[ j ] == '}' && --depth == 0 )
+          break;
+        else if( p[ j ] == ',' && depth == 1 )
+          comma = 1;
+      }
+      if( p[ j ] == '\0' )
+        return 0;
+      if( comma ) {
+        *open = i;
+        *close = j;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/* expands `{a,b,c}` alternatives (possibly nested) into separate
+ * patterns */
+static apr_status_t glob_braces( apr_array_header_t* out, char const* p,
+                                 apr_pool_t* pool ) {
+  size_t open = 0, close = 0;
+  if( !glob_find_braces( p, &open, &close ) ) {
+    if( out->nelts >= GLOB_MAX_PATTERNS )
+      return APR_EINVAL;
+    APR_ARRAY_PUSH( out, char const* ) = p;
+  } else {
+    size_t start = open + 1, i = 0;
+    int depth = 0;
+    for( i = open+1; i <= close; ++i ) {
+      if( p[ i ] == '{' )
+        ++depth;
+      else if( p[ i ] == '}' && depth > 0 )
+        --depth;
+      else if( (p[ i ] == ',' && depth == 0) || i == close ) {
+        apr_status_t rv = glob_braces( out, apr_pstrcat( pool,
+          apr_pstrndup( pool, p, open ),
+          apr_pstrndup( pool, p+start, i-start ),
+          p + close + 1, NULL ), pool );
+        if( rv != APR_SUCCESS )
+          return rv;
+        start = i + 1;
+      }
+    }
+  }
+  return APR_SUCCESS;
+}
+
+
+static apr_status_t glob_pattern( glob_ctx* x, char const* pattern ) {
+  char const* root = NULL;
+  char const* rest = pattern;
+  char** comps = NULL;
+  char* s = NULL;
+  char* c = NULL;
+  int m = 0;
+  apr_status_t rv = apr_filepath_root( &root, &rest, APR_FILEPATH_NATIVE,
+                                       x->pool );
+  if( APR_STATUS_IS_ERELATIVE( rv ) ) {
+    root = "";
+    rest = pattern;
+  } else if( rv != APR_SUCCESS && !APR_STATUS_IS_EINCOMPLETE( rv ) )
+    return rv;
+  /* split the rest of the pattern into path components */
+  s = apr_pstrdup( x->pool, rest );
+  x->dironly = *s != '\0' && glob_is_sep( s[ strlen( s )-1 ] );
+  comps = apr_palloc( x->pool, (strlen( s )/2 + 2) * sizeof( char* ) );
+  for( c = s; *c != '\0'; ) {
+    while( glob_is_sep( *c ) )
+      *c++ = '\0';
+    if( *c != '\0' ) {
+      comps[ m++ ] = c;
+      while( *c != '\0' && !glob_is_sep( *c ) )
+        ++c;
+    }
+  }
+  if( m > 0 )
+    glob_walk( x, root, comps, 0, m, 0 );
+  return x->rv;
+}
+
+
+static void ape_globcache_init( void* p ) {
+  ape_globcache* c = p;
+  c->pool = NULL;
+  c->dirs = NULL;
+  c->epoch = 0;
+  c->threads = GLOB_THREADS;
+}
+
+
+static void globcache_free( ape_globcache* c ) {
+  if( c->dirs != NULL ) {
+    apr_hash_index_t* hi = NULL;
+    for( hi = apr_hash_first( NULL, c->dirs ); hi; hi = apr_hash_next( hi ) ) {
+      void* d = NULL;
+      apr_hash_this( hi, NULL, NULL, &d );
+      free( d );
+    }
+    c->dirs = NULL;
+  }
+  if( c->pool != NULL ) {
+    apr_pool_destroy( c->pool );
+    c->pool = NULL;
+  }
+}
+
+
+static void globcache_create( lua_State* L, ape_globcache* c ) {
+  ape_assert( L, apr_pool_create( &c->pool, NULL ), "APR memory pool" );
+  c->dirs = apr_hash_make( c->pool );
+}
+
+
+static int ape_globcache_gc( lua_State* L ) {
+  globcache_free( moon_checkudata( L, 1, APE_GLOBCACHE_NAME ) );
+  return 0;
+}
+
+
+static int ape_globcache_clear( lua_State* L ) {
+  ape_globcache* c = moon_checkudata( L, 1, APE_GLOBCACHE_NAME );
+  globcache_free( c );
+  globcache_create( L, c );
+  return 0;
+}
+
+
+static int glob_strcmp( void const* a, void const* b ) {
+  return strcmp( *(char const* const*)a, *(char const* const*)b );
+}
+
+
+static int ape_globcache_glob( lua_State* L ) {
+  ape_globcache* c = moon_checkudata( L, 1, APE_GLOBCACHE_NAME );
+  int have_tab = lua_istable( L, 2 ) && !lua_isnoneornil( L, 3 );
+  int pi = 2 + have_tab;
+  size_t tab_len = 0, i = 0, n = 0;
+  apr_array_header_t* patterns = NULL;
+  apr_array_header_t* strictness = NULL;
+  glob_ctx x;
+  apr_status_t rv = APR_SUCCESS;
+  if( !lua_istable( L, pi ) )
+    luaL_checkstring( L, pi );
+  if( c->pool == NULL )
+    luaL_error( L, "attempt to use a closed glob cache" );
+  if( have_tab )
+    tab_len = moon_rawlen( L, 2 );
+  memset( &x, 0, sizeof( x ) );
+  x.c = c;
+  ape_assert( L, apr_pool_create( &x.pool, c->pool ), "APR memory pool" );
+  x.results = apr_array_make( x.pool, 64, sizeof( char const* ) );
+  patterns = apr_array_make( x.pool, 4, sizeof( char const* ) );
+  strictness = apr_array_make( x.pool, 4, sizeof( int ) );
+  n = lua_istable( L, pi ) ? moon_rawlen( L, pi ) : 1;
+  for( i = 0; i < n && rv == APR_SUCCESS; ++i ) {
+    char const* p = NULL;
+    int before = patterns->nelts;
+    if( lua_istable( L, pi ) ) {
+      lua_rawgeti( L, pi, (int)i+1 );
+      p = lua_tostring( L, -1 );
+      if( p == NULL ) {
+        apr_pool_destroy( x.pool );
+        luaL_argerror( L, pi, "array of strings expected" );
+      }
+      p = apr_pstrdup( x.pool, p );
+      lua_pop( L, 1 );
+    } else
+      p = lua_tostring( L, pi );
+    rv = glob_braces( patterns, p, x.pool );
+    /* alternatives may refer to directories that don't exist */
+    if( rv == APR_SUCCESS ) {
+      int strict = patterns->nelts == before+1 &&
+                   APR_ARRAY_IDX( patterns, before, char const* ) == p;
+      while( strictness->nelts < patterns->nelts )
+        APR_ARRAY_PUSH( strictness, int ) = strict;
+    }
+  }
+  c->epoch++;
+  for( i = 0; i < (size_t)patterns->nelts && rv == APR_SUCCESS; ++i ) {
+    x.strict = APR_ARRAY_IDX( strictness, i, int );
+    rv = glob_pattern( &x, APR_ARRAY_IDX( patterns, i, char const* ) );
+  }
+  if( rv != APR_SUCCESS ) {
+    apr_pool_destroy( x.pool );
+    return ape_status( L, 0, rv );
+  }
+  /* sorted and without duplicates */
+  qsort( x.results->elts, x.results->nelts, sizeof( char const* ),
+         glob_strcmp );
+  if( have_tab )
+    lua_pushvalue( L, 2 );
+  else
+    lua_createtable( L, x.results->nelts, 0 );
+  for( i = 0; i < (size_t)x.results->nelts; ++i ) {
+    char const* r = APR_ARRAY_IDX( x.results, i, char const* );
+    if( i == 0 || strcmp( r, APR_ARRAY_IDX( x.results, i-1,
+                                            char const* ) ) != 0 ) {
+      lua_pushstring( L, r );
+      lua_rawseti( L, -2, (int)++tab_len );
+    }
+  }
+  apr_pool_destroy( x.pool );
+  return 1;
+}
+
+
+static int ape_glob_cache( lua_State* L ) {
+  int threads = luaL_optint( L, 1, GLOB_THREADS );
+  ape_globcache* c = moon_newobject( L, APE_GLOBCACHE_NAME, 0 );
+  if( threads > GLOB_MAX_THREADS )
+    threads = GLOB_MAX_THREADS;
+  c->threads = threads;
+  globcache_create( L, c );
+  return 1;
+}
+
+
+APE_API void ape_glob_setup( lua_State* L ) {
+  luaL_Reg const ape_globcache_metamethods[] = {
+    { "__gc", ape_globcache_gc },
+    { NULL, NULL }
+  };
+  /***
+    Userdata type for caches of directory listings.
+    @type ape_globcache_t
+  */
+  luaL_Reg const ape_globcache_methods[] = {
+  /***
+    Returns a sorted array (without duplicates) of the paths matching
+    any of the given patterns. Every path component may contain glob
+    characters, a `**` component matches zero or more directories
+    (hidden directories and symbolic links are skipped), and `{a,b}`
+    expands to alternatives. A trailing directory separator restricts
+    the matches to directories. A missing directory at the start of a
+    pattern (before any glob characters) is an error, unless the
+    pattern contains alternatives. The directory listings are cached, but
+    the modification time of every directory is checked once per
+    call.
+    @function glob
+    @tparam[opt] table t append the paths to this table if given
+    @tparam string|table patterns a pattern or an array of patterns
+    @treturn table an array of paths
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "glob", ape_globcache_glob },
+  /***
+    Removes all cached directory listings.
+    @function clear
+  */
+    { "clear", ape_globcache_clear },
+    { NULL, NULL }
+  };
+  moon_object_type const ape_globcache_type = {
+    APE_GLOBCACHE_NAME,
+    sizeof( ape_globcache ),
+    ape_globcache_init,
+    ape_globcache_metamethods,
+    ape_globcache_methods
+  };
+  luaL_Reg const ape_glob_functions[] = {
+  /***
+    Creates a cache for directory listings used for globbing.
+    Directory trees below `**` are listed by multiple threads.
+    @function glob_cache
+    @tparam[opt] number threads the maximum number of threads
+      (default: 8)
+    @treturn ape_globcache_t the new cache
+  */
+    { "glob_cache", ape_glob_cache },
+    { NULL, NULL }
+  };
+  moon_defobject( L, &ape_globcache_type, 0 );
+  moon_register( L, ape_glob_functions );
+}
+
@@ -0,0 +1,968 @@
+/***
+  @module ape
+*/
+#if !defined( _GNU_SOURCE ) && defined( __linux__ )
+/* for posix_spawn_file_actions_addchdir_np */
+#  define _GNU_SOURCE
+#endif
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_poll.h>
+#include <apr_time.h>
+#include "moon.h"
+#include "ape.h"
+
+/* posix_spawn uses vfork (or an equivalent clone) on most systems, so
+ * starting a command doesn't copy the page tables of the (possibly
+ * large) buildsh process */
+#if defined( APR_HAVE_UNISTD_H ) && APR_HAVE_UNISTD_H && \
+    !defined( _WIN32 ) && !defined( _WIN64 )
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <spawn.h>
+#  include <apr_portable.h>
+#  define APE_HAVE_POSIX_SPAWN 1
+extern char** environ;
+/* changing the working directory needs a non-standard extension */
+#  if (defined( __GLIBC__ ) && (__GLIBC__ > 2 || \
+       (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) || \
+      (defined( __APPLE__ ) && defined( __MACH__ ))
+#    define APE_HAVE_SPAWN_CHDIR 1
+#  endif
+#endif
+
+/***
+  Asynchronous jobs.
+  @section jobs
+*/
+/***
+  Userdata type for a child process whose standard output and
+  standard error are captured.
+  @type ape_job_t
+*/
+
+/* interval for checking on children that have closed their pipes */
+#define JOB_REAP_INTERVAL 10000
+/* interval for checking whether children with open pipes have exited
+ * (background processes they started may still hold the pipes) */
+#define JOB_EXIT_INTERVAL 100000
+/* output of such background processes is collected for this long
+ * after the child has exited, then the pipes are closed */
+#define JOB_LINGER_TIME apr_time_from_sec( 1 )
+/* captured output is kept in chunks of this size ... */
+#define JOB_CHUNK_SIZE 65536
+/* ... until this limit, the rest goes to a temporary file */
+#define JOB_MEMORY_LIMIT (4*1024*1024)
+/* maximum number of reads from one pipe before serving others */
+#define JOB_MAX_READS 64
+
+typedef struct job_chunk {
+  struct job_chunk* next;
+  size_t len;
+  char data[ JOB_CHUNK_SIZE ];
+} job_chunk;
+
+typedef struct {
+  job_chunk* head;
+  job_chunk* tail;
+  size_t size; /* number of bytes in memory */
+  apr_file_t* spill; /* temporary file (deleted on close) */
+  apr_status_t error; /* why output was lost (or APR_SUCCESS) */
+} job_buffer;
+
+typedef struct {
+  apr_proc_t proc;
+  apr_pool_t* pool; /* for the temporary files */
+  apr_pool_t* own; /* pool owned by the job (or NULL) */
+  apr_file_t* pipes[ 2 ]; /* parent ends of stdout and stderr */
+  job_buffer bufs[ 2 ];
+  int started;
+  int done;
+  apr_time_t exited; /* when the child was reaped (or 0) */
+  int exitcode;
+  apr_exit_why_e why;
+  ape_rusage usage;
+} ape_job;
+
+
+static void job_init( void* p ) {
+  ape_job* job = p;
+  memset( job, 0, sizeof( *job ) );
+}
+
+
+static void job_buffer_clear( job_buffer* b ) {
+  job_chunk* c = b->head;
+  while( c != NULL ) {
+    job_chunk* next = c->next;
+    free( c );
+    c = next;
+  }
+  b->head = b->tail = NULL;
+  b->size = 0;
+  b->error = APR_SUCCESS;
+  if( b->spill != NULL ) {
+    apr_file_close( b->spill );
+    b->spill = NULL;
+  }
+}
+
+
+/* appends data that doesn't fit into memory to a temporary file. If
+ * that fails, the data is lost and the error is remembered, so that
+ * the incomplete output is never passed on as if it were complete. */
+static void job_buffer_spill( ape_job* job, job_buffer* b,
+                              char const* data, apr_size_t len ) {
+  apr_status_t rv = APR_SUCCESS;
+  if( b->error != APR_SUCCESS )
+    return;
+  if( b->spill == NULL ) {
+    char const* tmpdir = NULL;
+    if( job->pool == NULL )
+      rv = APR_ENOMEM;
+    else if( (rv = apr_temp_dir_get( &tmpdir, job->pool )) == APR_SUCCESS ) {
+      char* tmpl = apr_pstrcat( job->pool, tmpdir, "/buildshXXXXXX", NULL );
+      rv = apr_file_mktemp( &b->spill, tmpl, APR_FOPEN_CREATE |
+                            APR_FOPEN_READ | APR_FOPEN_WRITE |
+                            APR_FOPEN_EXCL | APR_FOPEN_DELONCLOSE,
+                            job->pool );
+      if( rv != APR_SUCCESS )
+        b->spill = NULL;
+    }
+  }
+  if( rv == APR_SUCCESS )
+    rv = apr_file_write_full( b->spill, data, len, NULL );
+  b->error = rv;
+}
+
+
+/* calls `f` for every piece of the buffered data */
+static void job_buffer_walk( job_buffer* b,
+                             void (*f)( void*, char const*, size_t ),
+                             void* ud ) {
+  job_chunk* c = b->head;
+  for( ; c != NULL; c = c->next )
+    f( ud, c->data, c->len );
+  if( b->spill != NULL ) {
+    apr_off_t off = 0;
+    char buffer[ 4096 ];
+    apr_status_t rv = apr_file_seek( b->spill, APR_SET, &off );
+    while( rv == APR_SUCCESS ) {
+      apr_size_t n = sizeof( buffer );
+      rv = apr_file_read( b->spill, buffer, &n );
+      if( n > 0 )
+        f( ud, buffer, n );
+    }
+    off = 0;
+    apr_file_seek( b->spill, APR_END, &off );
+  }
+}
+
+
+static void job_close_pipes( ape_job* job ) {
+  int i = 0;
+  for( i = 0; i < 2; ++i ) {
+    if( job->pipes[ i ] != NULL ) {
+      apr_file_close( job->pipes[ i ] );
+      job->pipes[ i ] = NULL;
+    }
+  }
+}
+
+
+static void job_release( ape_job* job ) {
+  job_close_pipes( job );
+  if( job->started && !job->done && job->exited == 0 ) {
+    apr_proc_kill( &job->proc, SIGTERM );
+    ape_proc_wait_rusage( &job->proc, &job->exitcode, &job->why,
+                          APR_WAIT, &job->usage );
+    job->done = 1;
+  }
+  job_buffer_clear( job->bufs );
+  job_buffer_clear( job->bufs+1 );
+  if( job->own != NULL ) {
+    apr_pool_destroy( job->own );
+    job->own = job->pool = NULL;
+  }
+}
+
+
+/* reads what is currently available from a (nonblocking) pipe
+ * (directly into the chunks of the buffer) and closes the pipe on end
+ * of file */
+static apr_size_t job_drain( ape_job* job, int i ) {
+  job_buffer* b = job->bufs + i;
+  apr_size_t total = 0;
+  int n = 0;
+  for( n = 0; n < JOB_MAX_READS && job->pipes[ i ] != NULL; ++n ) {
+    apr_status_t rv = APR_SUCCESS;
+    apr_size_t size = 0;
+    job_chunk* c = b->tail;
+    if( (c == NULL || c->len == JOB_CHUNK_SIZE) &&
+        b->size < JOB_MEMORY_LIMIT && b->spill == NULL ) {
+      c = malloc( sizeof( job_chunk ) );
+      if( c != NULL ) {
+        c->next = NULL;
+        c->len = 0;
+        if( b->tail != NULL )
+          b->tail->next = c;
+        else
+          b->head = c;
+        b->tail = c;
+      }
+    }
+    if( c != NULL && c->len < JOB_CHUNK_SIZE && b->spill == NULL ) {
+      size = JOB_CHUNK_SIZE - c->len;
+      rv = apr_file_read( job->pipes[ i ], c->data + c->len, &size );
+      c->len += size;
+      b->size += size;
+    } else {
+      char buffer[ 16384 ];
+      size = sizeof( buffer );
+      rv = apr_file_read( job->pipes[ i ], buffer, &size );
+      if( size > 0 )
+        job_buffer_spill( job, b, buffer, size );
+    }
+    total += size;
+    if( rv != APR_SUCCESS ) {
+      if( !APR_STATUS_IS_EAGAIN( rv ) ) { /* EOF or error */
+        apr_file_close( job->pipes[ i ] );
+        job->pipes[ i ] = NULL;
+      }
+      break;
+    }
+  }
+  return total;
+}
+
+
+static void job_add_lua( void* ud, char const* s, size_t n ) {
+  luaL_addlstring( ud, s, n );
+}
+
+
+static void job_add_file( void* ud, char const* s, size_t n ) {
+  fwrite( s, 1, n, ud );
+}
+
+
+static void job_push_buffer( lua_State* L, job_buffer* b ) {
+  luaL_Buffer buf;
+  luaL_buffinit( L, &buf );
+  job_buffer_walk( b, job_add_lua, &buf );
+  luaL_pushresult( &buf );
+}
+
+
+/* reaps the child process. A job is done once the child has exited
+ * and both pipes are closed, or `JOB_LINGER_TIME` after the child has
+ * exited if processes left in the background keep the pipes open. */
+static int job_check( ape_job* job ) {
+  if( !job->done && job->exited == 0 ) {
+    apr_status_t rv = ape_proc_wait_rusage( &job->proc, &job->exitcode,
+                                            &job->why, APR_NOWAIT,
+                                            &job->usage );
+    if( rv == APR_CHILD_DONE )
+      job->exited = apr_time_now();
+    else if( rv != APR_CHILD_NOTDONE ) { /* not our child anymore */
+      job->exited = apr_time_now();
+      job->why = APR_PROC_SIGNAL;
+      job->exitcode = 0;
+    }
+  }
+  if( !job->done && job->exited != 0 ) {
+    if( job->pipes[ 0 ] != NULL || job->pipes[ 1 ] != NULL ) {
+      if( apr_time_now() - job->exited < JOB_LINGER_TIME )
+        return 0;
+      job_drain( job, 0 );
+      job_drain( job, 1 );
+      job_close_pipes( job );
+    }
+    job->done = 1;
+  }
+  return job->done;
+}
+
+
+/* waits until one of the given jobs has finished; a negative timeout
+ * means no timeout. On success `*which` is the index of the finished
+ * job, or `n` if the timeout expired. */
+static apr_status_t job_wait( ape_job** jobs, size_t n,
+                              apr_interval_time_t timeout,
+                              apr_pollfd_t* fds, size_t* which ) {
+  apr_time_t deadline = timeout >= 0 ? apr_time_now() + timeout : 0;
+  while( 1 ) {
+    apr_interval_time_t t = -1;
+    apr_interval_time_t check = JOB_EXIT_INTERVAL;
+    apr_int32_t nfds = 0;
+    size_t i = 0;
+    int j = 0;
+    for( i = 0; i < n; ++i ) {
+      if( job_check( jobs[ i ] ) ) {
+        *which = i;
+        return APR_SUCCESS;
+      }
+      if( jobs[ i ]->exited != 0 ||
+          (jobs[ i ]->pipes[ 0 ] == NULL && jobs[ i ]->pipes[ 1 ] == NULL) )
+        check = JOB_REAP_INTERVAL;
+      for( j = 0; j < 2; ++j ) {
+        if( jobs[ i ]->pipes[ j ] != NULL ) {
+          apr_pollfd_t* fd = fds + nfds++;
+          memset( fd, 0, sizeof( *fd ) );
+          fd->desc_type = APR_POLL_FILE;
+          fd->reqevents = APR_POLLIN;
+          fd->desc.f = jobs[ i ]->pipes[ j ];
+          fd->client_data = jobs[ i ];
+        }
+      }
+    }
+    if( n == 0 ) {
+      *which = n;
+      return APR_SUCCESS;
+    }
+    if( timeout >= 0 ) {
+      t = deadline - apr_time_now();
+      if( t < 0 )
+        t = 0;
+    }
+    /* children that have exited without closing their pipes (or vice
+     * versa) can only be noticed by polling their status */
+    if( t < 0 || t > check )
+      t = check;
+#if APR_FILES_AS_SOCKETS
+    if( nfds > 0 ) {
+      apr_int32_t nsds = 0;
+      apr_status_t rv = apr_poll( fds, nfds, &nsds, t );
+      if( rv == APR_SUCCESS ) {
+        for( j = 0; j < nfds; ++j ) {
+          if( fds[ j ].rtnevents != 0 ) {
+            ape_job* job = fds[ j ].client_data;
+            job_drain( job, fds[ j ].desc.f == job->pipes[ 0 ] ? 0 : 1 );
+          }
+        }
+      } else if( !APR_STATUS_IS_TIMEUP( rv ) &&
+                 !APR_STATUS_IS_EINTR( rv ) )
+        return rv;
+    } else
+      apr_sleep( t );
+#else
+    {
+      /* no poll support for pipes, so read in a busy loop */
+      int got = 0;
+      for( j = 0; j < nfds; ++j ) {
+        ape_job* job = fds[ j ].client_data;
+        int k = fds[ j ].desc.f == job->pipes[ 0 ] ? 0 : 1;
+        if( job_drain( job, k ) > 0 || job->pipes[ k ] == NULL )
+          got = 1;
+      }
+      if( !got ) {
+        if( t < 0 || t > JOB_REAP_INTERVAL )
+          t = JOB_REAP_INTERVAL;
+        apr_sleep( t );
+      }
+    }
+#endif
+    if( timeout >= 0 && apr_time_now() >= deadline ) {
+      for( i = 0; i < n; ++i ) {
+        if( job_check( jobs[ i ] ) ) {
+          *which = i;
+          return APR_SUCCESS;
+        }
+      }
+      *which = n;
+      return APR_SUCCESS;
+    }
+  }
+}
+
+
+/* starts a process with piped stdout/stderr using the given process
+ * attributes. stdin is inherited. */
+static apr_status_t job_start( ape_job* job, char const* name,
+                               char const* const* argv,
+                               char const* const* env,
+                               apr_procattr_t* pa, apr_pool_t* pool ) {
+  apr_status_t rv = apr_procattr_io_set( pa, APR_NO_PIPE, APR_CHILD_BLOCK,
+                                         APR_CHILD_BLOCK );
+  if( rv != APR_SUCCESS )
+    return rv;
+  rv = apr_proc_create( &job->proc, name, argv, env, pa, pool );
+  if( rv != APR_SUCCESS )
+    return rv;
+  job->pool = pool;
+  job->started = 1;
+  job->pipes[ 0 ] = job->proc.out;
+  job->pipes[ 1 ] = job->proc.err;
+  if( job->pipes[ 0 ] == NULL || job->pipes[ 1 ] == NULL )
+    return APR_EGENERAL;
+  return APR_SUCCESS;
+}
+
+
+#ifdef APE_HAVE_POSIX_SPAWN
+/* moves a process into a cgroup (v2) given by its directory */
+static void job_cgroup_attach( char const* cgroup, pid_t pid ) {
+  char path[ 4096 ];
+  int fd = -1;
+  if( strlen( cgroup ) + sizeof( "/cgroup.procs" ) > sizeof( path ) )
+    return;
+  strcpy( path, cgroup );
+  strcat( path, "/cgroup.procs" );
+  fd = open( path, O_WRONLY | O_CLOEXEC );
+  if( fd >= 0 ) {
+    char buf[ 32 ];
+    int n = sprintf( buf, "%ld", (long)pid );
+    if( write( fd, buf, n ) != n ) {
+      /* the command just runs outside of the cgroup */
+    }
+    close( fd );
+  }
+}
+
+
+static apr_status_t job_pipe( int fds[ 2 ] ) {
+  if( pipe( fds ) != 0 )
+    return APR_FROM_OS_ERROR( errno );
+  /* the parent ends must not leak into other children */
+  fcntl( fds[ 0 ], F_SETFD, FD_CLOEXEC );
+  fcntl( fds[ 1 ], F_SETFD, FD_CLOEXEC );
+  return APR_SUCCESS;
+}
+
+
+/* makes the (nonblocking) parent end of a pipe usable for APR */
+static apr_status_t job_put_pipe( apr_file_t** f, int fd,
+                                  apr_pool_t* pool ) {
+  apr_os_file_t ofd = fd;
+  apr_status_t rv = apr_os_pipe_put_ex( f, &ofd, 1, pool );
+  if( rv != APR_SUCCESS ) {
+    close( fd );
+    return rv;
+  }
+  return apr_file_pipe_timeout_set( *f, 0 );
+}
+
+
+/* starts a process via posix_spawn with piped stdout/stderr. Returns
+ * APR_ENOTIMPL if the process attributes are not supported. */
+static apr_status_t job_spawn( ape_job* job, char const* name,
+                               char const* const* argv,
+                               char const* const* env,
+                               char const* dir, int search,
+                               int pgroup, char const* cgroup,
+                               apr_pool_t* pool ) {
+  int out[ 2 ] = { -1, -1 };
+  int err[ 2 ] = { -1, -1 };
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t sa;
+  sigset_t set;
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+  pid_t pid = 0;
+  int rv = 0;
+  int cgfd = -1;
+  apr_status_t status = APR_SUCCESS;
+#ifndef APE_HAVE_SPAWN_CHDIR
+  if( dir != NULL )
+    return APR_ENOTIMPL;
+#endif
+  if( (status = job_pipe( out )) != APR_SUCCESS )
+    return status;
+  if( (status = job_pipe( err )) != APR_SUCCESS ) {
+    close( out[ 0 ] );
+    close( out[ 1 ] );
+    return status;
+  }
+  posix_spawn_file_actions_init( &fa );
+  posix_spawn_file_actions_adddup2( &fa, out[ 1 ], 1 );
+  posix_spawn_file_actions_adddup2( &fa, err[ 1 ], 2 );
+#ifdef APE_HAVE_SPAWN_CHDIR
+  if( dir != NULL )
+    posix_spawn_file_actions_addchdir_np( &fa, dir );
+#endif
+  posix_spawnattr_init( &sa );
+#ifdef POSIX_SPAWN_USEVFORK
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  if( pgroup ) {
+    /* the child becomes the leader of a new process group */
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup( &sa, 0 );
+  }
+#ifdef POSIX_SPAWN_SETCGROUP
+  /* glibc 2.39+ starts the child in the cgroup (via clone3) */
+  if( cgroup != NULL &&
+      (cgfd = open( cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC )) >= 0 ) {
+    flags |= POSIX_SPAWN_SETCGROUP;
+    posix_spawnattr_setcgroup_np( &sa, cgfd );
+  }
+#endif
+  posix_spawnattr_setflags( &sa, flags );
+  sigemptyset( &set );
+  posix_spawnattr_setsigmask( &sa, &set );
+  sigaddset( &set, SIGPIPE );
+  sigaddset( &set, SIGCHLD );
+  posix_spawnattr_setsigdefault( &sa, &set );
+  rv = (search ? posix_spawnp : posix_spawn)( &pid, name, &fa, &sa,
+         (char* const*)argv, env != NULL ? (char* const*)env : environ );
+  posix_spawnattr_destroy( &sa );
+  posix_spawn_file_actions_destroy( &fa );
+  close( out[ 1 ] );
+  close( err[ 1 ] );
+  if( rv != 0 ) {
+    if( cgfd >= 0 )
+      close( cgfd );
+    close( out[ 0 ] );
+    close( err[ 0 ] );
+    return APR_FROM_OS_ERROR( rv );
+  }
+  /* otherwise the child is moved right after the start (processes it
+   * has already created stay outside of the cgroup) */
+  if( cgfd >= 0 )
+    close( cgfd );
+  else if( cgroup != NULL )
+    job_cgroup_attach( cgroup, pid );
+  job->pool = pool;
+  job->started = 1;
+  job->proc.pid = pid;
+  status = job_put_pipe( job->pipes, out[ 0 ], pool );
+  if( status == APR_SUCCESS )
+    status = job_put_pipe( job->pipes+1, err[ 0 ], pool );
+  else
+    close( err[ 0 ] );
+  job->proc.out = job->pipes[ 0 ];
+  job->proc.err = job->pipes[ 1 ];
+  return status;
+}
+#endif
+
+
+static int job_push_status( lua_State* L, ape_job* job ) {
+  if( APR_PROC_CHECK_EXIT( job->why ) ) {
+    lua_pushboolean( L, job->exitcode == 0 );
+    lua_pushliteral( L, "exit" );
+  } else { /* SIGNAL */
+    lua_pushboolean( L, 0 );
+    lua_pushliteral( L, "signal" );
+  }
+  lua_pushnumber( L, job->exitcode );
+  lua_pushnumber( L, job->usage.maxrss );
+  lua_pushnumber( L, job->usage.cputime );
+  return 5;
+}
+
+
+static int ape_job_create( lua_State* L ) {
+  char const* name = luaL_checkstring( L, 1 );
+  apr_status_t rv = APR_ENOMEM;
+  char const** argv = NULL;
+  char const** env = NULL;
+  apr_procattr_t** pa = NULL;
+  apr_pool_t** pool = NULL;
+  luaL_checktype( L, 2, LUA_TTABLE );
+  if( !lua_isnoneornil( L, 3 ) )
+    luaL_checktype( L, 3, LUA_TTABLE );
+  pa = moon_checkudata( L, 4, APE_PROCATTR_NAME );
+  lua_settop( L, 4 );
+  moon_getuvfield( L, 4, "pool" );
+  pool = lua_touserdata( L, 5 );
+  if( ape_table2argv( L, 2, &argv, *pool ) == APR_SUCCESS &&
+      (lua_isnoneornil( L, 3 ) ||
+       ape_table2env( L, 3, &env, *pool ) == APR_SUCCESS) ) {
+    /* the pipes live in the pool of the process attributes */
+    ape_job* job = moon_newobject_ref( L, APE_JOB_NAME, 4 );
+    rv = job_start( job, name, argv, env, *pa, *pool );
+    if( rv != APR_SUCCESS )
+      job_release( job );
+  }
+  return ape_status( L, 1, rv );
+}
+
+
+/* APR only passes the given environment with APR_PROGRAM (without
+ * `PATH` search), the others inherit the parent's environment */
+static apr_cmdtype_e job_cmdtype( int search, char const* const* env ) {
+  if( env != NULL )
+    return APR_PROGRAM;
+  return search ? APR_PROGRAM_PATH : APR_PROGRAM_ENV;
+}
+
+
+static int ape_job_spawn( lua_State* L ) {
+  char const* name = luaL_checkstring( L, 1 );
+  char const* dir = NULL;
+  int search = 0;
+  int pgroup = 0;
+  char const* cgroup = NULL;
+  apr_status_t rv = APR_ENOMEM;
+  char const** argv = NULL;
+  char const** env = NULL;
+  ape_job* job = NULL;
+  luaL_checktype( L, 2, LUA_TTABLE );
+  if( !lua_isnoneornil( L, 3 ) )
+    luaL_checktype( L, 3, LUA_TTABLE );
+  if( !lua_isnoneornil( L, 4 ) ) {
+    luaL_checktype( L, 4, LUA_TTABLE );
+    lua_getfield( L, 4, "dir" );
+    dir = lua_tostring( L, -1 ); /* stays on the stack */
+    lua_getfield( L, 4, "path" );
+    search = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+    lua_getfield( L, 4, "pgroup" );
+    pgroup = lua_toboolean( L, -1 );
+    lua_pop( L, 1 );
+    lua_getfield( L, 4, "cgroup" );
+    cgroup = lua_tostring( L, -1 ); /* stays on the stack */
+  }
+  job = moon_newobject( L, APE_JOB_NAME, 0 );
+  ape_assert( L, apr_pool_create( &job->own, NULL ), "APR memory pool" );
+  if( ape_table2argv( L, 2, &argv, job->own ) == APR_SUCCESS &&
+      (lua_isnoneornil( L, 3 ) ||
+       ape_table2env( L, 3, &env, job->own ) == APR_SUCCESS) ) {
+#ifdef APE_HAVE_POSIX_SPAWN
+    rv = job_spawn( job, name, argv, env, dir, search, pgroup, cgroup,
+                    job->own );
+#else
+    rv = APR_ENOTIMPL;
+#endif
+    /* APR can't put the child into a new process group */
+    if( rv == APR_ENOTIMPL && !pgroup ) {
+      apr_procattr_t* pa = NULL;
+      if( (rv = apr_procattr_create( &pa, job->own )) == APR_SUCCESS &&
+          (rv = apr_procattr_cmdtype_set( pa, job_cmdtype( search, env ) ))
+            == APR_SUCCESS &&
+          (dir == NULL ||
+           (rv = apr_procattr_dir_set( pa, dir )) == APR_SUCCESS) )
+        rv = job_start( job, name, argv, env, pa, job->own );
+#ifdef APE_HAVE_POSIX_SPAWN
+      if( rv == APR_SUCCESS && cgroup != NULL )
+        job_cgroup_attach( cgroup, job->proc.pid );
+#endif
+    }
+  }
+  if( rv != APR_SUCCESS )
+    job_release( job );
+  return ape_status( L, 1, rv );
+}
+
+
+static int ape_job_gc( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  job_release( job );
+  return 0;
+}
+
+
+static int ape_job_pid( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  lua_pushnumber( L, (lua_Number)job->proc.pid );
+  return 1;
+}
+
+
+static int ape_job_status( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  if( !job->done ) {
+    lua_pushnil( L );
+    return 1;
+  }
+  return job_push_status( L, job );
+}
+
+
+static int ape_job_output( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  if( job->bufs[ 0 ].error != APR_SUCCESS )
+    return ape_status( L, 0, job->bufs[ 0 ].error );
+  job_push_buffer( L, job->bufs );
+  return 1;
+}
+
+
+static int ape_job_errout( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  if( job->bufs[ 1 ].error != APR_SUCCESS )
+    return ape_status( L, 0, job->bufs[ 1 ].error );
+  job_push_buffer( L, job->bufs+1 );
+  return 1;
+}
+
+
+static int ape_job_flush( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  size_t len = 0;
+  char const* echo = luaL_optlstring( L, 2, NULL, &len );
+  apr_status_t rv = job->bufs[ 0 ].error;
+  if( rv == APR_SUCCESS )
+    rv = job->bufs[ 1 ].error;
+  /* the output goes directly from the buffers to the C streams that
+   * are also used by io.stdout and io.stderr */
+  if( echo != NULL ) {
+    fwrite( echo, 1, len, stderr );
+    fputc( '\n', stderr );
+    fflush( stderr );
+  }
+  job_buffer_walk( job->bufs, job_add_file, stdout );
+  fflush( stdout );
+  job_buffer_walk( job->bufs+1, job_add_file, stderr );
+  fflush( stderr );
+  job_buffer_clear( job->bufs );
+  job_buffer_clear( job->bufs+1 );
+  /* what could be kept has been written anyway */
+  return ape_status( L, -1, rv );
+}
+
+
+static int ape_job_wait( lua_State* L ) {
+  ape_job* job = moon_checkudata( L, 1, APE_JOB_NAME );
+  apr_pollfd_t fds[ 2 ];
+  size_t which = 0;
+  apr_status_t rv = job_wait( &job, 1, -1, fds, &which );
+  if( rv != APR_SUCCESS )
+    return ape_status( L, 0, rv );
+  return job_push_status( L, job );
+}
+
+
+static int ape_job_wait_any( lua_State* L ) {
+  lua_Number t = luaL_optnumber( L, 2, -1 );
+  size_t n = 0, i = 0, which = 0;
+  ape_job** jobs = NULL;
+  apr_pollfd_t* fds = NULL;
+  apr_status_t rv = APR_SUCCESS;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  n = moon_rawlen( L, 1 );
+  jobs = lua_newuserdata( L, n * (sizeof( ape_job* ) +
+                                  2 * sizeof( apr_pollfd_t )) + 1 );
+  fds = (apr_pollfd_t*)(jobs + n);
+  for( i = 0; i < n; ++i ) {
+    lua_rawgeti( L, 1, (int)(i+1) );
+    jobs[ i ] = moon_checkudata( L, -1, APE_JOB_NAME );
+    lua_pop( L, 1 );
+  }
+  rv = job_wait( jobs, n, t < 0 ? -1 : (apr_interval_time_t)t, fds, &which );
+  if( rv != APR_SUCCESS )
+    return ape_status( L, 0, rv );
+  if( which >= n ) {
+    lua_pushnil( L );
+    return 1;
+  }
+  lua_rawgeti( L, 1, (int)(which+1) );
+  lua_pushinteger( L, (lua_Integer)(which+1) );
+  return 2;
+}
+
+
+static int ape_job_run_collect( lua_State* L ) {
+  static char const* const names[] = {
+    "shellcmd", "shellcmd/env", "program", "program/env",
+    "program/path", NULL
+  };
+  static apr_cmdtype_e const flags[] = {
+    APR_SHELLCMD, APR_SHELLCMD_ENV, APR_PROGRAM, APR_PROGRAM_ENV,
+    APR_PROGRAM_PATH
+  };
+  apr_cmdtype_e ct = flags[ luaL_checkoption( L, 1, NULL, names ) ];
+  char const* cmd = luaL_checkstring( L, 2 );
+  char const** argv = NULL;
+  char const** env = NULL;
+  apr_pool_t** pool = NULL;
+  apr_procattr_t* pa = NULL;
+  apr_status_t rv = APR_SUCCESS;
+  luaL_checktype( L, 3, LUA_TTABLE );
+  if( !lua_isnoneornil( L, 4 ) )
+    luaL_checktype( L, 4, LUA_TTABLE );
+  pool = ape_opt_pool( L, 5 );
+  rv = apr_procattr_create( &pa, *pool );
+  if( rv != APR_SUCCESS )
+    return ape_status( L, 0, rv );
+  rv = apr_procattr_cmdtype_set( pa, ct );
+  if( rv != APR_SUCCESS )
+    return ape_status( L, 0, rv );
+  if( (rv = ape_table2argv( L, 3, &argv, *pool )) == APR_SUCCESS &&
+      (lua_isnoneornil( L, 4 ) ||
+       (rv = ape_table2env( L, 4, &env, *pool )) == APR_SUCCESS) ) {
+    /* the buffers are released by the finalizer even if a Lua error
+     * is raised while pushing the results */
+    ape_job* job = moon_newobject( L, APE_JOB_NAME, 0 );
+    rv = job_start( job, cmd, argv, env, pa, *pool );
+    if( rv == APR_SUCCESS ) {
+      apr_pollfd_t fds[ 2 ];
+      size_t which = 0;
+      rv = job_wait( &job, 1, -1, fds, &which );
+    }
+    if( rv != APR_SUCCESS ) {
+      int v = ape_status( L, 0, rv );
+      job_push_buffer( L, job->bufs );
+      job_release( job );
+      return v + 1;
+    }
+    if( job->bufs[ 0 ].error != APR_SUCCESS ||
+        job->bufs[ 1 ].error != APR_SUCCESS ) {
+      rv = job->bufs[ 0 ].error != APR_SUCCESS ? job->bufs[ 0 ].error
+                                               : job->bufs[ 1 ].error;
+      job_release( job );
+      return ape_status( L, 0, rv );
+    }
+    job_push_status( L, job );
+    lua_pop( L, 2 ); /* remove maxrss and cputime */
+    job_push_buffer( L, job->bufs );
+    job_push_buffer( L, job->bufs+1 );
+    job_release( job );
+    return 5;
+  }
+  return ape_status( L, 0, rv );
+}
+
+
+
+APE_API void ape_job_setup( lua_State* L ) {
+  luaL_Reg const ape_job_metamethods[] = {
+    { "__gc", ape_job_gc },
+    { NULL, NULL }
+  };
+  /***
+    Userdata type for a child process whose standard output and
+    standard error are captured.
+    @type ape_job_t
+  */
+  luaL_Reg const ape_job_methods[] = {
+  /***
+    Returns the process id of the job.
+    @function pid
+    @treturn number the process id
+  */
+    { "pid", ape_job_pid },
+  /***
+    Returns the exit status of a finished job.
+    @function status
+    @treturn boolean,string,number,number,number same as
+      @{apr_proc_t:wait}
+    @treturn nil if the job is still running
+  */
+    { "status", ape_job_status },
+  /***
+    Returns the standard output captured so far.
+    @function output
+    @treturn string the output of the job
+    @treturn nil,string,number nil, an error message, and an error
+      code if part of the output was lost (no temporary file)
+  */
+    { "output", ape_job_output },
+  /***
+    Returns the standard error captured so far.
+    @function errout
+    @treturn string the error output of the job
+    @treturn nil,string,number nil, an error message, and an error
+      code if part of the output was lost (no temporary file)
+  */
+    { "errout", ape_job_errout },
+  /***
+    Writes an optional echo line and the captured output to the
+    standard output and standard error streams in one go, and
+    discards the buffers.
+    @function flush
+    @tparam[opt] string echo a line to print before the output
+    @treturn boolean a true value
+    @treturn nil,string,number nil, an error message, and an error
+      code if part of the output was lost (what was kept is written
+      anyway)
+  */
+    { "flush", ape_job_flush },
+  /***
+    Waits for the job to finish while collecting its output.
+    @function wait
+    @treturn boolean,string,number,number,number same as
+      @{apr_proc_t:wait}
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "wait", ape_job_wait },
+    { NULL, NULL }
+  };
+  moon_object_type const ape_job_type = {
+    APE_JOB_NAME,
+    sizeof( ape_job ),
+    job_init,
+    ape_job_metamethods,
+    ape_job_methods
+  };
+  /***
+    Asynchronous jobs.
+    @section jobs
+  */
+  luaL_Reg const ape_job_functions[] = {
+  /***
+    Starts a program and captures its standard output and standard
+    error. The I/O settings of the process attributes are replaced.
+    @function job_create
+    @tparam string prog the program name
+    @tparam table argv an array of program arguments
+    @tparam[opt] table env an env table
+    @tparam apr_procattr_t attr process attributes
+    @treturn ape_job_t the running job
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "job_create", ape_job_create },
+  /***
+    Starts a program like @{job_create}, but uses `posix_spawn` where
+    available, so that the costs don't depend on the memory size of
+    the calling process. The standard input and the environment (if
+    not given) are inherited. Without `posix_spawn` the `PATH` is not
+    searched if an environment is given.
+    @function job_spawn
+    @tparam string prog the program name
+    @tparam table argv an array of program arguments
+    @tparam[opt] table env an env table
+    @tparam[opt] table options the working directory of the child
+      process (`dir`), whether to search the `PATH` for the program
+      (`path`), whether the child should become the leader of a new
+      process group (`pgroup`, only with `posix_spawn`), and the
+      directory of a cgroup (v2) for the child (`cgroup`)
+    @treturn ape_job_t the running job
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "job_spawn", ape_job_spawn },
+  /***
+    Collects output from all given jobs until one of them finishes.
+    @function job_wait_any
+    @tparam table jobs an array of jobs
+    @tparam[opt] number timeout timeout in microseconds
+    @treturn ape_job_t,number the first finished job and its index
+    @treturn nil if the timeout expired (or the array is empty)
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "job_wait_any", ape_job_wait_any },
+  /***
+    Executes a program and collects its standard output and standard
+    error.
+    @function run_collect
+    @tparam string type specifies how to execute the program
+    @tparam string prog the program name
+    @tparam table argv an array of program arguments
+    @tparam[opt] table env an env table
+    @tparam[opt] apr_pool_t pool a memory pool for temporary
+      allocations
+    @treturn boolean,string,number,string,string same as
+      @{os.execute} in Lua 5.2 plus the output and error output
+    @treturn nil,string,number,string nil, an error message, and an
+      error code in case of an error (plus partial output if any)
+  */
+    { "run_collect", ape_job_run_collect },
+    { NULL, NULL }
+  };
+  moon_defobject( L, &ape_job_type, 0 );
+  moon_register( L, ape_job_functions );
+}
+
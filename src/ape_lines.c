@@ -0,0 +1,242 @@
+/***
+  @module ape
+*/
+#include <stddef.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <apr_file_io.h>
+#include <apr_file_info.h>
+#include <apr_mmap.h>
+#include <apr_strings.h>
+#include "moon.h"
+#include "ape.h"
+
+#if defined( APR_HAVE_UNISTD_H ) && APR_HAVE_UNISTD_H && \
+    !defined( _WIN32 ) && !defined( _WIN64 )
+#  include <sys/mman.h>
+#  if defined( POSIX_MADV_SEQUENTIAL )
+#    define APE_HAVE_POSIX_MADVISE 1
+#  endif
+#endif
+
+/* default number of words at the start of a line that are compared to
+ * the filter names */
+#define LINES_WORDS 2
+
+
+/* Iterator over the lines of a (possibly huge) log file. The file is
+ * mapped into memory (or read in one go if mmap isn't available),
+ * and lines are found using memchr. If a list of names is given,
+ * only lines having one of those names among their first few words
+ * are turned into Lua strings, all other lines are skipped without
+ * any allocations.
+ */
+typedef struct {
+  apr_pool_t* pool;
+  char const* data;
+  apr_size_t size;
+  apr_size_t pos;
+  char const** names;
+  apr_size_t* lens;
+  int nnames;
+  int nwords;
+} ape_lines;
+
+
+static void ape_lines_init( void* p ) {
+  ape_lines* l = p;
+  l->pool = NULL;
+  l->data = NULL;
+  l->size = 0;
+  l->pos = 0;
+  l->names = NULL;
+  l->lens = NULL;
+  l->nnames = 0;
+  l->nwords = LINES_WORDS;
+}
+
+
+static void lines_release( ape_lines* l ) {
+  if( l->pool != NULL ) {
+    apr_pool_destroy( l->pool );
+    l->pool = NULL;
+  }
+  l->data = NULL;
+  l->size = l->pos = 0;
+}
+
+
+static int ape_lines_gc( lua_State* L ) {
+  lines_release( moon_checkudata( L, 1, APE_LINES_NAME ) );
+  return 0;
+}
+
+
+static int is_word_char( char c ) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
+
+
+/* checks whether one of the first `nwords` words of the line is in
+ * the list of names */
+static int lines_match( ape_lines const* l, char const* s,
+                        char const* e ) {
+  int w = 0, i = 0;
+  while( s < e && w < l->nwords ) {
+    char const* b = NULL;
+    while( s < e && !is_word_char( *s ) )
+      ++s;
+    b = s;
+    while( s < e && is_word_char( *s ) )
+      ++s;
+    if( s == b )
+      break;
+    for( i = 0; i < l->nnames; ++i ) {
+      if( l->lens[ i ] == (apr_size_t)(s-b) &&
+          memcmp( l->names[ i ], b, s-b ) == 0 )
+        return 1;
+    }
+    ++w;
+  }
+  return 0;
+}
+
+
+static int lines_next( lua_State* L ) {
+  ape_lines* l = moon_checkudata( L, lua_upvalueindex( 1 ), APE_LINES_NAME );
+  while( l->pos < l->size ) {
+    char const* s = l->data + l->pos;
+    apr_size_t rest = l->size - l->pos;
+    char const* e = memchr( s, '\n', rest );
+    if( e == NULL )
+      e = s + rest;
+    l->pos += (e - s) + (e < s + rest);
+    if( l->names == NULL || lines_match( l, s, e ) ) {
+      lua_pushlstring( L, s, e - s );
+      return 1;
+    }
+  }
+  /* give back the mapping as soon as possible */
+  lines_release( l );
+  return 0;
+}
+
+
+static apr_status_t lines_open( ape_lines* l, char const* fname ) {
+  apr_file_t* f = NULL;
+  apr_finfo_t finfo;
+  apr_status_t rv = apr_file_open( &f, fname, APR_FOPEN_READ|APR_FOPEN_BINARY,
+                                   APR_FPROT_OS_DEFAULT, l->pool );
+  if( rv != APR_SUCCESS )
+    return rv;
+  rv = apr_file_info_get( &finfo, APR_FINFO_SIZE, f );
+  if( rv != APR_SUCCESS )
+    return rv;
+  if( finfo.size <= 0 )
+    return APR_SUCCESS;
+  if( (apr_uint64_t)finfo.size > (apr_uint64_t)(apr_size_t)-1 )
+    return APR_EINVAL;
+  l->size = (apr_size_t)finfo.size;
+#if APR_HAS_MMAP
+  {
+    apr_mmap_t* mm = NULL;
+    rv = apr_mmap_create( &mm, f, 0, l->size, APR_MMAP_READ, l->pool );
+    if( rv == APR_SUCCESS ) {
+      l->data = mm->mm;
+#if defined( APE_HAVE_POSIX_MADVISE )
+      posix_madvise( mm->mm, l->size, POSIX_MADV_SEQUENTIAL );
+#endif
+      return APR_SUCCESS;
+    }
+  }
+#endif
+  {
+    /* read the whole file instead */
+    char* buffer = apr_palloc( l->pool, l->size );
+    if( buffer == NULL )
+      return APR_ENOMEM;
+    rv = apr_file_read_full( f, buffer, l->size, &l->size );
+    l->data = buffer;
+  }
+  return rv;
+}
+
+
+static int ape_file_lines( lua_State* L ) {
+  char const* fname = luaL_checkstring( L, 1 );
+  int nwords = (int)luaL_optinteger( L, 3, LINES_WORDS );
+  ape_lines* l = NULL;
+  apr_status_t rv = APR_SUCCESS;
+  if( !lua_isnoneornil( L, 2 ) )
+    luaL_checktype( L, 2, LUA_TTABLE );
+  lua_settop( L, 3 );
+  l = moon_newobject( L, APE_LINES_NAME, 0 );
+  ape_assert( L, apr_pool_create( &l->pool, NULL ), "APR memory pool" );
+  l->nwords = nwords;
+  if( lua_istable( L, 2 ) ) {
+    int i = 0, n = (int)moon_rawlen( L, 2 );
+    l->names = apr_palloc( l->pool, (n+1) * sizeof( char const* ) );
+    l->lens = apr_palloc( l->pool, (n+1) * sizeof( apr_size_t ) );
+    ape_assert( L, l->names != NULL && l->lens != NULL ? APR_SUCCESS :
+                   APR_ENOMEM, "APR memory pool" );
+    for( i = 0; i < n; ++i ) {
+      size_t len = 0;
+      char const* s = NULL;
+      lua_rawgeti( L, 2, i+1 );
+      s = lua_tolstring( L, -1, &len );
+      if( s == NULL )
+        luaL_argerror( L, 2, "array of strings expected" );
+      l->names[ i ] = apr_pstrndup( l->pool, s, len );
+      l->lens[ i ] = len;
+      lua_pop( L, 1 );
+    }
+    l->nnames = n;
+  }
+  rv = lines_open( l, fname );
+  if( rv != APR_SUCCESS ) {
+    lines_release( l );
+    return ape_status( L, 0, rv );
+  }
+  lua_pushcclosure( L, lines_next, 1 );
+  return 1;
+}
+
+
+APE_API void ape_lines_setup( lua_State* L ) {
+  luaL_Reg const ape_lines_metamethods[] = {
+    { "__gc", ape_lines_gc },
+    { NULL, NULL }
+  };
+  moon_object_type const ape_lines_type = {
+    APE_LINES_NAME,
+    sizeof( ape_lines ),
+    ape_lines_init,
+    ape_lines_metamethods,
+    NULL
+  };
+  luaL_Reg const ape_lines_functions[] = {
+  /***
+    Iterates over the lines of a file like `io.lines`, but the file
+    is mapped into memory instead of read line by line. If an array
+    of names is given, only lines containing one of those names as
+    one of their first words (runs of alphanumeric characters and
+    underscores) are returned; other lines are skipped in C.
+    @function file_lines
+    @tparam string path the file name
+    @tparam[opt] table names array of names to filter the lines
+    @tparam[opt] number words the number of words at the start of
+      each line to compare to the names (default: 2)
+    @treturn function an iterator function returning the lines
+      (without the newline characters)
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "file_lines", ape_file_lines },
+    { NULL, NULL }
+  };
+  moon_defobject( L, &ape_lines_type, 0 );
+  moon_register( L, ape_lines_functions );
+}
+
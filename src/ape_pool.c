@@ -5,6 +5,7 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <apr_pools.h>
+#include <apr_allocator.h>
 #include "moon.h"
 #include "ape.h"
 
@@ -20,6 +21,27 @@
 static char const ape_pool_sentinel = 0;
 #define POOL_REG_KEY ((void*)&ape_pool_sentinel)
 
+/* maximum number of bytes of freed memory blocks kept by the
+ * allocator of the scratch pool */
+#define SCRATCH_MAX_FREE (1024*1024)
+
+
+/* The scratch pool is used by all ape functions that are called
+ * without an explicit pool argument, and it is cleared every time it
+ * is handed out. It has its own allocator which keeps freed blocks
+ * (up to SCRATCH_MAX_FREE bytes), so clearing it and allocating again
+ * only moves blocks between the pool and the allocator's free lists
+ * instead of unmapping and mapping memory for every call (the
+ * allocator of normal top-level pools keeps almost nothing).
+ * While a C function holds the scratch pool (because it calls back
+ * into Lua), the functions called from Lua get a child pool instead.
+ */
+typedef struct {
+  apr_pool_t* pool;
+  apr_pool_t* nested;
+  int held;
+} ape_scratch;
+
 
 static int ape_pool_child( lua_State* L ) {
   apr_pool_t** parent = moon_checkudata( L, 1, APE_POOL_NAME );
@@ -43,6 +65,51 @@ static void ape_pool_init( void* p ) {
 }
 
 
+static void ape_scratch_init( void* p ) {
+  ape_scratch* s = p;
+  s->pool = NULL;
+  s->nested = NULL;
+  s->held = 0;
+}
+
+
+static int ape_scratch_gc( lua_State* L ) {
+  ape_scratch* s = moon_checkudata( L, 1, APE_SCRATCH_NAME );
+  if( s->pool != NULL ) {
+    apr_pool_destroy( s->pool );
+    s->pool = NULL;
+    s->nested = NULL;
+  }
+  return 0;
+}
+
+
+static void ape_scratch_create( lua_State* L ) {
+  ape_scratch* s = moon_newobject( L, APE_SCRATCH_NAME, 0 );
+  apr_allocator_t* allocator = NULL;
+  apr_status_t rv = apr_allocator_create( &allocator );
+  if( rv == APR_SUCCESS ) {
+    rv = apr_pool_create_ex( &s->pool, NULL, NULL, allocator );
+    if( rv == APR_SUCCESS ) {
+      apr_allocator_owner_set( allocator, s->pool );
+      apr_allocator_max_free_set( allocator, SCRATCH_MAX_FREE );
+    } else
+      apr_allocator_destroy( allocator );
+  }
+  ape_assert( L, rv, "APR memory pool" );
+}
+
+
+static ape_scratch* ape_scratch_get( lua_State* L ) {
+  ape_scratch* s = NULL;
+  lua_pushlightuserdata( L, POOL_REG_KEY );
+  lua_rawget( L, LUA_REGISTRYINDEX );
+  s = lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+  return s;
+}
+
+
 static int ape_pool_create( lua_State* L ) {
   apr_pool_t** pool = moon_newobject( L, APE_POOL_NAME, 0 );
   apr_allocator_t* allocator = NULL;
@@ -93,24 +160,57 @@ APE_API void ape_pool_setup( lua_State* L ) {
     { "pool_create", ape_pool_create },
     { NULL, NULL },
   };
+  luaL_Reg const ape_scratch_metamethods[] = {
+    { "__gc", ape_scratch_gc },
+    { NULL, NULL }
+  };
+  moon_object_type const ape_scratch_type = {
+    APE_SCRATCH_NAME,
+    sizeof( ape_scratch ),
+    ape_scratch_init,
+    ape_scratch_metamethods,
+    NULL
+  };
   moon_defobject( L, &ape_pool_type, 0 );
+  moon_defobject( L, &ape_scratch_type, 0 );
   lua_pushlightuserdata( L, POOL_REG_KEY );
-  ape_pool_create( L );
+  ape_scratch_create( L );
   lua_rawset( L, LUA_REGISTRYINDEX );
   moon_register( L, ape_pool_functions );
 }
 
 
 APE_API apr_pool_t** ape_opt_pool( lua_State* L, int index ) {
-  apr_pool_t** pool = NULL;
   if( lua_isnoneornil( L, index ) ) {
-    lua_pushlightuserdata( L, POOL_REG_KEY );
-    lua_rawget( L, LUA_REGISTRYINDEX );
-    pool = lua_touserdata( L, -1 );
-    apr_pool_clear( *pool );
-    lua_pop( L, 1 );
-  } else
-    pool = moon_checkudata( L, index, APE_POOL_NAME );
-  return pool;
+    ape_scratch* s = ape_scratch_get( L );
+    if( s->held ) {
+      if( s->nested == NULL )
+        ape_assert( L, apr_pool_create( &s->nested, s->pool ),
+                    "APR memory pool" );
+      else
+        apr_pool_clear( s->nested );
+      return &s->nested;
+    }
+    apr_pool_clear( s->pool );
+    s->nested = NULL; /* destroyed by apr_pool_clear */
+    return &s->pool;
+  }
+  return moon_checkudata( L, index, APE_POOL_NAME );
+}
+
+
+APE_API apr_pool_t* ape_scratch_hold( lua_State* L ) {
+  ape_scratch* s = ape_scratch_get( L );
+  if( s->held )
+    luaL_error( L, "nested use of the ape scratch pool" );
+  apr_pool_clear( s->pool );
+  s->nested = NULL;
+  s->held = 1;
+  return s->pool;
+}
+
+
+APE_API void ape_scratch_release( lua_State* L ) {
+  ape_scratch_get( L )->held = 0;
 }
 
@@ -10,6 +10,22 @@
 #include "moon.h"
 #include "ape.h"
 
+#if defined( APR_HAVE_SYS_WAIT_H ) && APR_HAVE_SYS_WAIT_H && \
+    !defined( _WIN32 ) && !defined( _WIN64 )
+#  include <errno.h>
+#  include <sys/types.h>
+#  include <sys/time.h>
+#  include <sys/resource.h>
+#  include <sys/wait.h>
+#  define APE_HAVE_WAIT4 1
+/* ru_maxrss is in kilobytes everywhere but on Mac OS X */
+#  if defined( __APPLE__ ) && defined( __MACH__ )
+#    define APE_MAXRSS_UNIT 1
+#  else
+#    define APE_MAXRSS_UNIT 1024
+#  endif
+#endif
+
 /***
   Process handling.
   @section procs
@@ -189,7 +205,8 @@ static int ape_proc_wait( lua_State* L ) {
   apr_wait_how_e f = wait_flags[ luaL_checkoption( L, 2, "wait", wait_names ) ];
   int exitcode = 0;
   apr_exit_why_e why = 0;
-  apr_status_t rv = apr_proc_wait( proc, &exitcode, &why, f );
+  ape_rusage usage;
+  apr_status_t rv = ape_proc_wait_rusage( proc, &exitcode, &why, f, &usage );
   if( rv == APR_CHILD_DONE ) {
     if( APR_PROC_CHECK_EXIT( why ) ) {
       lua_pushboolean( L, exitcode == 0 );
@@ -199,7 +216,9 @@ static int ape_proc_wait( lua_State* L ) {
       lua_pushliteral( L, "signal" );
     }
     lua_pushnumber( L, exitcode );
-    return 3;
+    lua_pushnumber( L, usage.maxrss );
+    lua_pushnumber( L, usage.cputime );
+    return 5;
   } else if( rv == APR_CHILD_NOTDONE ) {
     lua_pushnil( L );
     return 1;
@@ -431,6 +450,9 @@ APE_API void ape_proc_setup( lua_State* L ) {
   */
     { "err", ape_proc_err_get },
   /***
+    Waits for the process. In addition to the exit status the peak
+    resident set size (in bytes) and the cpu time (in seconds) of the
+    process tree are returned (zero if unknown).
     @function wait
   */
     { "wait", ape_proc_wait },
@@ -609,3 +631,47 @@ APE_API apr_status_t ape_table2env( lua_State* L, int index,
   return APR_ENOMEM;
 }
 
+
+
+APE_API apr_status_t ape_proc_wait_rusage( apr_proc_t* proc, int* exitcode,
+                                           apr_exit_why_e* why,
+                                           apr_wait_how_e how,
+                                           ape_rusage* usage ) {
+#ifdef APE_HAVE_WAIT4
+  int status = 0;
+  struct rusage ru;
+  pid_t pid = 0;
+  do {
+    pid = wait4( proc->pid, &status, how == APR_NOWAIT ? WNOHANG : 0, &ru );
+  } while( pid < 0 && errno == EINTR );
+  if( pid == 0 )
+    return APR_CHILD_NOTDONE;
+  else if( pid < 0 )
+    return APR_FROM_OS_ERROR( errno );
+  if( WIFEXITED( status ) ) {
+    *why = APR_PROC_EXIT;
+    *exitcode = WEXITSTATUS( status );
+  } else if( WIFSIGNALED( status ) ) {
+    *why = APR_PROC_SIGNAL;
+#  ifdef WCOREDUMP
+    if( WCOREDUMP( status ) )
+      *why = (apr_exit_why_e)(APR_PROC_SIGNAL | APR_PROC_SIGNAL_CORE);
+#  endif
+    *exitcode = WTERMSIG( status );
+  } else /* stopped */
+    return APR_CHILD_NOTDONE;
+  if( usage != NULL ) {
+    /* for wait4 this covers all reaped descendants as well */
+    usage->maxrss = (lua_Number)ru.ru_maxrss * APE_MAXRSS_UNIT;
+    usage->cputime = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                     ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  }
+  return APR_CHILD_DONE;
+#else
+  if( usage != NULL ) {
+    usage->maxrss = 0;
+    usage->cputime = 0;
+  }
+  return apr_proc_wait( proc, exitcode, why, how );
+#endif
+}
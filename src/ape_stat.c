@@ -0,0 +1,298 @@
+/***
+  @module ape
+*/
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <apr_file_info.h>
+#include <apr_thread_proc.h>
+#include "moon.h"
+#include "ape.h"
+
+#if defined( APR_HAVE_UNISTD_H ) && APR_HAVE_UNISTD_H && \
+    !defined( _WIN32 ) && !defined( _WIN64 )
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <sys/types.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  define APE_HAVE_POSIX_STAT 1
+#  if defined( STATX_BASIC_STATS ) && defined( AT_FDCWD )
+#    define APE_HAVE_STATX 1
+#  endif
+#  if APR_HAS_THREADS
+#    define APE_HAVE_STAT_THREADS 1
+#  endif
+#endif
+
+/* default and maximum number of threads calling stat */
+#define STAT_THREADS 4
+#define STAT_MAX_THREADS 64
+/* minimum number of paths per thread */
+#define STAT_PARALLEL_MIN 256
+
+
+/* results for one path */
+typedef struct {
+  apr_off_t size;
+  apr_time_t mtime;
+  apr_ino_t inode;
+  apr_filetype_e type;
+  apr_status_t rv;
+} stat_info;
+
+/* a contiguous range of paths handled by one thread */
+typedef struct {
+  char const** paths;
+  stat_info* infos;
+  size_t n;
+  apr_pool_t* pool; /* only used without POSIX stat */
+} stat_range;
+
+
+#ifdef APE_HAVE_POSIX_STAT
+static apr_filetype_e stat_mode2type( unsigned mode ) {
+  switch( mode & S_IFMT ) {
+    case S_IFREG: return APR_REG;
+    case S_IFDIR: return APR_DIR;
+    case S_IFCHR: return APR_CHR;
+    case S_IFBLK: return APR_BLK;
+    case S_IFIFO: return APR_PIPE;
+    case S_IFLNK: return APR_LNK;
+#  ifdef S_IFSOCK
+    case S_IFSOCK: return APR_SOCK;
+#  endif
+    default:
+      return APR_UNKFILE;
+  }
+}
+#endif
+
+
+static void stat_one( char const* path, stat_info* si, apr_pool_t* pool ) {
+#if defined( APE_HAVE_STATX )
+  struct statx st;
+  (void)pool;
+  if( statx( AT_FDCWD, path, 0, STATX_TYPE | STATX_SIZE | STATX_MTIME |
+             STATX_INO, &st ) != 0 ) {
+    si->rv = APR_FROM_OS_ERROR( errno );
+    return;
+  }
+  si->size = (apr_off_t)st.stx_size;
+  si->mtime = (apr_time_t)st.stx_mtime.tv_sec * APR_USEC_PER_SEC +
+              st.stx_mtime.tv_nsec / 1000;
+  si->inode = (apr_ino_t)st.stx_ino;
+  si->type = stat_mode2type( st.stx_mode );
+#elif defined( APE_HAVE_POSIX_STAT )
+  struct stat st;
+  (void)pool;
+  if( stat( path, &st ) != 0 ) {
+    si->rv = APR_FROM_OS_ERROR( errno );
+    return;
+  }
+  si->size = (apr_off_t)st.st_size;
+  si->mtime = (apr_time_t)st.st_mtime * APR_USEC_PER_SEC;
+  si->inode = (apr_ino_t)st.st_ino;
+  si->type = stat_mode2type( st.st_mode );
+#else
+  apr_finfo_t finfo;
+  apr_status_t rv = apr_stat( &finfo, path, APR_FINFO_SIZE |
+                              APR_FINFO_MTIME | APR_FINFO_INODE |
+                              APR_FINFO_TYPE, pool );
+  if( rv != APR_SUCCESS && !APR_STATUS_IS_INCOMPLETE( rv ) ) {
+    si->rv = rv;
+    return;
+  }
+  si->size = (finfo.valid & APR_FINFO_SIZE) ? finfo.size : 0;
+  si->mtime = (finfo.valid & APR_FINFO_MTIME) ? finfo.mtime : 0;
+  si->inode = (finfo.valid & APR_FINFO_INODE) ? finfo.inode : 0;
+  si->type = (finfo.valid & APR_FINFO_TYPE) ? finfo.filetype : APR_UNKFILE;
+#endif
+  si->rv = APR_SUCCESS;
+}
+
+
+static void stat_run( stat_range* r ) {
+  size_t i = 0;
+  /* failed lookups report 0 and APR_NOFILE (== 0) */
+  memset( r->infos, 0, r->n * sizeof( stat_info ) );
+  for( i = 0; i < r->n; ++i )
+    stat_one( r->paths[ i ], r->infos + i, r->pool );
+}
+
+
+#ifdef APE_HAVE_STAT_THREADS
+static void* APR_THREAD_FUNC stat_thread( apr_thread_t* t, void* p ) {
+  stat_run( p );
+  apr_thread_exit( t, APR_SUCCESS );
+  return NULL;
+}
+#endif
+
+
+/* the same names as used by `ape.stat` */
+static char const* stat_type2string( apr_filetype_e t ) {
+  switch( t ) {
+    case APR_REG: return "regular file";
+    case APR_DIR: return "directory";
+    case APR_CHR: return "character device";
+    case APR_BLK: return "block device";
+    case APR_PIPE: return "pipe";
+    case APR_LNK: return "symbolic link";
+    case APR_SOCK: return "socket";
+    case APR_NOFILE: return "no file";
+    default:
+      return "unknown";
+  }
+}
+
+
+static void stat_push_array( lua_State* L, stat_info const* infos,
+                             size_t n, int field ) {
+  size_t i = 0;
+  lua_createtable( L, (int)n, 0 );
+  for( i = 0; i < n; ++i ) {
+    stat_info const* si = infos + i;
+    switch( field ) {
+      case 0:
+        lua_pushnumber( L, (lua_Number)si->size );
+        break;
+      case 1:
+        lua_pushnumber( L, (lua_Number)si->mtime );
+        break;
+      case 2:
+        lua_pushnumber( L, (lua_Number)si->inode );
+        break;
+      default:
+        if( si->rv == APR_SUCCESS )
+          lua_pushstring( L, stat_type2string( si->type ) );
+        else if( APR_STATUS_IS_ENOENT( si->rv ) ||
+                 APR_STATUS_IS_ENOTDIR( si->rv ) )
+          lua_pushstring( L, stat_type2string( APR_NOFILE ) );
+        else
+          lua_pushboolean( L, 0 );
+        break;
+    }
+    lua_rawseti( L, -2, (int)i+1 );
+  }
+}
+
+
+static int ape_stat_many( lua_State* L ) {
+  size_t n = 0, i = 0;
+  int threads = 0;
+  char const** paths = NULL;
+  stat_info* infos = NULL;
+  apr_pool_t* pool = NULL;
+  luaL_checktype( L, 1, LUA_TTABLE );
+  threads = luaL_optint( L, 2, STAT_THREADS );
+  if( threads > STAT_MAX_THREADS )
+    threads = STAT_MAX_THREADS;
+  n = moon_rawlen( L, 1 );
+  lua_settop( L, 1 );
+  /* the path strings stay alive in the argument table */
+  paths = malloc( (n+1) * sizeof( char const* ) );
+  infos = malloc( (n+1) * sizeof( stat_info ) );
+  if( paths == NULL || infos == NULL ) {
+    free( paths );
+    free( infos );
+    return ape_status( L, 0, APR_ENOMEM );
+  }
+  for( i = 0; i < n; ++i ) {
+    lua_rawgeti( L, 1, (int)i+1 );
+    paths[ i ] = lua_tostring( L, -1 );
+    lua_pop( L, 1 );
+    if( paths[ i ] == NULL ) {
+      free( paths );
+      free( infos );
+      luaL_argerror( L, 1, "array of strings expected" );
+    }
+  }
+  if( apr_pool_create( &pool, NULL ) != APR_SUCCESS ) {
+    free( paths );
+    free( infos );
+    return ape_status( L, 0, APR_ENOMEM );
+  }
+  {
+    stat_range all;
+    all.paths = paths;
+    all.infos = infos;
+    all.n = n;
+    all.pool = pool;
+#ifdef APE_HAVE_STAT_THREADS
+    if( threads > 1 && n >= 2 * STAT_PARALLEL_MIN ) {
+      stat_range ranges[ STAT_MAX_THREADS ];
+      apr_thread_t* tids[ STAT_MAX_THREADS ];
+      size_t chunk = 0, start = 0;
+      int t = 0, started = 0;
+      if( (size_t)threads > n / STAT_PARALLEL_MIN )
+        threads = (int)(n / STAT_PARALLEL_MIN);
+      chunk = (n + threads - 1) / threads;
+      /* the calling thread handles the last range itself */
+      for( t = 0; t < threads-1; ++t, start += chunk ) {
+        ranges[ t ].paths = paths + start;
+        ranges[ t ].infos = infos + start;
+        ranges[ t ].n = chunk;
+        ranges[ t ].pool = NULL;
+        if( apr_thread_create( tids+t, NULL, stat_thread, ranges+t,
+                               pool ) != APR_SUCCESS )
+          break;
+        ++started;
+      }
+      all.paths = paths + start;
+      all.infos = infos + start;
+      all.n = n - start;
+      stat_run( &all );
+      for( t = 0; t < started; ++t ) {
+        apr_status_t rv = APR_SUCCESS;
+        apr_thread_join( &rv, tids[ t ] );
+      }
+    } else
+#endif
+      stat_run( &all );
+  }
+  apr_pool_destroy( pool );
+  free( paths );
+  lua_createtable( L, 0, 4 );
+  stat_push_array( L, infos, n, 0 );
+  lua_setfield( L, -2, "size" );
+  stat_push_array( L, infos, n, 1 );
+  lua_setfield( L, -2, "mtime" );
+  stat_push_array( L, infos, n, 2 );
+  lua_setfield( L, -2, "inode" );
+  stat_push_array( L, infos, n, 3 );
+  lua_setfield( L, -2, "type" );
+  free( infos );
+  return 1;
+}
+
+
+APE_API void ape_stat_setup( lua_State* L ) {
+  luaL_Reg const ape_stat_functions[] = {
+  /***
+    Queries size, modification time, inode number, and type of many
+    files at once. Instead of one table per file the result contains
+    one array per property (all indexed like the `paths` array), so
+    checking thousands of files doesn't create thousands of tables.
+    Large arrays of paths are split among multiple threads. The
+    modification times are in microseconds (like `apr_time_t`), the
+    type strings are the same as for `ape.stat`, and missing files
+    have type `"no file"` (or `false` for other errors) and 0 for the
+    numeric properties.
+    @function stat_many
+    @tparam table paths an array of file paths
+    @tparam[opt] number threads the maximum number of threads
+      (default: 4)
+    @treturn table a table with the arrays `size`, `mtime`, `inode`,
+      and `type`
+    @treturn nil,string,number nil, an error message, and an error
+      code in case of an error
+  */
+    { "stat_many", ape_stat_many },
+    { NULL, NULL }
+  };
+  moon_register( L, ape_stat_functions );
+}
+
@@ -0,0 +1,300 @@
+/*
+**  buildsh -- a portable and flexible build system
+**  Copyright (C) 2013  Philipp Janda
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "lua.h"
+#include "lauxlib.h"
+#include "balloc.h"
+
+#if defined( _WIN32 ) || defined( _WIN64 )
+#  include <malloc.h>
+#endif
+
+
+/* slabs are aligned to their size, so the slab of a small block can
+ * be found by masking the block address */
+#define SLAB_SIZE ((size_t)64*1024)
+#define CLASS_GRAIN 16
+#define NCLASSES (BALLOC_MAX_SMALL/CLASS_GRAIN)
+#define CLASS_OF( n ) ((unsigned)(((n)-1)/CLASS_GRAIN))
+#define CLASS_SIZE( c ) (((size_t)(c)+1)*CLASS_GRAIN)
+
+
+typedef struct slab {
+  struct slab* next; /* in the list of non-full slabs of the class */
+  struct slab* prev;
+  void* free; /* released blocks */
+  char* bump; /* start of the never used part of the slab */
+  unsigned used;
+  unsigned capacity;
+  unsigned char cls;
+  unsigned char listed;
+} slab;
+
+#define SLAB_HEADER ((sizeof( slab )+CLASS_GRAIN-1) & ~(size_t)(CLASS_GRAIN-1))
+#define SLAB_OF( p ) ((slab*)((size_t)(p) & ~(SLAB_SIZE-1)))
+
+
+struct balloc {
+  slab* partial[ NCLASSES ]; /* non-full slabs per size class */
+  balloc_stats st;
+};
+
+
+static void* slab_memory( void ) {
+#if defined( _WIN32 ) || defined( _WIN64 )
+  return _aligned_malloc( SLAB_SIZE, SLAB_SIZE );
+#else
+  void* p = NULL;
+  if( posix_memalign( &p, SLAB_SIZE, SLAB_SIZE ) != 0 )
+    return NULL;
+  return p;
+#endif
+}
+
+
+static void slab_memory_free( void* p ) {
+#if defined( _WIN32 ) || defined( _WIN64 )
+  _aligned_free( p );
+#else
+  free( p );
+#endif
+}
+
+
+static void slab_link( balloc* a, slab* s ) {
+  slab** head = &a->partial[ s->cls ];
+  s->prev = NULL;
+  s->next = *head;
+  if( *head )
+    (*head)->prev = s;
+  *head = s;
+  s->listed = 1;
+}
+
+
+static void slab_unlink( balloc* a, slab* s ) {
+  if( s->prev )
+    s->prev->next = s->next;
+  else
+    a->partial[ s->cls ] = s->next;
+  if( s->next )
+    s->next->prev = s->prev;
+  s->next = s->prev = NULL;
+  s->listed = 0;
+}
+
+
+static slab* slab_new( balloc* a, unsigned cls ) {
+  slab* s = slab_memory();
+  if( s == NULL )
+    return NULL;
+  s->free = NULL;
+  s->bump = (char*)s + SLAB_HEADER;
+  s->used = 0;
+  s->capacity = (unsigned)((SLAB_SIZE - SLAB_HEADER) / CLASS_SIZE( cls ));
+  s->cls = (unsigned char)cls;
+  slab_link( a, s );
+  a->st.slabs++;
+  a->st.slab_bytes += SLAB_SIZE;
+  return s;
+}
+
+
+static void slab_release( balloc* a, slab* s ) {
+  slab_unlink( a, s );
+  a->st.slabs--;
+  a->st.slab_bytes -= SLAB_SIZE;
+  a->st.slabs_freed++;
+  slab_memory_free( s );
+}
+
+
+/* an empty slab is kept if it is the only non-full slab of its list,
+ * so that a block size oscillating around a slab boundary doesn't
+ * allocate and free a slab every time */
+static int slab_spare( balloc* a, slab* s ) {
+  return a->partial[ s->cls ] == s && s->next == NULL;
+}
+
+
+static void update_peak( balloc* a ) {
+  size_t total = a->st.small_bytes + a->st.large_bytes;
+  if( total > a->st.peak_bytes )
+    a->st.peak_bytes = total;
+}
+
+
+static void* block_alloc( balloc* a, size_t n ) {
+  void* p = NULL;
+  if( n <= BALLOC_MAX_SMALL ) {
+    unsigned cls = CLASS_OF( n );
+    slab* s = a->partial[ cls ];
+    if( s == NULL && (s = slab_new( a, cls )) == NULL )
+      return NULL;
+    if( s->free != NULL ) {
+      p = s->free;
+      s->free = *(void**)p;
+    } else {
+      p = s->bump;
+      s->bump += CLASS_SIZE( cls );
+    }
+    if( ++s->used == s->capacity )
+      slab_unlink( a, s );
+    a->st.small_bytes += n;
+  } else {
+    p = malloc( n );
+    if( p == NULL )
+      return NULL;
+    a->st.large_allocs++;
+    a->st.large_bytes += n;
+  }
+  update_peak( a );
+  return p;
+}
+
+
+static void block_free( balloc* a, void* p, size_t n ) {
+  if( n <= BALLOC_MAX_SMALL ) {
+    slab* s = SLAB_OF( p );
+    *(void**)p = s->free;
+    s->free = p;
+    if( !s->listed )
+      slab_link( a, s );
+    if( --s->used == 0 && !slab_spare( a, s ) )
+      slab_release( a, s );
+    a->st.small_bytes -= n;
+  } else {
+    free( p );
+    a->st.large_bytes -= n;
+  }
+}
+
+
+void* balloc_alloc( void* ud, void* ptr, size_t osize, size_t nsize ) {
+  balloc* a = ud;
+  void* p = NULL;
+  if( nsize == 0 ) {
+    if( ptr != NULL ) {
+      a->st.frees++;
+      block_free( a, ptr, osize );
+    }
+    return NULL;
+  } else if( ptr == NULL ) {
+    a->st.allocs++;
+    return block_alloc( a, nsize );
+  }
+  a->st.reallocs++;
+  if( osize <= BALLOC_MAX_SMALL && nsize <= BALLOC_MAX_SMALL &&
+      CLASS_OF( osize ) == CLASS_OF( nsize ) ) {
+    a->st.small_bytes += nsize;
+    a->st.small_bytes -= osize;
+    update_peak( a );
+    return ptr;
+  } else if( osize > BALLOC_MAX_SMALL && nsize > BALLOC_MAX_SMALL ) {
+    p = realloc( ptr, nsize );
+    if( p != NULL ) {
+      a->st.large_bytes += nsize;
+      a->st.large_bytes -= osize;
+      update_peak( a );
+    }
+    return p;
+  }
+  p = block_alloc( a, nsize );
+  if( p != NULL ) {
+    memcpy( p, ptr, osize < nsize ? osize : nsize );
+    block_free( a, ptr, osize );
+  }
+  return p;
+}
+
+
+balloc* balloc_new( void ) {
+  balloc* a = malloc( sizeof( *a ) );
+  if( a != NULL )
+    memset( a, 0, sizeof( *a ) );
+  return a;
+}
+
+
+void balloc_delete( balloc* a ) {
+  unsigned i = 0;
+  if( a == NULL )
+    return;
+  /* full slabs aren't linked anywhere, so this only works after all
+   * blocks have been freed (i.e. after lua_close) */
+  for( i = 0; i < NCLASSES; ++i ) {
+    while( a->partial[ i ] )
+      slab_release( a, a->partial[ i ] );
+  }
+  free( a );
+}
+
+
+void balloc_getstats( balloc* a, balloc_stats* s ) {
+  *s = a->st;
+}
+
+
+balloc* balloc_get( lua_State* L ) {
+  void* ud = NULL;
+  if( lua_getallocf( L, &ud ) == balloc_alloc )
+    return ud;
+  return NULL;
+}
+
+
+
+/* Lua interface. All functions are no-ops if the running lua_State
+ * uses a different allocator. */
+
+static int balloc_lstats( lua_State* L ) {
+  balloc* a = balloc_get( L );
+  balloc_stats s;
+  if( a == NULL )
+    return 0;
+  balloc_getstats( a, &s );
+  lua_createtable( L, 0, 10 );
+#define FIELD( _n ) \
+  (lua_pushnumber( L, (lua_Number)s._n ), lua_setfield( L, -2, #_n ))
+  FIELD( small_bytes );
+  FIELD( large_bytes );
+  FIELD( peak_bytes );
+  FIELD( slabs );
+  FIELD( slab_bytes );
+  FIELD( slabs_freed );
+  FIELD( allocs );
+  FIELD( frees );
+  FIELD( reallocs );
+  FIELD( large_allocs );
+#undef FIELD
+  return 1;
+}
+
+
+int luaopen_balloc( lua_State* L ) {
+  luaL_Reg const balloc_funcs[] = {
+    { "stats", balloc_lstats },
+    { NULL, NULL }
+  };
+  lua_newtable( L );
+  luaL_register( L, NULL, balloc_funcs );
+  return 1;
+}
+
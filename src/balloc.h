@@ -0,0 +1,64 @@
+/*
+**  buildsh -- a portable and flexible build system
+**  Copyright (C) 2013  Philipp Janda
+**
+**  This program is free software: you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation, either version 3 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BALLOC_H_
+#define BALLOC_H_
+
+#include <stddef.h>
+#include "lua.h"
+
+
+/* A lua_Alloc implementation for the many small strings and tables
+ * buildsh creates while parsing traces: blocks up to BALLOC_MAX_SMALL
+ * bytes come from fixed size slabs (one free list per size class),
+ * everything else goes to realloc/free. Every lua_State gets its own
+ * allocator state (passed as the `ud` argument), so no locking is
+ * necessary. */
+#define BALLOC_MAX_SMALL 256
+
+typedef struct balloc balloc;
+
+typedef struct {
+  size_t small_bytes;   /* bytes in use by small blocks */
+  size_t large_bytes;   /* bytes in use by large blocks */
+  size_t peak_bytes;    /* maximum of small_bytes + large_bytes */
+  size_t slabs;         /* number of slabs currently allocated */
+  size_t slab_bytes;    /* memory reserved for slabs */
+  size_t slabs_freed;   /* number of slabs given back so far */
+  unsigned long allocs; /* number of allocations (small and large) */
+  unsigned long frees;  /* number of deallocations */
+  unsigned long reallocs; /* number of size changes */
+  unsigned long large_allocs; /* allocations that bypassed the slabs */
+} balloc_stats;
+
+
+balloc* balloc_new( void );
+void balloc_delete( balloc* a );
+void* balloc_alloc( void* ud, void* ptr, size_t osize, size_t nsize );
+
+void balloc_getstats( balloc* a, balloc_stats* s );
+
+/* returns the allocator state of a lua_State or NULL if the state
+ * doesn't use this allocator */
+balloc* balloc_get( lua_State* L );
+
+/* Lua interface (module "balloc") */
+int luaopen_balloc( lua_State* L );
+
+#endif /* BALLOC_H_ */
+
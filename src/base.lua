@@ -28,32 +28,37 @@ function _M.hex2name( s )
 end
 
 
-local get_path
+local get_path, get_paths
 do
   local cwd = ape.filepath_get( ape.FILEPATH_NATIVE )
-  local cwd_up = cwd and cwd:upper()
-  local dirsep = package.config:sub( 1, 1 )
-
-  function get_path( ccwd, p, transform )
-    if not ape.filepath_root( p, ape.FILEPATH_NATIVE ) then
-      return ape.filepath_merge( ccwd, p, ape.FILEPATH_NATIVE )
-    else
+  -- the same paths are looked up over and over again (e.g. header
+  -- files), so the normalized paths are cached in C (one cache per
+  -- transformation of the cwd)
+  local caches = {}
+
+  local function get_cache( transform )
+    local c = caches[ transform or false ]
+    if not c then
       local mycwd = cwd
-      if transform then mycwd = transform( cwd ) end
-      if mycwd and #mycwd <= #p and p:sub( 1, #mycwd ) == mycwd then
-        local rel = p:sub( #mycwd+1 )
-        while rel:sub( 1, 1 ) == "/" do
-          rel = rel:sub( 2 )
-        end
-        while rel:sub( 1, #dirsep ) == dirsep do
-          rel = rel:sub( 1+#dirsep )
-        end
-        return ape.filepath_merge( ".", rel, ape.FILEPATH_NATIVE )
-      end
+      if transform and cwd then mycwd = transform( cwd ) end
+      c = ape.filepath_cache( mycwd )
+      caches[ transform or false ] = c
     end
+    return c
+  end
+
+  function get_path( ccwd, p, transform )
+    return get_cache( transform ):normalize( ccwd, p )
+  end
+
+  -- normalizes an array of paths at once, the resulting array
+  -- contains false for paths outside of the project
+  function get_paths( ccwd, ps, transform )
+    return get_cache( transform ):normalize_many( ccwd, ps )
   end
 end
 _M.get_path = get_path
+_M.get_paths = get_paths
 
 
 local function get_pathat( pd, pid, atfd, name )
@@ -164,6 +169,25 @@ function _M.exec( td, pd, pid, prog )
 end
 
 
+-- an empty program name refers to the file descriptor itself (as used
+-- by fexecve and AT_EMPTY_PATH)
+local function execat( td, pd, pid, atfd, prog )
+  local progpath
+  if prog == "" then
+    progpath = pd[ pid ][ atfd ]
+  elseif atfd ~= "AT_FDCWD" or prog ~= ape.basename( prog ) then
+    progpath = get_pathat( pd, pid, atfd, prog )
+  end
+  if progpath and not td.output[ progpath ] then
+    td.input[ progpath ] = true
+  end
+end
+
+function _M.execat( td, pd, pid, atfd, prog )
+  return checked( execat, td, pd, pid, atfd, prog )
+end
+
+
 local function chdir( td, pd, pid, name )
   local path = get_path( pd[ pid ].cwd, name )
   pd[ pid ].cwd = path or name
@@ -210,6 +234,69 @@ function _M.mkdirat( td, pd, pid, atfd, name )
 end
 
 
+-- a failed lookup of a file is recorded as an input with a special
+-- hash, so that the command runs again if the file shows up
+_M.ABSENT = "-"
+
+local function missing( td, pd, pid, name )
+  local path = get_path( pd[ pid ].cwd, name )
+  if path and not td.output[ path ] and not td.input[ path ] then
+    td.input[ path ] = _M.ABSENT
+  end
+end
+
+function _M.missing( td, pd, pid, name )
+  return checked( missing, td, pd, pid, name )
+end
+
+
+local function missingat( td, pd, pid, atfd, name )
+  local path = get_pathat( pd, pid, atfd, name )
+  if path and not td.output[ path ] and not td.input[ path ] then
+    td.input[ path ] = _M.ABSENT
+  end
+end
+
+function _M.missingat( td, pd, pid, atfd, name )
+  return checked( missingat, td, pd, pid, atfd, name )
+end
+
+
+-- files whose metadata was looked at (stat, access, readlink, ...)
+-- without reading them are recorded as inputs with a value starting
+-- with this prefix. The engine compares existence, type, (and for
+-- regular files) size and modification time of those instead of a
+-- content hash.
+_M.PROBED = "?"
+
+function _M.is_probe( h )
+  return type( h ) == "string" and h:sub( 1, 1 ) == _M.PROBED
+end
+
+local function probe( td, pd, pid, name )
+  local path = get_path( pd[ pid ].cwd, name )
+  if path and not td.output[ path ] and not td.input[ path ] then
+    td.input[ path ] = _M.PROBED
+  end
+end
+
+function _M.probe( td, pd, pid, name )
+  return checked( probe, td, pd, pid, name )
+end
+
+
+local function probeat( td, pd, pid, atfd, name )
+  local path = get_pathat( pd, pid, atfd, name )
+  if path and not td.output[ path ] and not td.input[ path ] then
+    td.input[ path ] = _M.PROBED
+  end
+end
+
+function _M.probeat( td, pd, pid, atfd, name )
+  return checked( probeat, td, pd, pid, atfd, name )
+end
+
+
 local function fork( td, pd, ppid, cpid )
   local ppdata, cpdata = pd[ ppid ], {}
   for k,v in pairs( ppdata ) do
@@ -224,6 +311,32 @@ function _M.fork( td, pd, ppid, cpid )
 end
 
 
+-- for tracers that tag every event with the parent pid: a process
+-- that hasn't been seen before inherits the state of its parent (which
+-- can't have changed since the child was created, because all events
+-- of the parent before the fork are already processed), or starts in
+-- the given working directory if the parent is unknown as well, so
+-- events never have to be delayed. The parent pid is remembered, so
+-- that a later fork event for the same child can be recognized.
+function _M.adopt( td, pd, pid, ppid, cwd )
+  if pd[ pid ] then
+    return
+  end
+  local pdata, ppdata = nil, pd[ ppid ]
+  if ppdata then
+    pdata = {}
+    for k,v in pairs( ppdata ) do
+      pdata[ k ] = v
+    end
+  else
+    pdata = { cwd = cwd }
+  end
+  pdata.ppid = ppid
+  pd[ pid ] = pdata
+  replay( td, pd, pid )
+end
+
+
 local function rename( td, pd, pid, from, to )
   local fpath = get_path( pd[ pid ].cwd, from )
   local tpath = get_path( pd[ pid ].cwd, to )
@@ -262,9 +375,14 @@ end
 
 function _M.finish( deps, td )
   -- avoid rehashing of input files
-  for k in pairs( td.input ) do
-    if deps.input[ k ] then
-      td.input[ k ] = deps.input[ k ]
+  for k,v in pairs( td.input ) do
+    local old = deps.input[ k ]
+    if td.output[ k ] and (v == _M.ABSENT or v == _M.PROBED) then
+      -- the command created the file itself after looking for it
+      td.input[ k ] = nil
+    elseif old and v ~= _M.ABSENT and
+           _M.is_probe( old ) == (v == _M.PROBED) then
+      td.input[ k ] = old
     end
   end
   -- replace old deps with new ones
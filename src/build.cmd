@@ -50,23 +50,30 @@ link.exe /nologo /OUT:luac.exe luac.obj print.obj lua5.1-static.lib
 
 :buildsh
 
-.\lua.exe lua2inc.lua build.lua make.lua base.lua strace.lua ktrace.lua preload.lua tracker.lua
+.\lua.exe lua2inc.lua build.lua make.lua base.lua strace.lua ktrace.lua preload.lua tracker.lua fanotify.lua jobs.lua depstore.lua cgroup.lua
 
 cl.exe %CFLAGS% ape.c
+cl.exe %CFLAGS% ape_clean.c
 cl.exe %CFLAGS% ape_env.c
 cl.exe %CFLAGS% ape_errno.c
 cl.exe %CFLAGS% ape_extra.c
+cl.exe %CFLAGS% ape_fanotify.c
 cl.exe %CFLAGS% ape_file.c
 cl.exe %CFLAGS% ape_fnmatch.c
 cl.exe %CFLAGS% ape_fpath.c
+cl.exe %CFLAGS% ape_glob.c
+cl.exe %CFLAGS% ape_job.c
+cl.exe %CFLAGS% ape_lines.c
 cl.exe %CFLAGS% ape_pool.c
 cl.exe %CFLAGS% ape_proc.c
 cl.exe %CFLAGS% ape_random.c
+cl.exe %CFLAGS% ape_stat.c
 cl.exe %CFLAGS% ape_time.c
 cl.exe %CFLAGS% ape_user.c
 cl.exe %CFLAGS% moon\moon.c
+cl.exe %CFLAGS% balloc.c
 cl.exe %CFLAGS% buildsh.c
-link.exe /nologo /OUT:buildsh.exe buildsh.obj ape*.obj moon.obj lua5.1.lib ".\apr-win32\libapr-1.lib"
+link.exe /nologo /OUT:buildsh.exe buildsh.obj balloc.obj ape*.obj moon.obj lua5.1.lib ".\apr-win32\libapr-1.lib"
 if exist buildsh.exe (
   @echo To install put buildsh.exe and libapr-1.dll somewhere in your PATH.
   @echo Have fun!
@@ -17,67 +17,15 @@
 local ape = require( "ape" ) -- (subset of) apache portable runtime
 local bci = require( "bci" ) -- bytecode inspector library
 local make = require( "make" ) -- useful functions for buildsh scripts
+local jobs = require( "jobs" ) -- admission control for commands
+local cgroup = require( "cgroup" ) -- per-command cgroups (Linux)
+local depstore = require( "depstore" ) -- on-disk dependency records
+local base = require( "base" ) -- common code for syscall tracers
 local dirsep = package.config:sub( 1, 1 )
 local _G = _G
 _G.make = make
 
-local exec_handler, dependencies, depproxy, dont_save_deps
-
-
-local function save_deps( deps )
-  local f = io.open( ".deps.lua", "w" )
-  if f then
-    f:write( "return {\n" )
-    for k,v in pairs( deps ) do
-      if type( k ) == "string" and type( v ) == "table" then
-        f:write( ("  [ %q ] = {\n"):format( k ) )
-        if type( v.input ) == "table" then
-          f:write( "    input = {\n" )
-          for fn,h in pairs( v.input ) do
-            if type( fn ) == "string" and type( h ) == "string" then
-              f:write( ("      [ %q ] = %q,\n"):format( fn, h ) )
-            end
-          end
-          f:write( "    },\n" )
-        end
-        if type( v.output ) == "table" then
-          f:write( "    output = {\n" )
-          for fn,h in pairs( v.output ) do
-            if type( fn ) == "string" and type( h ) == "string" then
-              f:write( ("      [ %q ] = %q,\n"):format( fn, h ) )
-            end
-          end
-          f:write( "    },\n" )
-        end
-        f:write( "  },\n" )
-      end
-    end
-    f:write( "}\n" )
-    f:close()
-  end
-end
-
-
-local function load_deps()
-  local f, ok, t = loadfile( ".deps.lua" ), nil, nil
-  if f then
-    setfenv( f, {} )
-    ok, t = pcall( f )
-    if not ok or type( t ) ~= "table" then
-      t = {}
-    end
-  else
-    t = {}
-  end
-  local ud = newproxy( true )
-  local m = getmetatable( ud )
-  m.__gc = function()
-    if not dont_save_deps then
-      save_deps( t )
-    end
-  end
-  return t, ud
-end
+local exec_handler, dependencies, depproxy
 
 
 -- handle commandline arguments
@@ -237,7 +185,15 @@ end
 
 local function call_buildsh_function( fname, f, is_target )
   local cont = true
-  local ok, res_or_msg = pcall( f )
+  -- target functions run as coroutines of the job scheduler, so that
+  -- commands can execute concurrently
+  local ok, res_or_msg = (is_target and jobs.run or pcall)( f )
+  if not is_target then
+    -- programs started via `make.pipe_async` whose output was never
+    -- asked for
+    while jobs.poll() do
+    end
+  end
   if not ok then
     if type( res_or_msg ) == "table" then
       if res_or_msg.type == "file" then
@@ -316,7 +272,7 @@ do
 end
 
 
-local argv2cmd
+local argv2cmd, cmd2argv
 do
   local a2c_pattern = dirsep == "\\" and "[%s\"]" or "[%s\\\"]"
   local a2c_repl = {
@@ -328,24 +284,91 @@ do
   }
 
   function argv2cmd( argv, dir )
-    local s = ""
+    local t = {}
     if dir then
       if dir:match( a2c_pattern ) then
         dir = '"' .. dir:gsub( a2c_pattern, a2c_repl ) .. '"'
       end
-      s = "cd " .. dir .. " && "
+      t[ 1 ] = "cd " .. dir .. " &&"
     end
     for i = 1, #argv do
       local a = argv[ i ]
       if a:match( a2c_pattern ) then
         a = '"' .. a:gsub( a2c_pattern, a2c_repl ) .. '"'
       end
-      s = s .. a
-      if i < #argv then
-        s = s .. " "
+      t[ #t+1 ] = a
+    end
+    return table.concat( t, " " )
+  end
+
+  -- the characters escaped by a backslash inside quotes
+  local a2c_escaped = dirsep == "\\" and '"' or '[\\"]'
+
+  -- splits a command line created by argv2cmd (for converting the
+  -- dependencies of older versions). Returns nil if it can't be
+  -- parsed, whitespace inside arguments is lost.
+  function cmd2argv( s )
+    local words, pos = {}, 1
+    while pos <= #s do
+      if s:sub( pos, pos ) == '"' then
+        local t, c = {}, nil
+        pos = pos + 1
+        repeat
+          local q = s:find( '[\\"]', pos )
+          if not q then
+            return nil
+          end
+          t[ #t+1 ] = s:sub( pos, q-1 )
+          c, pos = s:sub( q, q ), q + 1
+          if c == "\\" then
+            local n = s:sub( pos, pos )
+            if n ~= "" and n:match( a2c_escaped ) then
+              t[ #t+1 ], pos = n, pos + 1
+            else
+              t[ #t+1 ] = c
+            end
+          end
+        until c == '"'
+        words[ #words+1 ] = table.concat( t )
+      else
+        local e = s:find( " ", pos, true ) or #s+1
+        words[ #words+1 ], pos = s:sub( pos, e-1 ), e
+      end
+      if pos <= #s then
+        if s:sub( pos, pos ) ~= " " then
+          return nil
+        end
+        pos = pos + 1
       end
     end
-    return s
+    if words[ 1 ] == "cd" and words[ 3 ] == "&&" then
+      local argv = {}
+      for i = 4, #words do
+        argv[ i-3 ] = words[ i ]
+      end
+      return argv, words[ 2 ]
+    end
+    return words
+  end
+end
+
+
+-- commands are identified by a digest of the working directory and
+-- the arguments (which can't contain NUL characters), so the cost of
+-- looking up and storing their dependencies doesn't depend on the
+-- length of the command line. The environment is deliberately not
+-- part of the key: commands that differ only in their environment
+-- share one record.
+local command_key
+do
+  local hasher = ape.sha256_new( ape.pool_create() )
+
+  function command_key( argv, dir )
+    hasher:reset():update( dir and "d" .. dir or "-", "\0" )
+    for i = 1, #argv do
+      hasher:update( argv[ i ], "\0" )
+    end
+    return hasher:digest()
   end
 end
 
@@ -356,9 +379,12 @@ do
 
   function hash_file( filename )
     hasher:reset()
-    local ok, msg = ape.hash_file( hasher, filename )
+    local ok, msg, code = ape.hash_file( hasher, filename )
     if ok then
       return hasher:digest()
+    elseif code and (ape.is_ENOENT( code ) or ape.is_ENOTDIR( code )) then
+      -- must match the hash for failed lookups of the tracers
+      return base.ABSENT
     else
       return msg
     end
@@ -366,23 +392,124 @@ do
 end
 
 
-local function deep_copy( v )
-  if type( v ) == "table" then
-    local t = {}
-    for k,v in pairs( v ) do
-      t[ k ] = deep_copy( v )
+-- hashes many files at once (using multiple threads), returns a table
+-- mapping file names to hashes like `hash_file`
+local function hash_files( filenames )
+  local digests, msgs, codes = ape.sha256_files( filenames )
+  local hashes = {}
+  for i,fn in ipairs( filenames ) do
+    local h = digests[ i ]
+    if not h then
+      local code = codes[ i ]
+      if code and (ape.is_ENOENT( code ) or ape.is_ENOTDIR( code )) then
+        h = base.ABSENT
+      else
+        h = msgs[ i ]
+      end
+    end
+    hashes[ fn ] = h
+  end
+  return hashes
+end
+
+
+-- maps the file names of probed dependencies (see `base.PROBED`) to
+-- values describing existence, type, and (for regular files) size and
+-- modification time, all queried at once
+local function probe_files( filenames )
+  local st = assert( ape.stat_many( filenames ) )
+  local probes = {}
+  for i,fn in ipairs( filenames ) do
+    local t = st.type[ i ] or "error"
+    if t == "regular file" then
+      probes[ fn ] = ("%s%s %.0f %.0f"):format( base.PROBED, t,
+                                               st.size[ i ],
+                                               st.mtime[ i ] )
+    else
+      probes[ fn ] = base.PROBED .. t
     end
-    return t
   end
-  return v
+  return probes
 end
 
 
-local function update_deps_io( deps_io, onlynew, stop )
-  local differ = false
+-- file hashes computed during this run: a file is hashed only once
+-- unless it is written by a command with dependency tracking (its
+-- outputs are hashed again afterwards). Commands without dependency
+-- tracking (including `make.pipe`) might write anything, so the cache
+-- is dropped after them. Files written by Lua code are not noticed
+-- unless the build script calls `make.invalidate`.
+local hash_cache = {}
+-- the same for probed files
+local probe_cache = {}
+-- input sets (by digest) found unchanged, mapped to the value of
+-- `hash_epoch` at the time of the check. The epoch changes whenever a
+-- file hash in the cache changes.
+local set_checks, hash_epoch = {}, 0
+
+
+local function flush_hash_cache()
+  hash_cache = {}
+  probe_cache = {}
+  hash_epoch = hash_epoch + 1
+end
+
+
+-- minimum number of files to hash in one `hash_files` call
+local HASH_BULK_MIN = 8
+
+
+-- entries added by the tracers that have no hash yet
+local function is_new( h )
+  return type( h ) ~= "string" or h == base.PROBED
+end
+
+
+local function update_deps_io( deps_io, onlynew, stop, fresh )
+  local differ, hashed, probed = false, nil, nil
+  -- hash (and probe) all missing files in one go unless we might stop
+  -- early
+  if not stop then
+    local todo, ptodo = {}, {}
+    for fn,ohash in pairs( deps_io ) do
+      if not onlynew or is_new( ohash ) then
+        if base.is_probe( ohash ) then
+          if not probe_cache[ fn ] then
+            ptodo[ #ptodo+1 ] = fn
+          end
+        elseif fresh or not hash_cache[ fn ] then
+          todo[ #todo+1 ] = fn
+        end
+      end
+    end
+    if #todo >= HASH_BULK_MIN then
+      hashed = hash_files( todo )
+    end
+    if #ptodo > 0 then
+      probed = probe_files( ptodo )
+    end
+  end
   for fn,ohash in pairs( deps_io ) do
-    if not onlynew or type( ohash ) ~= "string" then
-      local nhash = hash_file( fn )
+    if not onlynew or is_new( ohash ) then
+      local nhash
+      if base.is_probe( ohash ) then
+        nhash = probe_cache[ fn ] or probed and probed[ fn ] or
+                probe_files( { fn } )[ fn ]
+        probe_cache[ fn ] = nhash
+      else
+        nhash = not fresh and hash_cache[ fn ]
+        if not nhash then
+          nhash = hashed and hashed[ fn ] or hash_file( fn )
+          if fresh then
+            if hash_cache[ fn ] ~= nhash then
+              hash_epoch = hash_epoch + 1
+            end
+            -- the metadata has probably changed as well
+            probe_cache[ fn ] = nil
+          end
+          hash_cache[ fn ] = nhash
+        end
+      end
       deps_io[ fn ] = nhash
       if ohash ~= nhash then
         differ = true
@@ -394,14 +521,13 @@ local function update_deps_io( deps_io, onlynew, stop )
 end
 
 
-local function check_deps( depstable, cmd )
+-- the record is a private copy from the store, so it can be updated
+-- in place
+local function check_deps( deps )
   local run_it = false
-  local deps = depstable[ cmd ]
   if type( deps ) ~= "table" then
     deps = { input = {}, output = {} }
     run_it = true
-  else
-    deps = deep_copy( deps )
   end
   if type( deps.input ) ~= "table" then
     deps.input = {}
@@ -415,7 +541,15 @@ local function check_deps( depstable, cmd )
     run_it = true
   end
   if not run_it then
-    run_it = update_deps_io( deps.input )
+    -- many commands share the same input set, which needs to be
+    -- checked only once as long as no file hash has changed
+    local set = deps.inputset
+    if not set or set_checks[ set ] ~= hash_epoch then
+      run_it = update_deps_io( deps.input )
+      if set and not run_it then
+        set_checks[ set ] = hash_epoch
+      end
+    end
     if not run_it then
       run_it = update_deps_io( deps.output, false, true )
     end
@@ -424,11 +558,92 @@ local function check_deps( depstable, cmd )
 end
 
 
+-- returns the file name of the function `lvl` levels up the call
+-- stack as a prefix for error messages, because errors of concurrent
+-- commands are raised later from a different place
+local function call_site( lvl )
+  local info = debug.getinfo( lvl+1, "Sl" )
+  if info and info.currentline > 0 then
+    return info.short_src .. ":" .. info.currentline .. ": "
+  end
+  return ""
+end
+
+
+-- paths (relative to the current directory) that a command might read
+-- and write according to its recorded dependencies (and its non-option
+-- arguments). If the outputs haven't been recorded yet, there is no
+-- second return value: the outputs can't be guessed from the arguments
+-- (e.g. `cc -c a.c` writes `a.o`), so such a command must run alone.
+local command_paths
+do
+  local function join( dir, a )
+    a = a:gsub( "^%.[/\\]+", "" )
+    if dir and not (a:match( "^[/\\]" ) or a:match( "^%a:" )) then
+      a = dir .. dirsep .. a
+    end
+    return a
+  end
+
+  function command_paths( argv, dir, record )
+    local reads, writes = {}, nil
+    if argv[ 1 ] then
+      reads[ 1 ] = join( dir, argv[ 1 ] )
+    end
+    for i = 2, #argv do
+      local a = argv[ i ]
+      if type( a ) == "string" and a ~= "" and a:sub( 1, 1 ) ~= "-" then
+        reads[ #reads+1 ] = join( dir, a )
+      end
+    end
+    if type( record ) == "table" then
+      if type( record.input ) == "table" then
+        for fn in pairs( record.input ) do
+          reads[ #reads+1 ] = fn
+        end
+      end
+      if type( record.output ) == "table" then
+        writes = {}
+        for fn in pairs( record.output ) do
+          reads[ #reads+1 ] = fn
+          writes[ #writes+1 ] = fn
+        end
+      end
+    end
+    return reads, writes
+  end
+end
+
+
+local function exit_error( where, p, etype, code )
+  if etype == "exit" then
+    error( where .. "program `" .. p .. "' exited with status code " .. tostring( code ), 0 )
+  elseif etype == "signal" then
+    error( where .. "program `" .. p .. "' died from signal " .. tostring( code ), 0 )
+  else
+    error( where .. "exec'" .. p .. "' = " .. tostring( etype ), 0 )
+  end
+end
+
+
+-- resource limits for commands are ignored (with a warning) if cgroups
+-- are not available
+local warned_limits = false
+
+local function warn_limits( msg )
+  if not warned_limits then
+    warned_limits = true
+    err:write( "== ", msg or "cgroups not available",
+               ", ignoring `memory_max'/`cpu_max'\n" )
+  end
+end
+
+
 function make.run( p )
   return function( a, ... )
     local p = p
     local argv = flatten( p, a, ... )
-    local dir, echo
+    local dir, echo, memory_max, cpu_max
     if type( a ) == "table" then
       if type( a.echo ) == "string" then
         echo = a.echo
@@ -436,154 +651,332 @@ function make.run( p )
       if type( a.dir ) == "string" then
         dir = a.dir
       end
+      if type( a.memory_max ) == "string" or
+         type( a.memory_max ) == "number" then
+        memory_max = a.memory_max
+      end
+      if type( a.cpu_max ) == "string" or
+         type( a.cpu_max ) == "number" then
+        cpu_max = a.cpu_max
+      end
+    end
+    local where = call_site( 2 )
+    local key = command_key( argv, dir )
+    -- wait for running commands that might write files we use (or
+    -- for all of them if we don't know what this command writes)
+    local record = dependencies:get( key )
+    local reads, writes = command_paths( argv, dir, record )
+    jobs.check()
+    if writes then
+      jobs.wait( function() return not jobs.conflicts( reads ) end )
+    else
+      jobs.wait( jobs.idle )
     end
-    local sargv = argv2cmd( argv, dir )
-    local deps, run_it = check_deps( dependencies, sargv )
+    jobs.check()
+    local deps, run_it = check_deps( record )
     if run_it then
-      dont_save_deps = nil
+      -- throttle according to job limit, system load and memory
+      jobs.wait( function() return jobs.admit( deps.rss ) end )
+      jobs.check()
+      -- the echo line is printed together with the output of the
+      -- command when it has finished
+      local cmdline = argv2cmd( argv, dir )
+      local line = cmdline
       if echo then
         local bn = ape.basename( p, ".exe", ".cmd", ".bat" )
         if bn then
-          err:write( "[", bn, "] ", echo, "\n" )
-        else
-          err:write( sargv, "\n" )
+          line = "[" .. bn .. "] " .. echo
         end
-      else
-        err:write( sargv, "\n" )
       end
-      local data
+      -- a handler may need a special environment for the command
+      -- (which must not leak into other commands running meanwhile)
+      local data, env
       if type( exec_handler ) == "table" and
          type( exec_handler.pre_process ) == "function" then
-        argv, data = exec_handler.pre_process( argv )
+        argv, data, env = exec_handler.pre_process( argv )
         p = argv[ 1 ]
+        if env then
+          -- without `PATH` search some platforms ignore `env`
+          p = ape.find_exec( p ) or p
+        end
       end
-      local pool = ape.pool_create()
-      local pattr, msg = ape.procattr_create( pool )
-      if not pattr then error( "exec'" .. p .. "' = " .. msg, 2 ) end
-      local ok, msg = pattr:cmdtype_set( "program/path" )
-      if not ok then error( "exec'" .. p .. "' = " .. msg, 2 ) end
-      ok, msg = pattr:io_set( "file", "file", "file" )
-      if not ok then error( "exec'" .. p .. "' = " .. msg, 2 ) end
-      if dir then
-        ok, msg = pattr:dir_set( dir )
-        if not ok then error( "exec'" .. p .. "' = " .. msg, 2 ) end
-      end
-      local proc, msg = ape.proc_create( p, argv, nil, pattr )
-      if not proc then error( "exec'" .. p .. "' = " .. msg, 2 ) end
-      local ok, etype, code  = proc:wait( "wait" )
-      if not ok then
-        if etype == "exit" then
-          error( "program `" .. p .. "' exited with status code " .. tostring( code ), 2 )
-        elseif etype == "signal" then
-          error( "program `" .. p .. "' died from signal " .. tostring( code ), 2 )
-        else
-          error( "exec'" .. p .. "' = " .. etype, 2 )
+      local function discard()
+        if type( exec_handler ) == "table" and
+           type( exec_handler.discard ) == "function" then
+          exec_handler.discard( data )
         end
-      elseif type( exec_handler ) == "table" and
-             type( exec_handler.post_process ) == "function" then
-        if not dir then
-          dir = "."
+      end
+      local cg, cgmsg = cgroup.create( memory_max, cpu_max )
+      if not cg and (memory_max or cpu_max) then
+        warn_limits( cgmsg )
+      end
+      local token = jobs.acquire( deps.rss )
+      local job, msg = ape.job_spawn( p, argv, env, {
+        dir = dir,
+        path = true,
+        pgroup = type( exec_handler ) == "table" and exec_handler.pgroup,
+        cgroup = cg,
+      } )
+      if not job then
+        if cg then cgroup.collect( cg ) end
+        jobs.release( token )
+        discard()
+        error( "exec'" .. p .. "' = " .. msg, 2 )
+      end
+      local finished = false
+      jobs.add( job, writes, function( job )
+        finished = true
+        jobs.release( token )
+        local flushed, fmsg = job:flush( line )
+        if not flushed then
+          err:write( "== output of `", p, "' is incomplete: ", fmsg, "\n" )
         end
-        exec_handler.post_process( deps, data, dir )
-        update_deps_io( deps.input, true, false )
-        update_deps_io( deps.output )
-        dependencies[ sargv ] = deps
+        local ok, etype, code, maxrss = job:status()
+        if maxrss and maxrss > 0 then
+          deps.rss = maxrss
+        end
+        if cg then
+          deps.cpu, deps.mem, deps.io = cgroup.collect( cg )
+        end
+        if not ok then
+          discard()
+          exit_error( where, p, etype, code )
+        elseif type( exec_handler ) == "table" and
+               type( exec_handler.post_process ) == "function" then
+          -- the collector is stopped until the dependencies are
+          -- merged, the garbage is collected while waiting for
+          -- commands (see jobs.lua)
+          jobs.gc_stop()
+          local ok, msg = pcall( exec_handler.post_process, deps, data,
+                                 dir or ".", job:pid(), cg )
+          if ok then
+            ok, msg = pcall( function()
+              update_deps_io( deps.input, true, false )
+              update_deps_io( deps.output, false, false, true )
+              dependencies:set( key, deps, cmdline )
+            end )
+          end
+          jobs.gc_restart()
+          if not ok then
+            error( msg, 0 )
+          end
+        else
+          flush_hash_cache()
+        end
+      end )
+      -- outside of target functions commands run synchronously
+      if not jobs.managed() then
+        jobs.wait( function() return finished end )
+        jobs.check()
       end
     end
   end
 end
 
 
+-- starts a program whose output is needed by the build script, and
+-- returns a function that waits for the program and returns its
+-- output
+local function pipe_start( p, argv, where )
+  local reads = command_paths( argv )
+  jobs.check()
+  jobs.wait( function() return not jobs.conflicts( reads ) end )
+  jobs.check()
+  jobs.wait( function() return jobs.admit() end )
+  jobs.check()
+  err:write( argv2cmd( argv ), "\n" )
+  local token = jobs.acquire()
+  local job, msg = ape.job_spawn( p, argv, nil, { path = true } )
+  if not job then
+    jobs.release( token )
+    error( where .. "exec'" .. p .. "' = " .. msg, 0 )
+  end
+  local finished, output = false, nil
+  jobs.add( job, {}, function( job )
+    finished = true
+    jobs.release( token )
+    -- the program might have written any file
+    flush_hash_cache()
+  end )
+  return function()
+    if output then
+      return output
+    end
+    jobs.wait( function() return finished end )
+    local errout, msg = job:errout()
+    if errout and errout ~= "" then
+      err:write( errout )
+    end
+    local ok, etype, code = job:status()
+    if ok then
+      -- the output is data for the build script, so it must be complete
+      output, msg = job:output()
+      if not output then
+        error( where .. "output of `" .. p .. "' is incomplete: " .. msg, 0 )
+      end
+      return output
+    else
+      exit_error( where, p, etype, code )
+    end
+  end
+end
+
+
 function make.pipe( p )
   local f = make.have_exec( p )
   if not f then
     error( { type = "exec", p } )
   end
   return function( ... )
-    local argv = flatten( p, ... )
-    err:write( argv2cmd( argv ), "\n" )
-    local ok, etype, code, output = ape.run_collect( "program/path", p, argv )
-    if ok then
-      return output
-    else
-      if etype == "exit" then
-        error( "program `" .. p .. "' exited with status code " .. tostring( code ), 2 )
-      elseif etype == "signal" then
-        error( "program `" .. p .. "' died from signal " .. tostring( code ), 2 )
-      else
-        error( "exec'" .. p .. "' = " .. etype, 2 )
-      end
-    end
+    return pipe_start( p, flatten( p, ... ), call_site( 2 ) )()
   end
 end
 
 
-local collect_outputs
-do
-  --[[
-  local function compare( a, b )
-    local a_len, b_len = #a, #b
-    if a_len > b_len then
-      return true
-    elseif a_len == b_len then
-      return a > b
-    else
-      return false
-    end
+-- like `make.pipe`, but the program runs in the background: the
+-- function returned for it gives the output once it is needed
+function make.pipe_async( p )
+  local f = make.have_exec( p )
+  if not f then
+    error( { type = "exec", p } )
   end
-  --]]
-  local function compare( a, b )
-    return a > b
+  return function( ... )
+    return pipe_start( p, flatten( p, ... ), call_site( 2 ) )
   end
+end
 
-  function collect_outputs( deps )
-    local t = {}
-    if type( deps ) == "table" then
-      for _,v in pairs( deps ) do
-        if type( v ) == "table" and
-           type( v.output ) == "table" then
-          for o in pairs( v.output ) do
-            if type( o ) == "string" then
-              t[ #t+1 ] = o
-            end
-          end
+
+local function collect_outputs( store )
+  local t, seen = {}, {}
+  for _,v in store:each() do
+    if type( v.output ) == "table" then
+      for o in pairs( v.output ) do
+        if type( o ) == "string" and not seen[ o ] then
+          seen[ o ] = true
+          t[ #t+1 ] = o
         end
       end
     end
-    table.sort( t, compare )
-    return t
+  end
+  return t
+end
+
+
+-- for build scripts that write files themselves: drops the cached
+-- hashes (and metadata) of the given files, or of all files
+function make.invalidate( ... )
+  local n = select( '#', ... )
+  if n == 0 then
+    flush_hash_cache()
+  else
+    for i = 1, n do
+      local fn = select( i, ... )
+      if type( fn ) == "string" then
+        hash_cache[ fn ] = nil
+        probe_cache[ fn ] = nil
+      end
+    end
+    -- input sets containing the files must be checked again
+    hash_epoch = hash_epoch + 1
   end
 end
 
 
+-- the files are removed in parallel (grouped by directory), output
+-- directories are removed afterwards if they are empty
 function make.autoclean()
+  jobs.wait( jobs.idle )
   err:write( "== cleaning up ...\n" )
-  dont_save_deps = true
   local outputs = collect_outputs( dependencies )
-  outputs[ #outputs+1 ] = ".deps.lua"
-  for _,f in ipairs( outputs ) do
-    write_err( nil, nil, "deleting `" .. f .. "' ..." )
-    if not os.remove( f ) then
-      ape.dir_remove( f )
-    end
+  local function progress( done, total )
+    err:write( "\r-- deleting outputs ... ", done, "/", total )
   end
-  for k in pairs( dependencies ) do
-    dependencies[ k ] = nil
+  local removed, failed = ape.clean_files( outputs, nil, progress )
+  err:write( " (", removed, " deleted)\n" )
+  for f, msg in pairs( failed ) do
+    write_err( nil, nil, "cannot delete `" .. f .. "': " .. msg )
   end
+  write_err( nil, nil, "deleting `" .. dependencies.idxname .. "' ..." )
+  dependencies:clear()
+  flush_hash_cache()
 end
 
 
 
+-- the dependencies of older versions are keyed by the command line
+local function legacy_key( cmdline )
+  local argv, dir = cmd2argv( cmdline )
+  if argv and #argv > 0 then
+    return command_key( argv, dir )
+  end
+end
+
+
+local function load_deps()
+  local store = depstore.open( ".deps" )
+  -- convert dependencies saved by older versions (store versions
+  -- before 3 are keyed by command line), and records written to the
+  -- journal before the first compaction, so that the index is created
+  local old = {}
+  if not store.version or store.version < 3 then
+    for k,v in store:each() do
+      old[ #old+1 ] = { k, v, true }
+    end
+  end
+  local f = loadfile( ".deps.lua" )
+  if f then
+    setfenv( f, {} )
+    local ok, t = pcall( f )
+    if ok and type( t ) == "table" then
+      for k,v in pairs( t ) do
+        if type( k ) == "string" and type( v ) == "table" then
+          old[ #old+1 ] = { k, v }
+        end
+      end
+    end
+  end
+  for i = 1, #old do
+    local k, v, stored = old[ i ][ 1 ], old[ i ][ 2 ], old[ i ][ 3 ]
+    if not k:match( "^" .. ("%x"):rep( 64 ) .. "$" ) then
+      if stored then
+        store:set( k, nil )
+      end
+      local key = legacy_key( k )
+      if key then
+        store:set( key, v, k )
+      end
+    end
+  end
+  if (#old > 0 or f) and store:compact() then
+    os.remove( ".deps.lua" )
+  end
+  -- updates are journaled immediately, so only the journal needs to
+  -- be closed at exit
+  local ud = newproxy( true )
+  local m = getmetatable( ud )
+  m.__gc = function()
+    store:close()
+  end
+  return store, ud
+end
+
+
 -- load/initialize dependencies table
 dependencies, depproxy = load_deps()
 -- figure out which syscall tracing method to use
 do
   local platform = ape.platform()
   local preload_env = os.getenv( "BUILDSH_PRELOAD" )
+  -- fanotify misses too much to be used unless asked for (see
+  -- fanotify.lua)
+  local fanotify_env = os.getenv( "BUILDSH_FANOTIFY" )
 
   if (platform == "UNIX" or platform == "MACOSX") and preload_env and
      make.have_file( preload_env ) then
     exec_handler = require( "preload" )
+  elseif platform == "UNIX" and fanotify_env and fanotify_env ~= "0" and
+         ape.fanotify_open and require( "fanotify" ).available then
+    exec_handler = require( "fanotify" )
   elseif platform == "UNIX" and make.have_exec( "strace" ) then
     exec_handler = require( "strace" )
   elseif (platform == "UNIX" or platform == "MACOSX") and
@@ -603,75 +996,82 @@ end
 
 -- start main program
 local make_files, make_targets = handle_args( arg )
-local retval = true
-for _,fname in ipairs( make_files ) do
-  err:write( "== checking `", fname, "' ...\n" )
-  local f, msg = loadfile( fname )
-  if not f then
-    retval = false
-    write_err( nil, nil, msg )
-  else
-    local gg, sg, special_gg = check_bytecode( f, {}, {}, {} )
-    local sg_name, sg_line = next( sg )
-    if sg_name then
+local function main()
+  local retval = true
+  for _,fname in ipairs( make_files ) do
+    err:write( "== checking `", fname, "' ...\n" )
+    local f, msg = loadfile( fname )
+    if not f then
       retval = false
-      write_err( fname, sg_line, "no globals assignment allowed (`",
-                 sg_name, "')" )
+      write_err( nil, nil, msg )
     else
-      local ok, cont, env = make_env_with_executables( fname, gg, special_gg )
-      if not ok then
-        if not cont then
-          return false
-        end
+      local gg, sg, special_gg = check_bytecode( f, {}, {}, {} )
+      local sg_name, sg_line = next( sg )
+      if sg_name then
         retval = false
+        write_err( fname, sg_line, "no globals assignment allowed (`",
+                   sg_name, "')" )
       else
-        setfenv( f, env )
-        local ok, cont, res = call_buildsh_function( fname, f )
+        local ok, cont, env = make_env_with_executables( fname, gg, special_gg )
         if not ok then
           if not cont then
             return false
           end
           retval = false
-        elseif type( res ) ~= "table" or
-             next( res ) == nil then
-          write_err( fname, nil, "no targets defined" )
-          return false
-        else -- got target definition table
-          retval = true
-          err:write( "== `", fname, "' it is ...\n" )
-          if exec_handler then
-            err:write( "== using ", exec_handler.name,
-                       " to detect dependencies.\n" )
-          end
-          for i = 1, #make_targets do
-            local target = make_targets[ i ]
-            local tfunc = res[ target ]
-            if type( tfunc ) ~= "function" and
-               (target == "list" or target == "clean") then
-              if target == "list" then
-                list_targets( res )
+        else
+          setfenv( f, env )
+          local ok, cont, res = call_buildsh_function( fname, f )
+          if not ok then
+            if not cont then
+              return false
+            end
+            retval = false
+          elseif type( res ) ~= "table" or
+               next( res ) == nil then
+            write_err( fname, nil, "no targets defined" )
+            return false
+          else -- got target definition table
+            retval = true
+            err:write( "== `", fname, "' it is ...\n" )
+            if exec_handler then
+              err:write( "== using ", exec_handler.name,
+                         " to detect dependencies.\n" )
+            end
+            for i = 1, #make_targets do
+              local target = make_targets[ i ]
+              local tfunc = res[ target ]
+              if type( tfunc ) ~= "function" and
+                 (target == "list" or target == "clean") then
+                if target == "list" then
+                  list_targets( res )
+                else
+                  make.autoclean()
+                end
               else
-                make.autoclean()
-              end
-            else
-              err:write( "== executing target `", target, "' ...\n" )
-              if type( tfunc ) ~= "function" then
-                write_err( fname, nil, "no target `", target, "' defined" )
-                return false
-              elseif not call_buildsh_function( fname, tfunc, true ) then
-                return false
+                err:write( "== executing target `", target, "' ...\n" )
+                if type( tfunc ) ~= "function" then
+                  write_err( fname, nil, "no target `", target, "' defined" )
+                  return false
+                elseif not call_buildsh_function( fname, tfunc, true ) then
+                  return false
+                end
               end
             end
+            if retval then
+              err:write( "== done.\n" )
+            end
+            return retval
           end
-          if retval then
-            err:write( "== done.\n" )
-          end
-          return retval
         end
       end
     end
   end
+  return retval
 end
 
+
+local retval = main()
+cgroup.cleanup()
+jobs.gc_report( err )
 return retval
 
@@ -34,6 +34,12 @@
 #include "lauxlib.h"
 #include "lualib.h"
 #include "moon.h"
+#include "balloc.h"
+
+#if defined(LUA_USE_POSIX)
+#include <sys/time.h>
+#define LUA_PROFILER
+#endif
 
 
 
@@ -57,6 +63,137 @@ static void laction (int i) {
 }
 
 
+/*
+** Sampling profiler (`--profile file`): SIGPROF only counts the cpu
+** time ticks, and a count hook (inherited by all coroutines) records
+** the stack of the running Lua thread whenever ticks are pending. The
+** stacks are written in the folded format of flamegraph.pl at exit.
+*/
+#define PROF_INTERVAL  1000  /* usecs of cpu time per tick */
+#define PROF_COUNT     1000  /* instructions between checks */
+
+static const char *profname = NULL;
+
+#if defined(LUA_PROFILER)
+static FILE *proffile = NULL;
+static char prof_key;  /* registry key of the sample table */
+static volatile sig_atomic_t prof_ticks = 0;
+
+
+static void lprofile (int i) {
+  (void)i;
+  prof_ticks++;
+}
+
+
+static void addstack (lua_State *L, lua_State *co, luaL_Buffer *b) {
+  lua_Debug ar;
+  int depth = 0;
+  while (lua_getstack(co, depth, &ar)) depth++;
+  while (depth-- > 0) {
+    lua_getstack(co, depth, &ar);
+    lua_getinfo(co, "Sn", &ar);
+    if (*ar.what == 'C')
+      lua_pushfstring(L, "%s [C]", ar.name ? ar.name : "?");
+    else if (*ar.what == 'm')
+      lua_pushfstring(L, "main chunk (%s)", ar.short_src);
+    else if (*ar.what == 't')
+      lua_pushliteral(L, "(tail call)");
+    else
+      lua_pushfstring(L, "%s (%s:%d)", ar.name ? ar.name : "?",
+                      ar.short_src, ar.linedefined);
+    luaL_addvalue(b);
+    if (depth > 0) luaL_addchar(b, ';');
+  }
+}
+
+
+static void lsample (lua_State *L, lua_Debug *ar) {
+  int n = prof_ticks;
+  luaL_Buffer b;
+  (void)ar;
+  if (n == 0) return;
+  prof_ticks = 0;
+  luaL_buffinit(L, &b);
+  if (L != globalL) {
+    /* a coroutine: its resumer is (usually) suspended in the main
+     * thread, frames of intermediate coroutines are missing */
+    addstack(L, globalL, &b);
+    luaL_addchar(&b, ';');
+  }
+  addstack(L, L, &b);
+  luaL_pushresult(&b);
+  lua_pushlightuserdata(L, &prof_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);
+  n += (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  lua_insert(L, -2);
+  lua_pushinteger(L, n);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+#endif
+
+
+static int profile_start (lua_State *L) {
+#if defined(LUA_PROFILER)
+  struct sigaction sa;
+  struct itimerval it;
+  proffile = fopen(profname, "w");
+  if (proffile == NULL) return 0;
+  lua_pushlightuserdata(L, &prof_key);
+  lua_newtable(L);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_sethook(L, lsample, LUA_MASKCOUNT, PROF_COUNT);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lprofile;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  it.it_interval.tv_sec = 0;
+  it.it_interval.tv_usec = PROF_INTERVAL;
+  it.it_value = it.it_interval;
+  setitimer(ITIMER_PROF, &it, NULL);
+  return 1;
+#else
+  (void)L;
+  return 0;
+#endif
+}
+
+
+static void profile_stop (lua_State *L) {
+#if defined(LUA_PROFILER)
+  struct itimerval it;
+  if (proffile == NULL) return;
+  memset(&it, 0, sizeof(it));
+  setitimer(ITIMER_PROF, &it, NULL);
+  signal(SIGPROF, SIG_DFL);
+  lua_pushlightuserdata(L, &prof_key);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  if (lua_istable(L, -1)) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      fprintf(proffile, "%s %d\n", lua_tostring(L, -2),
+              (int)lua_tointeger(L, -1));
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  if (ferror(proffile) | fclose(proffile)) {
+    fprintf(stderr, "%s: cannot write profile to `%s'\n", progname,
+            profname);
+    fflush(stderr);
+  }
+  proffile = NULL;
+#else
+  (void)L;
+#endif
+}
+
+
 static void l_message (const char *pname, const char *msg) {
   if (pname) fprintf(stderr, "%s: ", pname);
   fprintf(stderr, "%s\n", msg);
@@ -185,6 +322,7 @@ LUALIB_API int luaopen_ape(lua_State* L);
 static luaL_Reg preload_libs[] = {
   {"bci", luaopen_bci},
   {"ape", luaopen_ape},
+  {"balloc", luaopen_balloc},
   {NULL, NULL}
 };
 
@@ -212,6 +350,22 @@ static char const tracker_lua_h[] =
 #include "tracker.lua.h"
 ;
 
+static char const fanotify_lua_h[] =
+#include "fanotify.lua.h"
+;
+
+static char const jobs_lua_h[] =
+#include "jobs.lua.h"
+;
+
+static char const depstore_lua_h[] =
+#include "depstore.lua.h"
+;
+
+static char const cgroup_lua_h[] =
+#include "cgroup.lua.h"
+;
+
 static moon_lua_reg const preload_mods[] = {
   { "make", "@make.lua", make_lua_h, sizeof( make_lua_h ) },
   { "base", "@base.lua", base_lua_h, sizeof( base_lua_h ) },
@@ -219,6 +373,10 @@ static moon_lua_reg const preload_mods[] = {
   { "ktrace", "@ktrace.lua", ktrace_lua_h, sizeof( ktrace_lua_h ) },
   { "preload", "@preload.lua", preload_lua_h, sizeof( preload_lua_h ) },
   { "tracker", "@tracker.lua", tracker_lua_h, sizeof( tracker_lua_h ) },
+  { "fanotify", "@fanotify.lua", fanotify_lua_h, sizeof( fanotify_lua_h ) },
+  { "jobs", "@jobs.lua", jobs_lua_h, sizeof( jobs_lua_h ) },
+  { "depstore", "@depstore.lua", depstore_lua_h, sizeof( depstore_lua_h ) },
+  { "cgroup", "@cgroup.lua", cgroup_lua_h, sizeof( cgroup_lua_h ) },
   { NULL, NULL, NULL, 0 }
 };
 
@@ -228,11 +386,30 @@ static int pmain (lua_State *L) {
   char **argv = s->argv;
   globalL = L;
   if (argv[0] && argv[0][0]) progname = argv[0];
+  if (argv[0] && argv[1] && strcmp(argv[1], "--profile") == 0) {
+    if (argv[2] == NULL) {
+      l_message(progname, "`--profile' needs a file name");
+      s->status = 1;
+      return 0;
+    }
+    profname = argv[2];
+    argv[2] = argv[0];  /* remove the option from `arg' */
+    argv += 2;
+  }
   lua_gc(L, LUA_GCSTOP, 0);  /* stop collector during initialization */
   luaL_openlibs(L);  /* open libraries */
   moon_preload_c(L, preload_libs);
   moon_preload_lua(L, preload_mods);
   lua_gc(L, LUA_GCRESTART, 0);
+  if (profname != NULL && !profile_start(L)) {
+#if defined(LUA_PROFILER)
+    l_message(progname, lua_pushfstring(L, "cannot open `%s'", profname));
+#else
+    l_message(progname, "profiling is not supported on this platform");
+#endif
+    s->status = 1;
+    return 0;
+  }
   s->status = handle_luainit(L);
   if (s->status != 0) return 0;
   s->status = handle_script(L, argv, 0 );
@@ -240,10 +417,55 @@ static int pmain (lua_State *L) {
 }
 
 
+static int panic (lua_State *L) {
+  (void)L;  /* to avoid warnings */
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+                   lua_tostring(L, -1));
+  return 0;
+}
+
+
+/* uses the slab allocator unless BUILDSH_ALLOC=malloc is set */
+static lua_State *newstate (balloc **a) {
+  lua_State *L = NULL;
+  const char *alloc = getenv("BUILDSH_ALLOC");
+  *a = NULL;
+  if (alloc != NULL && strcmp(alloc, "malloc") == 0)
+    return luaL_newstate();
+  *a = balloc_new();
+  if (*a == NULL) return NULL;
+  L = lua_newstate(balloc_alloc, *a);
+  if (L == NULL) {
+    balloc_delete(*a);
+    *a = NULL;
+    return NULL;
+  }
+  lua_atpanic(L, &panic);
+  return L;
+}
+
+
+static void print_allocstats (balloc *a) {
+  balloc_stats st;
+  if (a == NULL || getenv("BUILDSH_ALLOCSTATS") == NULL) return;
+  balloc_getstats(a, &st);
+  fprintf(stderr, "%s: allocator: %lu allocs, %lu frees, %lu reallocs, "
+                  "%lu large\n", progname, st.allocs, st.frees,
+                  st.reallocs, st.large_allocs);
+  fprintf(stderr, "%s: allocator: %lu bytes in use (%lu small), "
+                  "%lu peak, %lu slabs (%lu released)\n",
+                  progname, (unsigned long)(st.small_bytes+st.large_bytes),
+                  (unsigned long)st.small_bytes,
+                  (unsigned long)st.peak_bytes, (unsigned long)st.slabs,
+                  (unsigned long)st.slabs_freed);
+}
+
+
 int main (int argc, char **argv) {
   int status;
   struct Smain s;
-  lua_State *L = lua_open();  /* create state */
+  balloc *a = NULL;
+  lua_State *L = newstate(&a);  /* create state */
   if (L == NULL) {
     l_message(argv[0], "cannot create state: not enough memory");
     return EXIT_FAILURE;
@@ -252,7 +474,10 @@ int main (int argc, char **argv) {
   s.argv = argv;
   status = lua_cpcall(L, &pmain, &s);
   report(L, status);
+  profile_stop(L);
+  print_allocstats(a);
   lua_close(L);
+  balloc_delete(a);
   return (status || s.status) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
@@ -0,0 +1,181 @@
+--  buildsh -- a portable and flexible build system
+--  Copyright (C) 2013  Philipp Janda
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+local ape = require( "ape" ) -- (subset of) apache portable runtime
+-- the module table
+local _M = {}
+
+--[[
+Every command started by `make.run` can get its own cgroup (v2) for
+measuring its resource usage (including all of its child processes)
+and for enforcing limits. This only works if buildsh may create
+cgroups below its own one (a delegated subtree, e.g. as root in a
+container, or in a systemd unit with `Delegate=yes`). Because of the
+"no internal processes" rule of cgroup v2, buildsh moves itself into
+a leaf cgroup first:
+
+    <own cgroup>/buildsh-<pid>/main     buildsh itself
+    <own cgroup>/buildsh-<pid>/cmd-<n>  one per running command
+
+Controllers that can't be enabled are simply missing (`cpu.stat`
+exists in every cgroup). Setting `BUILDSH_CGROUPS=0` disables cgroups.
+--]]
+
+local CGROUP_FS = "/sys/fs/cgroup"
+
+-- nil: not initialized yet, false: not available
+local base_dir, own_dir
+local counter = 0
+-- cgroups that couldn't be removed yet (because of lingering
+-- processes)
+local leftover = {}
+
+
+local function read_file( path )
+  local f = io.open( path, "r" )
+  if f then
+    local s = f:read( "*a" )
+    f:close()
+    return s
+  end
+end
+
+local function write_file( path, s )
+  local f = io.open( path, "w" )
+  if f then
+    local ok = f:write( s )
+    -- the kernel reports errors when the buffer is flushed
+    ok = f:close() and ok
+    return ok and true or false
+  end
+  return false
+end
+
+
+local function init()
+  base_dir = false
+  if ape.platform() ~= "UNIX" or os.getenv( "BUILDSH_CGROUPS" ) == "0" then
+    return
+  end
+  local cg = (read_file( "/proc/self/cgroup" ) or ""):match( "0::([^\n]*)" )
+  local pid = (read_file( "/proc/self/stat" ) or ""):match( "^(%d+)" )
+  if not cg or not pid then
+    return
+  end
+  if cg == "/" then cg = "" end
+  own_dir = CGROUP_FS .. cg
+  local dir = own_dir .. "/buildsh-" .. pid
+  if not read_file( own_dir .. "/cgroup.controllers" ) or
+     not ape.dir_make( dir, ape.FPROT_OS_DEFAULT ) then
+    return
+  end
+  if not ape.dir_make( dir .. "/main", ape.FPROT_OS_DEFAULT ) or
+     not write_file( dir .. "/main/cgroup.procs", pid ) then
+    ape.dir_remove( dir .. "/main" )
+    ape.dir_remove( dir )
+    return
+  end
+  for _,c in ipairs{ "cpu", "memory", "io" } do
+    write_file( dir .. "/cgroup.subtree_control", "+" .. c )
+  end
+  base_dir = dir
+end
+
+
+-- returns whether commands get their own cgroups
+function _M.available()
+  if base_dir == nil then
+    init()
+  end
+  return base_dir ~= false
+end
+
+
+-- creates a cgroup for a command and applies the limits (in the
+-- syntax of the `memory.max` and `cpu.max` files, numbers are bytes
+-- and cpus respectively). Returns the path of the cgroup or nil.
+function _M.create( memory_max, cpu_max )
+  if not _M.available() then
+    return nil
+  end
+  counter = counter + 1
+  local dir = base_dir .. "/cmd-" .. counter
+  if not ape.dir_make( dir, ape.FPROT_OS_DEFAULT ) then
+    return nil
+  end
+  if type( memory_max ) == "number" then
+    memory_max = ("%d"):format( memory_max )
+  end
+  if type( cpu_max ) == "number" then
+    cpu_max = ("%d 100000"):format( cpu_max * 100000 )
+  end
+  if (memory_max and
+      not write_file( dir .. "/memory.max", memory_max )) or
+     (cpu_max and not write_file( dir .. "/cpu.max", cpu_max )) then
+    ape.dir_remove( dir )
+    return nil, "cannot set cgroup limits (controller not enabled?)"
+  end
+  return dir
+end
+
+
+-- removes a cgroup and returns the resource usage of the command:
+-- cpu time (in seconds), peak memory and I/O (in bytes), or nil for
+-- the values that are not available
+function _M.collect( dir )
+  local cpu, mem, iobytes
+  local s = read_file( dir .. "/cpu.stat" )
+  local usec = s and tonumber( s:match( "usage_usec%s+(%d+)" ) )
+  if usec then
+    cpu = usec / 1e6
+  end
+  mem = tonumber( read_file( dir .. "/memory.peak" ) or "" )
+  s = read_file( dir .. "/io.stat" )
+  if s then
+    iobytes = 0
+    for _,n in s:gmatch( "([rw])bytes=(%d+)" ) do
+      iobytes = iobytes + tonumber( n )
+    end
+  end
+  if not ape.dir_remove( dir ) then
+    leftover[ #leftover+1 ] = dir
+  end
+  return cpu, mem, iobytes
+end
+
+
+-- moves buildsh back to its original cgroup and removes the cgroups
+-- created by this module
+function _M.cleanup()
+  if base_dir then
+    local pid = (read_file( "/proc/self/stat" ) or ""):match( "^(%d+)" )
+    if pid then
+      write_file( own_dir .. "/cgroup.procs", pid )
+    end
+    for i = 1, #leftover do
+      ape.dir_remove( leftover[ i ] )
+    end
+    leftover = {}
+    ape.dir_remove( base_dir .. "/main" )
+    ape.dir_remove( base_dir )
+    base_dir = false
+  end
+end
+
+
+-- return module table
+return _M
+
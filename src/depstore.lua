@@ -0,0 +1,694 @@
+--  buildsh -- a portable and flexible build system
+--  Copyright (C) 2013  Philipp Janda
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+local ape = require( "ape" ) -- (subset of) apache portable runtime
+-- the module table
+local _M = {}
+
+--[[
+The dependency records are stored in three files:
+
+*   a data file starting with a dictionary of all file paths,
+    followed by one Lua chunk per command (`return { ... }`). The
+    input and output sets in the chunks are arrays of path ids and
+    hashes sorted by id. The dictionary is front-coded (each path is
+    stored as the length of the prefix shared with the previous path
+    plus the remaining suffix) in blocks of `DICT_BLOCK` paths that
+    start with a complete path, and ids never change, so records can
+    be copied without translation.
+*   an index file with a header line naming the current data file and
+    the size of the dictionary, a line with the offsets of the
+    dictionary blocks, followed by lines of the form
+    "key\toffset\tlength\n" sorted by key
+*   a journal of records changed since the last compaction (including
+    the paths new to the dictionary). Every update is appended (and
+    flushed) right away, so an interrupted build keeps its progress.
+
+Many commands share the same input set (e.g. all object files of a
+project include the same system headers), so input sets are stored
+only once as separate records keyed by `SET_PREFIX` plus the SHA-256
+of their serialized content. A command record refers to its input set
+by that digest, and `get` reports the digest as `inputset`, so that
+the caller can check every distinct set only once per run. Sets that
+are no longer referenced are dropped during compaction. The full
+command line of a command is stored once in a separate record keyed
+by `CMD_PREFIX` plus the command key, so that the data file still
+shows which command a record belongs to. buildsh itself never reads
+it.
+
+The index is kept in memory as a single string and searched in
+place, and a record is only read and parsed when it is requested, so
+the cost of a run depends on the commands actually executed. The same
+goes for the dictionary: a block is decoded when one of its paths is
+needed. Only looking up the id of a path that hasn't been seen yet
+(when a record is written) decodes the remaining blocks. The
+journal is replayed into memory (as unparsed chunks) when the store is
+opened. Once it grows too large compared to the data file, compaction
+writes a new data file (unchanged records are copied verbatim),
+replaces the index atomically, and removes the journal.
+--]]
+
+-- compaction happens if the journal is larger than this many bytes
+-- and larger than the given fraction of the data file
+local JOURNAL_MIN = 65536
+local JOURNAL_RATIO = 8
+
+-- prefix of the keys of shared input sets (command keys never start
+-- with a control character)
+local SET_PREFIX = "\1"
+-- prefix of the keys of command lines
+local CMD_PREFIX = "\2"
+
+-- version of the index format (version 2 and 3 stores are readable,
+-- version 2 stores don't have command line records, and the
+-- dictionary of both is decoded at once)
+_M.VERSION = 4
+
+-- number of paths per dictionary block, and the width of a block
+-- offset in the block directory
+local DICT_BLOCK = 64
+local DIR_WIDTH = 10
+
+local hasher = ape.sha256_new( ape.pool_create() )
+
+local store_meta = {}
+store_meta.__index = store_meta
+
+
+-- front-coded dictionary: "prefixlen suffixlen\n" suffix. Returns the
+-- dictionary and the block directory (fixed width decimal offsets).
+local function encode_paths( paths, count )
+  local buffer, offsets, prev, off = {}, {}, "", 0
+  for i = 1, count do
+    local p = paths[ i ]
+    if (i-1) % DICT_BLOCK == 0 then
+      offsets[ #offsets+1 ] = ("%0" .. DIR_WIDTH .. "d"):format( off )
+      prev = ""
+    end
+    local n, max = 0, math.min( #p, #prev )
+    while n < max and p:byte( n+1 ) == prev:byte( n+1 ) do
+      n = n + 1
+    end
+    local suffix = p:sub( n+1 )
+    buffer[ i ] = n .. " " .. #suffix .. "\n" .. suffix
+    off = off + #buffer[ i ]
+    prev = p
+  end
+  return table.concat( buffer ), table.concat( offsets )
+end
+
+
+-- decodes `count` paths starting at position `pos` of the dictionary
+-- string and assigns them ids following `id`
+local function decode_paths( self, s, pos, id, count )
+  local prev = ""
+  while count > 0 do
+    local n, len, p = s:match( "^(%d+) (%d+)\n()", pos )
+    if not n then
+      break
+    end
+    len = tonumber( len )
+    local path = prev:sub( 1, tonumber( n ) ) .. s:sub( p, p+len-1 )
+    id = id + 1
+    self.paths[ id ] = path
+    self.pathids[ path ] = id
+    prev, pos, count = path, p + len, count - 1
+  end
+end
+
+
+local function decode_block( self, b )
+  if not self.decoded[ b ] then
+    self.decoded[ b ] = true
+    local off = tonumber( self.dictdir:sub( (b-1)*DIR_WIDTH+1, b*DIR_WIDTH ) )
+    if off then
+      local first = (b-1) * DICT_BLOCK
+      decode_paths( self, self.dict, off+1, first,
+                    math.min( DICT_BLOCK, self.dictsize - first ) )
+    end
+  end
+end
+
+
+-- returns the path for an id (or nil)
+local function get_path( self, id )
+  local path = self.paths[ id ]
+  if not path and type( id ) == "number" and id >= 1 and
+     id <= self.dictsize then
+    decode_block( self, math.floor( (id-1) / DICT_BLOCK ) + 1 )
+    path = self.paths[ id ]
+  end
+  return path
+end
+
+
+-- decodes the blocks that haven't been needed so far
+local function decode_all( self )
+  if not self.complete then
+    self.complete = true
+    for b = 1, math.ceil( self.dictsize / DICT_BLOCK ) do
+      decode_block( self, b )
+    end
+  end
+end
+
+
+local function reset_paths( self )
+  self.paths, self.pathids, self.newpaths = {}, {}, {}
+  self.npaths, self.dictsize, self.dict, self.dictdir = 0, 0, "", ""
+  self.decoded, self.complete = {}, true
+end
+
+
+-- binary search for a key in the sorted index string
+local function lookup( index, key )
+  local lo, hi = 1, #index+1 -- lo and hi are always at line starts
+  while lo < hi do
+    local mid = math.floor( (lo+hi) / 2 )
+    local ls = lo
+    if mid > lo then
+      local nl = index:find( "\n", mid-1, true )
+      if nl and nl+1 < hi then
+        ls = nl + 1
+      end
+    end
+    local tab = index:find( "\t", ls, true )
+    local le = index:find( "\n", ls, true )
+    if not tab or not le then
+      return nil
+    end
+    local k = index:sub( ls, tab-1 )
+    if k == key then
+      local off, len = index:match( "^(%d+)\t(%d+)", tab+1 )
+      return tonumber( off ), tonumber( len )
+    elseif key < k then
+      hi = ls
+    else
+      lo = le + 1
+    end
+  end
+  return nil
+end
+
+
+local function load( self )
+  self.index, self.gen, self.datname = "", 0, nil
+  reset_paths( self )
+  self.version = nil -- no index file
+  local f = io.open( self.idxname, "rb" )
+  if f then
+    local header = f:read( "*l" ) or ""
+    local gen, dictlen, dictsize, datname = header:match( "^buildsh%-deps 4 (%d+) (%d+) (%d+) (.+)$" )
+    local version = 4
+    if not gen then
+      version, gen, dictlen, datname = header:match( "^buildsh%-deps ([23]) (%d+) (%d+) (.+)$" )
+    end
+    if gen then
+      self.data = io.open( datname, "rb" )
+      if self.data then
+        local dict = self.data:read( tonumber( dictlen ) ) or ""
+        if dictsize then
+          self.dict, self.dictdir = dict, f:read( "*l" ) or ""
+          self.dictsize, self.npaths = tonumber( dictsize ), tonumber( dictsize )
+          self.complete = self.dictsize == 0
+        else -- no blocks
+          decode_paths( self, dict, 1, 0, math.huge )
+          self.npaths = #self.paths
+        end
+        self.index = f:read( "*a" ) or ""
+        self.gen, self.datname = tonumber( gen ), datname
+        self.version = tonumber( version )
+      end
+    end
+    f:close()
+  end
+end
+
+
+-- reads the journal entries ("+keylen chunklen\n" key chunk,
+-- "-keylen\n" key, or "=len\n" path for new paths) into memory. Returns false if the journal ends
+-- with an incomplete entry.
+local function replay( self )
+  self.jsize = 0
+  local f = io.open( self.jnlname, "rb" )
+  if not f then
+    return true
+  end
+  local s = f:read( "*a" ) or ""
+  f:close()
+  local pos = 1
+  while pos <= #s do
+    local op, kl, cl, p = s:match( "^([+=-])(%d+) ?(%d*)\n()", pos )
+    if not op then
+      return false
+    end
+    kl, cl = tonumber( kl ), tonumber( cl ) or 0
+    if p+kl+cl-1 > #s then
+      return false
+    end
+    local key = s:sub( p, p+kl-1 )
+    if op == "+" then
+      self.changed[ key ] = s:sub( p+kl, p+kl+cl-1 )
+    elseif op == "=" then
+      self.npaths = self.npaths + 1
+      self.paths[ self.npaths ] = key
+      self.pathids[ key ] = self.npaths
+    else
+      self.changed[ key ] = false
+    end
+    pos = p + kl + cl
+    self.jsize = pos - 1
+  end
+  return true
+end
+
+
+local function journal( self, entry )
+  if not self.journal then
+    self.journal = io.open( self.jnlname, "ab" )
+  end
+  if self.journal then
+    -- paths must be defined before the records using them
+    local defs = {}
+    for i = 1, #self.newpaths do
+      local p = self.newpaths[ i ]
+      defs[ i ] = "=" .. #p .. "\n" .. p
+    end
+    self.newpaths = {}
+    entry = table.concat( defs ) .. entry
+    self.journal:write( entry )
+    self.journal:flush()
+    self.jsize = self.jsize + #entry
+  end
+end
+
+
+-- returns the id of a path, new paths are added to the dictionary
+-- (and the journal)
+local function intern( self, path )
+  local id = self.pathids[ path ]
+  if not id and not self.complete then
+    decode_all( self )
+    id = self.pathids[ path ]
+  end
+  if not id then
+    self.npaths = self.npaths + 1
+    id = self.npaths
+    self.paths[ id ] = path
+    self.pathids[ path ] = id
+    self.newpaths[ #self.newpaths+1 ] = path
+  end
+  return id
+end
+
+
+-- serializes a path set as a Lua array of path ids and hashes
+local function serialize_set( self, t )
+  local names, ids, hashes = {}, {}, {}
+  for fn,h in pairs( t ) do
+    if type( fn ) == "string" and type( h ) == "string" then
+      names[ #names+1 ] = fn
+    end
+  end
+  -- new paths get their ids in sorted order, so that neighbours in
+  -- the (front coded) dictionary share long prefixes
+  table.sort( names )
+  for i = 1, #names do
+    local id = intern( self, names[ i ] )
+    ids[ i ] = id
+    hashes[ id ] = t[ names[ i ] ]
+  end
+  table.sort( ids )
+  local buffer = { "{\n" }
+  for i = 1, #ids do
+    buffer[ #buffer+1 ] = ("    %d, %q,\n"):format( ids[ i ], hashes[ ids[ i ] ] )
+  end
+  buffer[ #buffer+1 ] = "  }"
+  return table.concat( buffer )
+end
+
+
+local function has_key( self, key )
+  local r = self.changed[ key ]
+  if r ~= nil then
+    return r ~= false
+  end
+  return lookup( self.index, key ) ~= nil
+end
+
+
+-- stores an input set (unless it already exists) and returns its
+-- digest
+local function store_set( self, set )
+  local digest = hasher:reset():update( set ):digest()
+  local key = SET_PREFIX .. digest
+  if not has_key( self, key ) then
+    local chunk = "return " .. set .. "\n"
+    self.changed[ key ] = chunk
+    journal( self, "+" .. #key .. " " .. #chunk .. "\n" .. key .. chunk )
+  end
+  return digest
+end
+
+
+local function serialize( self, v )
+  local buffer = { "return {\n" }
+  if type( v.input ) == "table" then
+    local digest = store_set( self, serialize_set( self, v.input ) )
+    buffer[ #buffer+1 ] = ("  input = %q,\n"):format( digest )
+  end
+  if type( v.output ) == "table" then
+    buffer[ #buffer+1 ] = "  output = " .. serialize_set( self, v.output ) .. ",\n"
+  end
+  if type( v.rss ) == "number" then
+    buffer[ #buffer+1 ] = ("  rss = %d,\n"):format( v.rss )
+  end
+  -- resource usage measured via cgroups
+  if type( v.cpu ) == "number" then
+    buffer[ #buffer+1 ] = ("  cpu = %.6f,\n"):format( v.cpu )
+  end
+  if type( v.mem ) == "number" then
+    buffer[ #buffer+1 ] = ("  mem = %d,\n"):format( v.mem )
+  end
+  if type( v.io ) == "number" then
+    buffer[ #buffer+1 ] = ("  io = %d,\n"):format( v.io )
+  end
+  buffer[ #buffer+1 ] = "}\n"
+  return table.concat( buffer )
+end
+
+
+-- turns an array of path ids and hashes into a table mapping paths to
+-- hashes
+local function expand( self, a )
+  local t = {}
+  if type( a ) == "table" then
+    for i = 1, #a-1, 2 do
+      local fn = get_path( self, a[ i ] )
+      if fn then
+        t[ fn ] = a[ i+1 ]
+      end
+    end
+  end
+  return t
+end
+
+
+local function run_chunk( s )
+  local f = s and loadstring( s, "=deps" )
+  if f then
+    setfenv( f, {} )
+    local ok, t = pcall( f )
+    if ok and type( t ) == "table" then
+      return t
+    end
+  end
+  return nil
+end
+
+
+local function read_chunk( self, key )
+  local r = self.changed[ key ]
+  if r ~= nil then
+    return r or nil
+  end
+  local off, len = lookup( self.index, key )
+  if off and self.data and self.data:seek( "set", off ) then
+    return self.data:read( len )
+  end
+  return nil
+end
+
+
+-- returns the (cached) expanded input set for a digest, or nil if the
+-- set is missing
+local function get_set( self, digest )
+  local set = self.sets[ digest ]
+  if set == nil then
+    local a = run_chunk( read_chunk( self, SET_PREFIX .. digest ) )
+    set = a and expand( self, a ) or false
+    self.sets[ digest ] = set
+  end
+  return set or nil
+end
+
+
+local function parse( self, s )
+  local t = run_chunk( s )
+  if t then
+    if type( t.input ) == "string" then
+      local set = get_set( self, t.input )
+      t.inputset = set and t.input or nil
+      t.input = nil
+      if set then
+        t.input = {}
+        for fn,h in pairs( set ) do
+          t.input[ fn ] = h
+        end
+      end
+    else
+      t.input = expand( self, t.input )
+    end
+    t.output = expand( self, t.output )
+  end
+  return t
+end
+
+
+local function need_compaction( self )
+  local dsize = self.data and self.data:seek( "end" ) or 0
+  return self.jsize > JOURNAL_MIN and self.jsize * JOURNAL_RATIO > dsize
+end
+
+
+function _M.open( prefix )
+  local self = setmetatable( {
+    prefix = prefix,
+    idxname = prefix .. ".idx",
+    jnlname = prefix .. ".jnl",
+    changed = {}, -- key -> serialized record, or false if deleted
+    sets = {}, -- digest -> expanded input set (or false if missing)
+    jsize = 0,
+  }, store_meta )
+  load( self )
+  if not replay( self ) or need_compaction( self ) then
+    self:compact()
+  end
+  return self
+end
+
+
+-- returns a fresh copy of the record for the given key that the caller
+-- may modify
+function store_meta:get( key )
+  local r = read_chunk( self, key )
+  return r and parse( self, r ) or nil
+end
+
+
+-- updates (or deletes) a record and appends the change to the
+-- journal. The command line is only written if the key doesn't have
+-- one yet.
+function store_meta:set( key, record, cmdline )
+  local ckey = CMD_PREFIX .. key
+  if record then
+    local chunk = serialize( self, record )
+    self.changed[ key ] = chunk
+    journal( self, "+" .. #key .. " " .. #chunk .. "\n" .. key .. chunk )
+    if type( cmdline ) == "string" and not has_key( self, ckey ) then
+      -- stored verbatim (not as a Lua chunk)
+      self.changed[ ckey ] = cmdline
+      journal( self, "+" .. #ckey .. " " .. #cmdline .. "\n" .. ckey .. cmdline )
+    end
+  else
+    self.changed[ key ] = false
+    journal( self, "-" .. #key .. "\n" .. key )
+    if has_key( self, ckey ) then
+      self.changed[ ckey ] = false
+      journal( self, "-" .. #ckey .. "\n" .. ckey )
+    end
+  end
+end
+
+
+local function is_set( key )
+  return key:sub( 1, #SET_PREFIX ) == SET_PREFIX
+end
+
+
+-- input sets and command lines are no command records
+local function is_aux( key )
+  local c = key:sub( 1, 1 )
+  return c == SET_PREFIX or c == CMD_PREFIX
+end
+
+
+-- iterates over all keys and records
+function store_meta:each()
+  return coroutine.wrap( function()
+    for key in self.index:gmatch( "([^\t\n]*)\t[^\n]*\n" ) do
+      if self.changed[ key ] == nil and not is_aux( key ) then
+        local r = self:get( key )
+        if r then
+          coroutine.yield( key, r )
+        end
+      end
+    end
+    for key, r in pairs( self.changed ) do
+      r = r and not is_aux( key ) and parse( self, r )
+      if r then
+        coroutine.yield( key, r )
+      end
+    end
+  end )
+end
+
+
+local function replace( tmpname, name )
+  if not os.rename( tmpname, name ) then
+    -- renaming over an existing file fails on some platforms
+    os.remove( name )
+    return os.rename( tmpname, name )
+  end
+  return true
+end
+
+
+-- merges the journal into a new data file and index
+function store_meta:compact()
+  if self.journal then
+    self.journal:close()
+    self.journal = nil
+  end
+  local keys, used = {}, {}
+  local function mark( chunk )
+    local digest = chunk and chunk:match( '^return {\n  input = "(%x+)",\n' )
+    if digest then
+      used[ SET_PREFIX .. digest ] = true
+    end
+  end
+  for k, chunk in pairs( self.changed ) do
+    keys[ #keys+1 ] = k
+    if not is_aux( k ) then
+      mark( chunk )
+    end
+  end
+  table.sort( keys )
+  -- find the input sets still referenced by some command
+  for key, o, l in self.index:gmatch( "([^\t\n]*)\t(%d+)\t(%d+)\n" ) do
+    if self.changed[ key ] == nil and not is_aux( key ) and
+       self.data:seek( "set", tonumber( o ) ) then
+      mark( self.data:read( tonumber( l ) ) )
+    end
+  end
+  local gen = self.gen + 1
+  local datname = self.prefix .. "." .. gen .. ".dat"
+  local tmpname = self.idxname .. ".tmp"
+  local dat = io.open( datname, "wb" )
+  if not dat then
+    return false
+  end
+  local idx = io.open( tmpname, "wb" )
+  if not idx then
+    dat:close()
+    os.remove( datname )
+    return false
+  end
+  -- the dictionary includes the paths added since the last compaction
+  decode_all( self )
+  local dict, dictdir = encode_paths( self.paths, self.npaths )
+  dat:write( dict )
+  idx:write( "buildsh-deps ", _M.VERSION, " ", gen, " ", #dict, " ",
+             self.npaths, " ", datname, "\n", dictdir, "\n" )
+  local off = #dict
+  local function emit( key, chunk )
+    if chunk and (used[ key ] or not is_set( key )) then
+      dat:write( chunk )
+      idx:write( key, "\t", off, "\t", #chunk, "\n" )
+      off = off + #chunk
+    end
+  end
+  -- merge the sorted old index with the sorted changed keys
+  local i = 1
+  for key, o, l in self.index:gmatch( "([^\t\n]*)\t(%d+)\t(%d+)\n" ) do
+    while keys[ i ] and keys[ i ] < key do
+      emit( keys[ i ], self.changed[ keys[ i ] ] )
+      i = i + 1
+    end
+    if keys[ i ] == key then
+      emit( key, self.changed[ key ] )
+      i = i + 1
+    elseif self.data:seek( "set", tonumber( o ) ) then
+      emit( key, self.data:read( tonumber( l ) ) )
+    end
+  end
+  while keys[ i ] do
+    emit( keys[ i ], self.changed[ keys[ i ] ] )
+    i = i + 1
+  end
+  dat:close()
+  idx:close()
+  if not replace( tmpname, self.idxname ) then
+    os.remove( datname )
+    return false
+  end
+  -- a crash before this point only leads to replaying the journal
+  -- again on top of the new data
+  os.remove( self.jnlname )
+  if self.data then
+    self.data:close()
+    self.data = nil
+    os.remove( self.datname )
+  end
+  self.changed, self.jsize = {}, 0
+  load( self )
+  return true
+end
+
+
+-- closes the journal (and compacts the store if necessary)
+function store_meta:close()
+  if need_compaction( self ) then
+    return self:compact()
+  elseif self.journal then
+    self.journal:close()
+    self.journal = nil
+  end
+  return true
+end
+
+
+-- removes all records and the files of the store
+function store_meta:clear()
+  if self.journal then
+    self.journal:close()
+    self.journal = nil
+  end
+  os.remove( self.jnlname )
+  if self.data then
+    self.data:close()
+    self.data = nil
+    os.remove( self.datname )
+  end
+  os.remove( self.idxname )
+  self.index, self.gen, self.datname = "", 0, nil
+  reset_paths( self )
+  self.changed, self.sets, self.jsize = {}, {}, 0
+end
+
+
+-- return module table
+return _M
@@ -0,0 +1,76 @@
+--  buildsh -- a portable and flexible build system
+--  Copyright (C) 2013  Philipp Janda
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+local base = require( "base" )
+local ape = require( "ape" )
+
+-- One listener for the mount of the project directory records the
+-- file accesses of all commands (only works on Linux with the
+-- CAP_SYS_ADMIN capability, e.g. as root in a container). Every
+-- command runs in its own process group (and its own cgroup, if
+-- available), which is used to attribute the events. Failed lookups
+-- (and thus missing files), `stat`/`access` probes, directories, and
+-- renames are not reported by fanotify, and a file that is written
+-- under a temporary name and renamed afterwards is recorded under
+-- whichever name it has when the event is read. Therefore this
+-- handler is only used if `BUILDSH_FANOTIFY` is set.
+local listener = ape.fanotify_open and ape.fanotify_open( "." )
+
+
+local function pre_process( argv )
+  return argv, { lost = listener:lost() }
+end
+
+
+local function post_process( deps, data, dir, pgid, cgroup )
+  local tempdeps = { input = {}, output = {} }
+  local files, lost = listener:take( pgid, cgroup )
+  -- if some events couldn't be attributed while the command was
+  -- running, the dependencies are incomplete: the empty sets make
+  -- sure that the command runs again next time
+  if lost ~= data.lost then
+    io.stderr:write( "== fanotify: ", lost - data.lost, " event(s) ",
+                     "couldn't be attributed, the dependencies of ",
+                     "this command are not recorded\n" )
+  else
+    local paths = {}
+    for p in pairs( files ) do
+      paths[ #paths+1 ] = p
+    end
+    local ps = base.get_paths( dir, paths )
+    for i = 1, #paths do
+      local path = ps[ i ]
+      if path then
+        if files[ paths[ i ] ] == "out" then
+          tempdeps.output[ path ] = true
+          tempdeps.input[ path ] = nil
+        elseif not tempdeps.output[ path ] then
+          tempdeps.input[ path ] = true
+        end
+      end
+    end
+  end
+  base.finish( deps, tempdeps )
+end
+
+return {
+  name = "fanotify",
+  available = listener ~= nil,
+  pgroup = true, -- needed for attributing the events
+  pre_process = pre_process,
+  post_process = post_process,
+}
+
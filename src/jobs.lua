@@ -0,0 +1,315 @@
+--  buildsh -- a portable and flexible build system
+--  Copyright (C) 2013  Philipp Janda
+--
+--  This program is free software: you can redistribute it and/or modify
+--  it under the terms of the GNU General Public License as published by
+--  the Free Software Foundation, either version 3 of the License, or
+--  (at your option) any later version.
+--
+--  This program is distributed in the hope that it will be useful,
+--  but WITHOUT ANY WARRANTY; without even the implied warranty of
+--  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+--  GNU General Public License for more details.
+--
+--  You should have received a copy of the GNU General Public License
+--  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+local ape = require( "ape" ) -- (subset of) apache portable runtime
+-- the module table
+local _M = {}
+
+
+local function env_number( name, default )
+  local v = tonumber( os.getenv( name ) or "" )
+  if v and v > 0 then
+    return v
+  end
+  return default
+end
+
+
+-- admission limits: the number of concurrent commands and the load
+-- average limit default to the number of cpus, a fixed amount of
+-- memory (in MiB) is kept free for the rest of the system
+local ncpu = ape.cpu_count()
+_M.limit = env_number( "BUILDSH_JOBS", ncpu )
+_M.max_load = env_number( "BUILDSH_MAXLOAD", ncpu )
+_M.mem_reserve = env_number( "BUILDSH_MEMRESERVE", 256 ) * 1024 * 1024
+
+
+-- bookkeeping of the commands currently running
+local running, outstanding = 0, 0
+
+
+function _M.running()
+  return running
+end
+
+
+-- checks whether a command with the given peak memory estimate (in
+-- bytes, from an earlier run) may be started right now. A command is
+-- always admitted if none of our commands is running, so a single
+-- command exceeding the budget can never block the build.
+function _M.admit( estimate )
+  if running == 0 then
+    return true
+  elseif running >= _M.limit then
+    return false
+  end
+  local load = ape.loadavg()
+  if load and load >= _M.max_load then
+    return false
+  end
+  local avail = ape.mem_available()
+  if avail then
+    -- the estimates of running commands are counted in full, because
+    -- they may not have reached their peak memory usage yet
+    local need = (tonumber( estimate ) or 0) + outstanding + _M.mem_reserve
+    if avail < need then
+      return false
+    end
+  end
+  return true
+end
+
+
+-- registers a command as running and returns a token for
+-- `_M.release`
+function _M.acquire( estimate )
+  estimate = tonumber( estimate ) or 0
+  running = running + 1
+  outstanding = outstanding + estimate
+  return estimate
+end
+
+
+function _M.release( token )
+  running = running - 1
+  outstanding = outstanding - token
+end
+
+
+-- garbage collection policy: the collector is stopped while the trace
+-- of a command is parsed (which creates lots of garbage in a short
+-- time), and it runs incremental steps while we wait for commands
+-- anyway. After the dependencies of a command have been merged, a full
+-- collection is done if the heap has doubled since the last one.
+local clock = os.clock
+local gc_time = 0 -- cpu time spent in explicit collections
+local gc_stopped = 0 -- nesting level of `_M.gc_stop`
+local gc_base = collectgarbage( "count" ) -- heap size after last full gc
+local gc_floor = gc_base -- heap size after last idle gc cycle
+local GC_STEP = 64 -- size of an incremental step while waiting
+
+
+local function gc_timed( opt, arg )
+  local t = clock()
+  local res = collectgarbage( opt, arg )
+  gc_time = gc_time + (clock() - t)
+  return res
+end
+
+
+function _M.gc_stop()
+  if gc_stopped == 0 then
+    collectgarbage( "stop" )
+  end
+  gc_stopped = gc_stopped + 1
+end
+
+
+function _M.gc_restart()
+  gc_stopped = gc_stopped - 1
+  if gc_stopped == 0 then
+    collectgarbage( "restart" )
+    if collectgarbage( "count" ) >= 2 * gc_base then
+      gc_timed( "collect" )
+      gc_base = collectgarbage( "count" )
+      gc_floor = gc_base
+    end
+  end
+end
+
+
+-- runs incremental gc steps until a job has finished or the gc cycle
+-- is complete. Returns the finished job and its index, if any.
+local function gc_idle( pending )
+  if gc_stopped > 0 or collectgarbage( "count" ) < gc_floor + GC_STEP then
+    return nil
+  end
+  while true do
+    local job, idx = ape.job_wait_any( pending, 0 )
+    if job or idx then
+      return job, idx
+    elseif gc_timed( "step", GC_STEP ) then
+      gc_floor = collectgarbage( "count" )
+      return nil
+    end
+  end
+end
+
+
+-- prints the share of cpu time spent in the collections and steps
+-- started by the policy above if the environment variable
+-- BUILDSH_GCSTATS is set. The work the collector does on its own
+-- (while it isn't stopped) can't be measured in Lua 5.1 and is not
+-- included.
+function _M.gc_report( out )
+  if os.getenv( "BUILDSH_GCSTATS" ) then
+    local total = clock()
+    out:write( ("== gc (explicit collections only): %.2fs of %.2fs cpu time (%.1f%%), %d KiB heap\n")
+               :format( gc_time, total,
+                        total > 0 and 100 * gc_time / total or 0,
+                        collectgarbage( "count" ) ) )
+  end
+end
+
+
+-- the scheduler: commands started via `_M.add` run in the background
+-- while the calling code continues. Code that has to wait for them
+-- (see `_M.wait`) yields if it runs inside a coroutine created by
+-- `_M.run`, and the event loop resumes it once the condition it waits
+-- for holds. If yielding is not possible (e.g. because of a `pcall`
+-- further up the stack), the event loop is run in place instead.
+local pending = {} -- array of running ape jobs
+local handlers = {} -- job -> completion handler
+local writes = {} -- job -> array of paths the command might write
+local busy = {} -- path -> number of running commands writing it
+local barriers = 0 -- number of running commands with unknown outputs
+local managed = setmetatable( {}, { __mode = "k" } )
+local failure -- error message of a failed command
+
+
+-- checks whether the current code runs inside a coroutine of the
+-- scheduler (so that commands need not be waited for immediately)
+function _M.managed()
+  local co = coroutine.running()
+  return co ~= nil and managed[ co ] ~= nil
+end
+
+
+-- we cannot yield across C functions like pcall, metamethods, or
+-- iterators of a generic `for` in Lua 5.1
+local function yieldable()
+  return _M.managed() and coroutine.isyieldable()
+end
+
+
+-- registers a running job. `done` is called with the job when it has
+-- finished, any error raised by it is reported via `_M.check` later.
+-- If `paths` (the files the command might write) is nil, every other
+-- command conflicts with this one until it has finished.
+function _M.add( job, paths, done )
+  pending[ #pending+1 ] = job
+  handlers[ job ] = done
+  writes[ job ] = paths or false
+  if paths then
+    for i = 1, #paths do
+      busy[ paths[ i ] ] = (busy[ paths[ i ] ] or 0) + 1
+    end
+  else
+    barriers = barriers + 1
+  end
+end
+
+
+-- waits for the next job to finish and runs its completion handler;
+-- returns false if no job is running
+function _M.poll()
+  if #pending == 0 then
+    return false
+  end
+  local job, idx = gc_idle( pending )
+  if not job and not idx then
+    job, idx = ape.job_wait_any( pending )
+  end
+  if not job then
+    error( "job_wait_any = " .. tostring( idx ), 2 )
+  end
+  table.remove( pending, idx )
+  local paths, done = writes[ job ], handlers[ job ]
+  writes[ job ], handlers[ job ] = nil, nil
+  if paths then
+    for i = 1, #paths do
+      local n = busy[ paths[ i ] ] - 1
+      busy[ paths[ i ] ] = n > 0 and n or nil
+    end
+  else
+    barriers = barriers - 1
+  end
+  local ok, msg = pcall( done, job )
+  if not ok and not failure then
+    failure = msg
+  end
+  return true
+end
+
+
+function _M.idle()
+  return #pending == 0
+end
+
+
+-- checks whether a running command might write any of the given
+-- paths
+function _M.conflicts( paths )
+  if barriers > 0 then
+    return true
+  end
+  for i = 1, #paths do
+    if busy[ paths[ i ] ] then
+      return true
+    end
+  end
+  return false
+end
+
+
+-- raises the error of a failed command (once)
+function _M.check()
+  if failure then
+    local msg = failure
+    failure = nil
+    error( msg, 0 )
+  end
+end
+
+
+-- blocks until `cond()` returns a true value
+function _M.wait( cond )
+  while not cond() do
+    if yieldable() then
+      coroutine.yield( cond )
+    elseif not _M.poll() then
+      return
+    end
+  end
+end
+
+
+-- runs a function as a coroutine of the scheduler and waits for all
+-- commands it started. Returns the same values as `pcall`.
+function _M.run( f )
+  local co = coroutine.create( f )
+  managed[ co ] = true
+  local ok, res = coroutine.resume( co )
+  while ok and coroutine.status( co ) == "suspended" do
+    if type( res ) == "function" then
+      while not res() and _M.poll() do
+      end
+    end
+    ok, res = coroutine.resume( co )
+  end
+  while _M.poll() do
+  end
+  if ok and failure then
+    ok, res = false, failure
+  end
+  failure = nil
+  return ok, res
+end
+
+
+-- return module table
+return _M
+
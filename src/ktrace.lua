@@ -195,6 +195,12 @@ local syscall_handlers = {
   rfork = handle_fork,
 }
 
+-- called instead of post_process if the command failed
+local function discard( data )
+  os.remove( data )
+end
+
+
 local function post_process( deps, data, dir )
   local tempdeps = { input = {}, output = {} }
   local pdata = {} -- keep track of cwd and open fds per process
@@ -203,7 +209,7 @@ local function post_process( deps, data, dir )
   os.execute( "kdump -s -f \""..data.."\" > \""..kdump.."\"" )
   os.remove( data )
   local stack = {}
-  for line in io.lines( kdump ) do
+  for line in assert( ape.file_lines( kdump ) ) do
     local pid, syscall, args, ret = line:match( syscall_re )
     if pid then
       push_syscall( stack, pid, syscall, args )
@@ -237,5 +243,6 @@ return {
   name = "ktrace/kdump",
   pre_process = pre_process,
   post_process = post_process,
+  discard = discard,
 }
 
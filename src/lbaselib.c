@@ -18,6 +18,7 @@
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "lstate.h"
 
 
 
@@ -595,6 +596,15 @@ static int luaB_yield (lua_State *L) {
 }
 
 
+/* (buildsh) like in Lua 5.3: a coroutine can't yield if a C function,
+** a metamethod, or a `for' iterator is active between the resume
+** and the call of `yield' */
+static int luaB_coisyieldable (lua_State *L) {
+  lua_pushboolean(L, !lua_pushthread(L) && L->nCcalls <= L->baseCcalls);
+  return 1;
+}
+
+
 static int luaB_corunning (lua_State *L) {
   if (lua_pushthread(L))
     lua_pushnil(L);  /* main thread is not a coroutine */
@@ -604,6 +614,7 @@ static int luaB_corunning (lua_State *L) {
 
 static const luaL_Reg co_funcs[] = {
   {"create", luaB_cocreate},
+  {"isyieldable", luaB_coisyieldable},
   {"resume", luaB_coresume},
   {"running", luaB_corunning},
   {"status", luaB_costatus},
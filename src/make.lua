@@ -106,15 +106,20 @@ function _M.assert_file( ... )
 end
 
 
+-- directory listings are shared by all glob calls of a build
+local globcache = ape.glob_cache()
+
 function _M.glob( ... )
-  local t, msg = {}
+  local patterns = { ... }
   for i = 1, select( '#', ... ) do
-    local s = select( i, ... )
-    t, msg = ape.path_glob( t, s )
-    if not t then
-      error( "glob'" .. tostring( s ) .. "' = " .. msg, 2 )
+    if type( patterns[ i ] ) ~= "string" then
+      error( "glob'" .. tostring( patterns[ i ] ) .. "' = string expected", 2 )
     end
   end
+  local t, msg = globcache:glob( patterns )
+  if not t then
+    error( "glob'" .. table.concat( patterns, "', '" ) .. "' = " .. msg, 2 )
+  end
   return t
 end
 
@@ -18,14 +18,23 @@ local base = require( "base" )
 local ape = require( "ape" )
 
 
+-- the settings only go into the environment of the traced command,
+-- buildsh's own environment is inherited by every other command
 local function pre_process( argv )
   local ofile = os.tmpname()
   local p = assert( os.getenv( "BUILDSH_PRELOAD" ) )
-  assert( ape.env_set( "LD_PRELOAD", p ) )
-  assert( ape.env_set( "DYLD_INSERT_LIBRARIES", p ) )
-  assert( ape.env_set( "DYLD_FORCE_FLAT_NAMESPACE", "y" ) )
-  assert( ape.env_set( "BUILDSH_TEMPFILE", ofile ) )
-  return argv, { file=ofile, exec=argv[ 1 ] }
+  local env = ape.env_all()
+  env.LD_PRELOAD = p
+  env.DYLD_INSERT_LIBRARIES = p
+  env.DYLD_FORCE_FLAT_NAMESPACE = "y"
+  env.BUILDSH_TEMPFILE = ofile
+  return argv, { file=ofile, exec=argv[ 1 ] }, env
+end
+
+
+-- called instead of post_process if the command failed
+local function discard( data )
+  os.remove( data.file )
 end
 
 
@@ -43,6 +52,34 @@ local function handle_openat( td, pd, pid, _, args )
   end
 end
 
+local function handle_missing( td, pd, pid, _, args )
+  local name = args:match( '^%s*([\\x%x]*)%s*$' )
+  if name then
+    base.missing( td, pd, pid, (base.hex2name( name )) )
+  end
+end
+
+local function handle_missingat( td, pd, pid, _, args )
+  local atfd, name = args:match( '^%s*([%w_]+)%s+([\\x%x]*)%s*$' )
+  if name then
+    base.missingat( td, pd, pid, atfd, (base.hex2name( name )) )
+  end
+end
+
+local function handle_probe( td, pd, pid, _, args )
+  local name = args:match( '^%s*([\\x%x]*)%s*$' )
+  if name then
+    base.probe( td, pd, pid, (base.hex2name( name )) )
+  end
+end
+
+local function handle_probeat( td, pd, pid, _, args )
+  local atfd, name = args:match( '^%s*([%w_]+)%s+([\\x%x]*)%s*$' )
+  if name then
+    base.probeat( td, pd, pid, atfd, (base.hex2name( name )) )
+  end
+end
+
 local function handle_creat( td, pd, pid, _, args )
   local name, fd = args:match( '^%s*([\\x%x]*)%s+(%d+)%s*$' )
   if name then
@@ -57,6 +94,13 @@ local function handle_exec( td, pd, pid, _, args )
   end
 end
 
+local function handle_execat( td, pd, pid, _, args )
+  local atfd, prog = args:match( '^%s*([%w_]+)%s+([\\x%x]*)%s*$' )
+  if atfd then
+    base.execat( td, pd, pid, atfd, base.hex2name( prog ) )
+  end
+end
+
 local function handle_fchdir( td, pd, pid, _, args )
   local fd = args:match( "^%s*(%d+)%s*$" )
   if fd then
@@ -87,8 +131,11 @@ end
 
 local function handle_fork( td, pd, ppid, _, args )
   local cpid = args:match( '^%s*(%d+)%s*$' )
-  if cpid then
+  -- the child may have been adopted already if its events came first
+  -- (otherwise the pid is new or has been reused)
+  if cpid and not (pd[ cpid ] and pd[ cpid ].ppid == ppid) then
     base.fork( td, pd, ppid, cpid )
+    pd[ cpid ].ppid = ppid
   end
 end
 
@@ -109,13 +156,19 @@ local function handle_renameat( td, pd, pid, _, args )
 end
 
 
-local syscall_re = "^(%d+)%s*([%w_]+)%s+(.*)$"
+-- every event is tagged with "pid/ppid"
+local syscall_re = "^(%d+)/(%d+)%s*([%w_]+)%s+(.*)$"
 
 local syscall_handlers = {
   open = handle_open,
   openat = handle_openat,
+  missing = handle_missing,
+  missingat = handle_missingat,
+  probe = handle_probe,
+  probeat = handle_probeat,
   creat = handle_creat,
   exec = handle_exec,
+  execat = handle_execat,
   chdir = handle_chdir,
   fchdir = handle_fchdir,
   mkdir = handle_mkdir,
@@ -129,14 +182,14 @@ local function post_process( deps, data, dir )
   local tempdeps = { input = {}, output = {} }
   local pdata = {} -- keep track of cwd and open fds per process
   local first_exec = data.exec
-  for line in io.lines( data.file ) do
-    local pid, syscall, args = line:match( syscall_re )
-    if first_exec then -- we didn't get the first execve (and fork)
-      pdata[ pid ] = { cwd = dir }
-      base.exec( tempdeps, pdata, pid, first_exec )
-      first_exec = nil
-    end
+  for line in assert( ape.file_lines( data.file ) ) do
+    local pid, ppid, syscall, args = line:match( syscall_re )
     if syscall then
+      base.adopt( tempdeps, pdata, pid, ppid, dir )
+      if first_exec then -- we didn't get the first execve (and fork)
+        base.exec( tempdeps, pdata, pid, first_exec )
+        first_exec = nil
+      end
       local sh = syscall_handlers[ syscall ]
       if sh then
         sh( tempdeps, pdata, pid, syscall, args )
@@ -145,11 +198,6 @@ local function post_process( deps, data, dir )
   end
   -- remove temp file
   os.remove( data.file )
-  -- remove environment variables
-  ape.env_delete( "LD_PRELOAD" )
-  ape.env_delete( "DYLD_INSERT_LIBRARIES" )
-  ape.env_delete( "DYLD_FORCE_FLAT_NAMESPACE" )
-  ape.env_delete( "BUILDSH_TEMPFILE" )
   -- avoid rehashing of input files
   base.finish( deps, tempdeps )
 end
@@ -158,5 +206,6 @@ return {
   name = "LD_PRELOAD",
   pre_process = pre_process,
   post_process = post_process,
+  discard = discard,
 }
 
@@ -15,11 +15,14 @@
 --  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 local base = require( "base" )
+local ape = require( "ape" )
 
 
 local syscalls = "trace=" .. table.concat( {
   "open", "openat", "creat", "execve", "chdir", "fchdir",
-  "mkdir", "mkdirat", "rename", "renameat", "clone", "vfork", "fork"
+  "mkdir", "mkdirat", "rename", "renameat", "clone", "vfork", "fork",
+  "stat", "lstat", "newfstatat", "statx", "access", "faccessat",
+  "readlink", "readlinkat"
 }, "," )
 
 local function pre_process( argv )
@@ -123,6 +126,46 @@ local function handle_renameat( td, pd, pid, _, args )
 end
 
 
+-- failed lookups of (read-only) files are recorded as well, so that
+-- the command runs again if such a file appears (e.g. a header file
+-- earlier in the include path). Empty names are skipped: they refer to
+-- the file descriptor (`AT_EMPTY_PATH`, e.g. `fstat` in modern glibc),
+-- not to the current directory.
+local function is_write( flags )
+  return flags:find( "O_WRONLY", 1, true ) or
+         flags:find( "O_RDWR", 1, true ) or
+         flags:find( "O_CREAT", 1, true )
+end
+
+local function handle_missing( td, pd, pid, _, args )
+  local name, flags = args:match( '^"([\\x%x]*)",?%s*([%u_|]*)' )
+  if name and name ~= "" and not is_write( flags ) then
+    base.missing( td, pd, pid, (base.hex2name( name )) )
+  end
+end
+
+local function handle_missingat( td, pd, pid, _, args )
+  local atfd, name, flags = args:match( '^([%w_]+),%s*"([\\x%x]*)",?%s*([%u_|]*)' )
+  if name and name ~= "" and not is_write( flags ) then
+    base.missingat( td, pd, pid, atfd, (base.hex2name( name )) )
+  end
+end
+
+local function handle_probe( td, pd, pid, _, args )
+  local name = args:match( '^"([\\x%x]*)"' )
+  if name and name ~= "" then
+    base.probe( td, pd, pid, (base.hex2name( name )) )
+  end
+end
+
+local function handle_probeat( td, pd, pid, _, args )
+  local atfd, name = args:match( '^([%w_]+),%s*"([\\x%x]*)"' )
+  if name and name ~= "" then
+    base.probeat( td, pd, pid, atfd, (base.hex2name( name )) )
+  end
+end
+
+
 local function push_unfinished( t, pid, syscall, args )
   local pt = t[ pid ]
   if not pt then
@@ -145,16 +188,16 @@ local function pop_unfinished( t, pid, syscall, args, ret )
     if st then
       local a = st[ #st ]
       st[ #st ] = nil
-      if a and ret:sub( 1, 1 ) ~= "-" then
+      if a then
         return a .. args
       end
     end
   end
 end
 
-local syscall_re = "^(%d+)%s*([%w_]+)%((.*)%)%s*=%s*(%d+)$"
+local syscall_re = "^(%d+)%s*([%w_]+)%((.*)%)%s*=%s*(%-?%d+)%s*(%u*)"
 local unfinished_re = "^(%d+)%s*([%w_]+)%(%s*(.*)<unfinished%s*%.%.%.>$"
-local resumed_re = "^(%d+)%s*<%.%.%.%s*([%w_]+)%s*resumed>%s*(.*)%)%s*=%s*(%-?%d+)"
+local resumed_re = "^(%d+)%s*<%.%.%.%s*([%w_]+)%s*resumed>%s*(.*)%)%s*=%s*(%-?%d+)%s*(%u*)"
 
 local syscall_handlers = {
   open = handle_open,
@@ -170,15 +213,55 @@ local syscall_handlers = {
   clone = handle_fork,
   vfork = handle_fork,
   fork = handle_fork,
+  stat = handle_probe,
+  lstat = handle_probe,
+  newfstatat = handle_probeat,
+  statx = handle_probeat,
+  access = handle_probe,
+  faccessat = handle_probeat,
+  readlink = handle_probe,
+  readlinkat = handle_probeat,
 }
 
+-- handlers for calls failing with ENOENT or ENOTDIR
+local failure_handlers = {
+  open = handle_missing,
+  openat = handle_missingat,
+  stat = handle_missing,
+  lstat = handle_missing,
+  newfstatat = handle_missingat,
+  access = handle_missing,
+  faccessat = handle_missingat,
+  statx = handle_missingat,
+  readlink = handle_missing,
+  readlinkat = handle_missingat,
+}
+
+-- the log is filtered in C, so that only lines of the syscalls handled
+-- above (the name is the second word after the pid) become Lua strings
+local traced = {}
+for name in pairs( syscall_handlers ) do
+  traced[ #traced+1 ] = name
+end
+for name in pairs( failure_handlers ) do
+  if not syscall_handlers[ name ] then
+    traced[ #traced+1 ] = name
+  end
+end
+
+-- called instead of post_process if the command failed
+local function discard( data )
+  os.remove( data )
+end
+
+
 local function post_process( deps, data, dir )
   local tempdeps = { input = {}, output = {} }
   local pdata = {} -- keep track of cwd and open fds per process
   local unfinished = {}
   local first = true
-  for line in io.lines( data ) do
-    local pid, syscall, args, ret = line:match( syscall_re )
+  for line in assert( ape.file_lines( data, traced ) ) do
+    local pid, syscall, args, ret, err = line:match( syscall_re )
     if not pid then
       pid, syscall, args = line:match( unfinished_re )
       if syscall then
@@ -186,7 +269,7 @@ local function post_process( deps, data, dir )
         syscall = nil -- don't call handler yet below ...
       end
       if not pid then
-        pid, syscall, args, ret = line:match( resumed_re )
+        pid, syscall, args, ret, err = line:match( resumed_re )
         if syscall then
           args = pop_unfinished( unfinished, pid, syscall, args, ret )
           if not args then
@@ -200,7 +283,12 @@ local function post_process( deps, data, dir )
         pdata[ pid ] = { cwd = dir }
         first = false
       end
-      local sh = syscall_handlers[ syscall ]
+      local sh
+      if ret:sub( 1, 1 ) ~= "-" then
+        sh = syscall_handlers[ syscall ]
+      elseif err == "ENOENT" or err == "ENOTDIR" then
+        sh = failure_handlers[ syscall ]
+      end
       if sh then
         sh( tempdeps, pdata, pid, syscall, args, ret )
       end
@@ -215,5 +303,6 @@ return {
   name = "strace",
   pre_process = pre_process,
   post_process = post_process,
+  discard = discard,
 }
 
@@ -95,54 +95,53 @@ local function each_line( file, func, ... )
 end
 
 
-local function handle_write( line, td )
-  local p = base.get_path( ".", line, wupper )
-  if p then
-    td.output[ p ] = true
-  end
+local function handle_write( p, td )
+  td.output[ p ] = true
 end
 
-local function handle_delete( line, td )
-  local p = base.get_path( ".", line, wupper )
-  if p then
-    td.output[ p ] = nil
-  end
+local function handle_delete( p, td )
+  td.output[ p ] = nil
 end
 
-local function handle_read( line, td )
-  local p = base.get_path( ".", line, wupper )
-  if p and not td.output[ p ] then
+local function handle_read( p, td )
+  if not td.output[ p ] then
     td.input[ p ] = true
   end
 end
 
 
+-- normalizes all paths of the matching log files in one go and calls
+-- `func` for the paths inside the project
+local function handle_logs( pattern, func, td )
+  local t = ape.path_glob( pattern )
+  if t then
+    for i = 1, #t do
+      local lines = {}
+      each_line( t[ i ], function( line )
+        lines[ #lines+1 ] = line
+      end )
+      local ps = base.get_paths( ".", lines, wupper )
+      for j = 1, #ps do
+        if ps[ j ] then
+          func( ps[ j ], td )
+        end
+      end
+    end
+  end
+end
+
+
 local function post_process( deps, data )
   local tempdeps = { input = {}, output = {} }
   local loc = os.setlocale()
   os.setlocale( ".ACP" )
   -- scan files in the temp dir
-  local t = ape.path_glob( data .. "/*.write.*.tlog" )
-  if t then
-    for i = 1, #t do
-      each_line( t[ i ], handle_write, tempdeps )
-    end
-  end
-  t = ape.path_glob( data .. "/*.delete.*.tlog" )
-  if t then
-    for i = 1, #t do
-      each_line( t[ i ], handle_delete, tempdeps )
-    end
-  end
-  t = ape.path_glob( data .. "/*.read.*.tlog" )
-  if t then
-    for i = 1, #t do
-      each_line( t[ i ], handle_read, tempdeps )
-    end
-  end
+  handle_logs( data .. "/*.write.*.tlog", handle_write, tempdeps )
+  handle_logs( data .. "/*.delete.*.tlog", handle_delete, tempdeps )
+  handle_logs( data .. "/*.read.*.tlog", handle_read, tempdeps )
   os.setlocale( loc )
   -- remove temp dir
-  t = ape.path_glob( data .. "/*.tlog" )
+  local t = ape.path_glob( data .. "/*.tlog" )
   if t then
     for i = 1, #t do
       os.remove( t[ i ] )